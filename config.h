@@ -24,10 +24,18 @@ typedef struct {
     sensor_ts_t ts;
 } sensor_data_t;
 
+// one slot per possible sensor id, for tables indexed by id
+#define SENSOR_IDS ((size_t) 1 << (8 * sizeof(sensor_id_t)))
+
 #ifndef TIMEOUT
     #define TIMEOUT 10
 #endif
 
+// number of buffer shards, readings of a sensor always go to shard 'id % SHARDS' so they stay in order
+#ifndef SHARDS
+    #define SHARDS 4
+#endif
+
 typedef unsigned int uint;
 
 // stringify preprocessor directives using 2-level preprocessor magic
@@ -1,123 +1,1248 @@
 #include "connmgr.h"
 
 #include "config.h"
+#include "lib/logger.h"
+#include "lib/pool.h"
 #include "lib/tcpsock.h"
+#include "lib/timerwheel.h"
 #include "lib/vector.h"
+#include "protocol.h"
 #include "sbuffer.h"
+#include "shmring.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <time.h>
+#if CONNMGR_IO_URING
+    #include <linux/io_uring.h>
+    #include <poll.h>
+    #include <stdint.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
 #include <unistd.h>
 
-void connmgr_listen(int port_number, sbuffer_t* buffer) {
+// maximum number of readings collected before they are published to the buffer
+#define PUBLISH_BATCH 64
+
+static void publish_pending(sbuffer_t* buffer, sensor_data_t* pending, size_t* count) {
+    if (*count == 0)
+        return;
+    int ret = sbuffer_insert_batch(buffer, pending, *count);
+    assert(ret == SBUFFER_SUCCESS);
+    (void) ret;
+    *count = 0;
+}
+
+// maximum number of ready descriptors handled per wakeup
+#define MAX_EVENTS 64
+
+// bytes a connection reads at once, a whole number of records
+#define RECEIVE_BUFFER (256 * PROTOCOL_RECORD_SIZE)
+
+// datagrams taken in by one recvmmsg call
+#define DATAGRAM_BATCH 32
+
+// largest datagram accepted, a v2 frame of over 200 readings; longer ones are dropped
+#define DATAGRAM_SIZE 4096
+
+// kernel buffer of a datagram socket, datagrams arriving while it is full are lost (capped by net.core.rmem_max)
+#define DATAGRAM_SOCKET_BUFFER (4 << 20)
+
+// whether a connection over its rate limit is paused rather than having readings dropped
+#define THROTTLE_PAUSES (CONNMGR_THROTTLE_PAUSE && (CONNMGR_SENSOR_RATE > 0 || CONNMGR_CONNECTION_RATE > 0))
+
+// slots of the wheel paused connections wait in, one per millisecond: a bucket holds a token again within a second
+#define RESUME_SLOTS 1024
+
+// readings taken out of the shared memory ring between two publishes
+#define LOCAL_BATCH 256
+
+// how long a thread waits before accepting again after running out of descriptors or memory
+#define ACCEPT_RETRY_MS 100
+
+// a sensor connection and the bytes received from it that do not form a whole reading yet
+typedef struct {
+    tcpsock_t* socket;
+    protocol_parser_t parser;
+    wheel_timer_t timer;  // armed for the moment the connection would time out, see expire_sensors
+    wheel_timer_t resume; // armed while paused, for the moment its buckets hold a token again
+    bool closing;         // io_uring: shut down, waiting for its last completion before it is freed
+    bool paused;          // over its rate limit, not read from until the buckets refill
+    _Atomic uint64_t bucket;
+    size_t buffered;
+    char buffer[RECEIVE_BUFFER];
+} connection_t;
+
+static void watch(int epoll_fd, int sd, void* data) {
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+        .data.ptr = data,
+    };
+    ASSERT_ELSE_PERROR(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sd, &event) == 0);
+}
+
+// state all connmgr threads share, everything else is per thread
+typedef struct {
+    sbuffer_t** buffers;
+    size_t shards;
+    _Atomic int64_t last_activity_ms; // last time any thread saw a socket event
+    _Atomic size_t busy;              // threads handling events, they may block on a full buffer for a while
+    atomic_bool stopping;
+    int shutdown_fd; // eventfd that wakes every thread once the server goes idle
+    pool_t* connection_pool;
+    pool_t* datagram_sensor_pool;
+    int record_fd;   // sensor_data_recv, only with DEBUG
+    int64_t start_ms;                  // time zero of the token buckets
+    _Atomic size_t connections;        // open over all threads, at most CONNMGR_MAX_CONNECTIONS
+    _Atomic size_t refused;            // connections closed right away because of that cap
+    _Atomic size_t accept_backoffs;    // times a thread could not accept for lack of descriptors or memory
+    _Atomic uint64_t* sensor_buckets;  // by sensor id, only with a CONNMGR_SENSOR_RATE
+    _Atomic size_t* throttled;         // by sensor id: readings dropped, or pauses, over a rate limit
+    shmring_t* ring;                   // written by sensors on this host, NULL without one
+} connmgr_shared_t;
+
+// a sensor that sends datagrams, without a connection its last reading is all there is to time it out
+typedef struct {
+    wheel_timer_t timer;
+    time_t last_seen;
+    sensor_id_t id;
+} datagram_sensor_t;
+
+typedef struct {
+    struct mmsghdr headers[DATAGRAM_BATCH];
+    struct iovec iovecs[DATAGRAM_BATCH];
+    char data[DATAGRAM_BATCH][DATAGRAM_SIZE];
+} datagram_batch_t;
+
+typedef struct uring uring_t;
+
+typedef struct {
+    connmgr_shared_t* shared;
+    tcpsock_t* connection_socket; // this thread's own listening socket on the shared port
+    tcpsock_t* local_socket;      // the Unix socket for sensors on this host, only the first thread has one
+    timer_wheel_t* timeouts;      // every open connection has its timer armed, so this is also the set of them
+    uring_t* ring;                // NULL when the thread runs on epoll
+    int datagram_sd;              // the UDP socket, only the first thread has one, -1 on the others
+    datagram_batch_t* datagrams;
+    datagram_sensor_t** datagram_sensors; // by sensor id, whatever port a sender uses it reaches this one thread
+    timer_wheel_t* datagram_timeouts;
+    timer_wheel_t* resumes; // the paused connections, in milliseconds of the throttle clock
+    int64_t accept_retry_ms; // when to accept again after running out of descriptors, in the throttle clock, -1 if not waiting
+    int epoll_fd;
+    sensor_data_t (*pending)[PUBLISH_BATCH]; // readings waiting to be published, per shard
+    size_t* pending_count;
+} connmgr_thread_t;
+
+static int64_t monotonic_ms() {
+    struct timespec now;
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// only writes the shared clock when it moved noticeably, so the threads do not fight over its cache line
+static void record_activity(connmgr_shared_t* shared) {
+    int64_t now_ms = monotonic_ms();
+    if (now_ms - atomic_load_explicit(&shared->last_activity_ms, memory_order_relaxed) >= 100)
+        atomic_store_explicit(&shared->last_activity_ms, now_ms, memory_order_relaxed);
+}
+
+// milliseconds since start_ms, the time of the token buckets and of the resumes wheel
+static int64_t throttle_clock(connmgr_shared_t* shared) {
+    return monotonic_ms() - shared->start_ms;
+}
+
+/*
+    A token bucket is one word, so threads sharing the bucket of a sensor id update it with a
+    compare-and-swap: the upper half is when it was last refilled, in milliseconds since
+    start_ms, the lower half the tokens it held then, in thousandths of a reading.
+*/
+static uint64_t bucket_full(uint32_t burst) {
+    return (uint64_t) burst * 1000;
+}
+
+// the tokens of a bucket that was 'old' when it was last updated, refilled up to 'now_ms'
+static uint64_t bucket_tokens(uint64_t old, uint32_t now_ms, uint32_t rate, uint32_t burst) {
+    uint32_t refilled_ms = old >> 32;
+    uint64_t tokens = (uint32_t) old + (uint64_t) (uint32_t) (now_ms - refilled_ms) * rate;
+    return tokens > bucket_full(burst) ? bucket_full(burst) : tokens;
+}
+
+// takes a token for one reading if there is one, 'rate' is in readings per second
+static bool bucket_take(_Atomic uint64_t* bucket, uint32_t now_ms, uint32_t rate, uint32_t burst) {
+    uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+    uint64_t new;
+    do {
+        uint64_t tokens = bucket_tokens(old, now_ms, rate, burst);
+        if (tokens < 1000)
+            return false;
+        new = (uint64_t) now_ms << 32 | (tokens - 1000);
+    } while (!atomic_compare_exchange_weak_explicit(bucket, &old, new, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+// milliseconds until the bucket holds a token, at most a second since 'rate' is at least one reading per second
+static uint32_t bucket_wait_ms(_Atomic uint64_t* bucket, uint32_t now_ms, uint32_t rate, uint32_t burst) {
+    uint64_t tokens = bucket_tokens(atomic_load_explicit(bucket, memory_order_relaxed), now_ms, rate, burst);
+    return tokens >= 1000 ? 0 : (uint32_t) ((1000 - tokens + rate - 1) / rate);
+}
+
+// whether a reading of sensor 'id' fits the rate limits, 'connection' is NULL for a datagram
+static bool admit(connmgr_thread_t* self, connection_t* connection, sensor_id_t id) {
+    if (CONNMGR_SENSOR_RATE == 0 && CONNMGR_CONNECTION_RATE == 0)
+        return true;
+    uint32_t now_ms = (uint32_t) throttle_clock(self->shared);
+    if (CONNMGR_CONNECTION_RATE > 0 && connection != NULL
+        && !bucket_take(&connection->bucket, now_ms, CONNMGR_CONNECTION_RATE, CONNMGR_CONNECTION_BURST))
+        return false;
+    return CONNMGR_SENSOR_RATE == 0
+           || bucket_take(&self->shared->sensor_buckets[id], now_ms, CONNMGR_SENSOR_RATE, CONNMGR_SENSOR_BURST);
+}
+
+// milliseconds until a reading of sensor 'id' that admit() refused may fit the rate limits, at least one
+static uint32_t throttle_delay_ms(connmgr_thread_t* self, connection_t* connection, sensor_id_t id) {
+    uint32_t now_ms = (uint32_t) throttle_clock(self->shared);
+    uint32_t delay_ms = 1;
+    if (CONNMGR_CONNECTION_RATE > 0 && connection != NULL) {
+        uint32_t wait_ms = bucket_wait_ms(&connection->bucket, now_ms, CONNMGR_CONNECTION_RATE, CONNMGR_CONNECTION_BURST);
+        if (wait_ms > delay_ms)
+            delay_ms = wait_ms;
+    }
+    if (CONNMGR_SENSOR_RATE > 0) {
+        uint32_t wait_ms = bucket_wait_ms(&self->shared->sensor_buckets[id], now_ms, CONNMGR_SENSOR_RATE, CONNMGR_SENSOR_BURST);
+        if (wait_ms > delay_ms)
+            delay_ms = wait_ms;
+    }
+    return delay_ms;
+}
+
+static void count_throttled(connmgr_shared_t* shared, sensor_id_t id) {
+    if (atomic_fetch_add_explicit(&shared->throttled[id], 1, memory_order_relaxed) == 0)
+        logger_log(LOGGER_WARNING, "Sensor with id %" PRIu16 " exceeds its rate limit, throttling it\n", id);
+}
+
+static connection_t* connection_of(wheel_timer_t* timer) {
+    return (connection_t*) ((char*) timer - offsetof(connection_t, timer));
+}
+
+static connection_t* paused_connection_of(wheel_timer_t* resume) {
+    return (connection_t*) ((char*) resume - offsetof(connection_t, resume));
+}
+
+// a connection times out once it was silent for more than TIMEOUT seconds
+static time_t timeout_of(connection_t* connection) {
+    return *tcp_last_seen(connection->socket) + TIMEOUT + 1;
+}
+
+static connection_t* connection_create(connmgr_thread_t* self, tcpsock_t* socket, time_t now) {
+    connection_t* connection = pool_alloc(self->shared->connection_pool);
+    assert(connection != NULL);
+    connection->socket = socket;
+    connection->timer.next = NULL;
+    connection->resume.next = NULL;
+    connection->closing = false;
+    connection->paused = false;
+    connection->bucket = bucket_full(CONNMGR_CONNECTION_BURST);
+    connection->buffered = 0;
+    protocol_parser_init(&connection->parser);
+    *tcp_last_seen(socket) = now;
+    timer_wheel_add(self->timeouts, &connection->timer, timeout_of(connection));
+    return connection;
+}
+
+// counts a new connection against CONNMGR_MAX_CONNECTIONS, closes it if there is no room
+static bool admit_connection(connmgr_thread_t* self, tcpsock_t** socket) {
+    connmgr_shared_t* shared = self->shared;
+    if (atomic_fetch_add(&shared->connections, 1) < CONNMGR_MAX_CONNECTIONS)
+        return true;
+    atomic_fetch_sub(&shared->connections, 1);
+    if (atomic_fetch_add_explicit(&shared->refused, 1, memory_order_relaxed) == 0)
+        logger_log(LOGGER_WARNING, "Refusing connections, " TO_STRING(CONNMGR_MAX_CONNECTIONS) " are open already\n");
+    tcp_close(socket);
+    return false;
+}
+
+/**
+ * Accepts the next connection queued on 'listener', skipping those that failed before they could be accepted
+ * Returns false once none is left, or the process ran out of descriptors or memory: the listeners are edge-triggered,
+ * so the connections still queued then are accepted by retry_accepts() once ACCEPT_RETRY_MS passed
+ */
+static bool accept_next(connmgr_thread_t* self, tcpsock_t* listener, tcpsock_t** new_socket) {
+    while (true) {
+        int result = tcp_wait_for_connection(listener, new_socket);
+        if (result == TCP_NO_ERROR)
+            return true;
+        if (result == TCP_WOULD_BLOCK)
+            return false;
+        // the connection was gone before we got to it, or accept() was interrupted: the rest of the queue is fine
+        if (result == TCP_SOCKOP_ERROR && (errno == ECONNABORTED || errno == EINTR || errno == EPROTO || errno == EPERM))
+            continue;
+        // EMFILE, ENFILE, ENOBUFS, ENOMEM: retrying right away would fail the same way
+        if (atomic_fetch_add_explicit(&self->shared->accept_backoffs, 1, memory_order_relaxed) == 0)
+            logger_log(LOGGER_WARNING, "Cannot accept connections (%s), retrying every " TO_STRING(ACCEPT_RETRY_MS) " ms\n",
+                       result == TCP_SOCKOP_ERROR ? strerror(errno) : "out of memory");
+        if (self->accept_retry_ms == -1)
+            self->accept_retry_ms = throttle_clock(self->shared) + ACCEPT_RETRY_MS;
+        return false;
+    }
+}
+
+// closing the descriptor also takes it out of the epoll set
+static void close_connection(connmgr_thread_t* self, connection_t* connection) {
+    timer_wheel_remove(self->resumes, &connection->resume);
+    atomic_fetch_sub(&self->shared->connections, 1);
+    timer_wheel_remove(self->timeouts, &connection->timer);
+    tcp_close(&connection->socket);
+    pool_free(self->shared->connection_pool, connection);
+}
+
+static void retire_connection(connmgr_thread_t* self, connection_t* connection);
+static void accept_connections(connmgr_thread_t* self, tcpsock_t* listener, time_t now);
+static void retry_accepts(connmgr_thread_t* self, time_t now);
+static void resume_connections(connmgr_thread_t* self, time_t now);
+
+static datagram_sensor_t* datagram_sensor_of(wheel_timer_t* timer) {
+    return (datagram_sensor_t*) ((char*) timer - offsetof(datagram_sensor_t, timer));
+}
 
+// activity only updates last_seen, a timer that fires early is simply armed again for the new deadline
+static void expire_sensors(connmgr_thread_t* self, time_t now) {
+    wheel_timer_t* timer;
+    while ((timer = timer_wheel_expire(self->timeouts, now)) != NULL) {
+        connection_t* connection = connection_of(timer);
+        if (now < timeout_of(connection)) {
+            timer_wheel_add(self->timeouts, timer, timeout_of(connection));
+            continue;
+        }
+        logger_log(LOGGER_INFO, "Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(connection->socket));
+        retire_connection(self, connection);
+    }
+    while ((timer = timer_wheel_expire(self->datagram_timeouts, now)) != NULL) {
+        datagram_sensor_t* sensor = datagram_sensor_of(timer);
+        if (now < sensor->last_seen + TIMEOUT + 1) {
+            timer_wheel_add(self->datagram_timeouts, timer, sensor->last_seen + TIMEOUT + 1);
+            continue;
+        }
+        logger_log(LOGGER_INFO, "Sensor with id %" PRIu16 " timed out. \n", sensor->id);
+        self->datagram_sensors[sensor->id] = NULL;
+        pool_free(self->shared->datagram_sensor_pool, sensor);
+    }
+}
+
+// queues 'data' for its shard
+static void handle_reading(connmgr_thread_t* self, const sensor_data_t* data) {
+    connmgr_shared_t* shared = self->shared;
 #if DEBUG
-    const int fd =
-        open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-    assert(fd > 0);
+    // one write per record, so records of different threads do not interleave
+    char record[PROTOCOL_RECORD_SIZE];
+    protocol_encode_v1(record, data);
+    ASSERT_ELSE_PERROR(write(shared->record_fd, record, sizeof(record)) == sizeof(record));
 #endif
+    logger_log(LOGGER_DEBUG, "sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld\n", data->id, data->value, data->ts);
+    size_t shard = data->id % shared->shards;
+    self->pending[shard][self->pending_count[shard]++] = *data;
+    if (self->pending_count[shard] == PUBLISH_BATCH)
+        publish_pending(shared->buffers[shard], self->pending[shard], &self->pending_count[shard]);
+}
 
-    vector_t* sockets = vector_create();
+// parses every complete reading 'connection' has buffered, a partial one waits for the rest of its bytes
+// a reading over the rate limit is dropped, or left in the buffer with the connection paused until its buckets refill
+// returns false if the sensor does not speak the protocol, the connection should be dropped then
+static bool parse_records(connmgr_thread_t* self, connection_t* connection) {
+    tcpsock_t* socket = connection->socket;
+    size_t parsed = 0;
+    protocol_result_t result;
+    do {
+        sensor_data_t data;
+        size_t consumed;
+        protocol_parser_t before = connection->parser;
+        result = protocol_parse(&connection->parser, connection->buffer + parsed, connection->buffered - parsed, &data, &consumed);
+        if (result == PROTOCOL_READING && !admit(self, connection, data.id)) {
+            if (THROTTLE_PAUSES) {
+                // parse it again once there is a token for it
+                connection->parser = before;
+                if (!connection->paused)
+                    count_throttled(self->shared, data.id);
+                connection->paused = true;
+                int64_t resume_ms = throttle_clock(self->shared) + throttle_delay_ms(self, connection, data.id);
+                timer_wheel_add(self->resumes, &connection->resume, resume_ms);
+                break;
+            }
+            count_throttled(self->shared, data.id);
+            parsed += consumed;
+            continue;
+        }
+        parsed += consumed;
+        if (result != PROTOCOL_READING)
+            break;
+        connection->paused = false;
+        if (!socket->announced) {
+            logger_log(LOGGER_INFO, "A new sensor with id = %" PRIu16 " has opened a new connection\n", data.id);
+            socket->announced = true;
+        }
+        *tcp_last_seen_sensor_id(socket) = data.id;
+        handle_reading(self, &data);
+    } while (true);
+    connection->buffered -= parsed;
+    memmove(connection->buffer, connection->buffer + parsed, connection->buffered);
+    if (result == PROTOCOL_MALFORMED)
+        logger_log(LOGGER_WARNING, "Sensor with id %d sent malformed data, dropping it\n", *tcp_last_seen_sensor_id(socket));
+    return result != PROTOCOL_MALFORMED;
+}
 
-    {
-        tcpsock_t* connection_socket = NULL;
-        if (tcp_passive_open(&connection_socket, port_number) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        vector_add(sockets, connection_socket);
-    }
-
-    bool active = true;
-    struct pollfd* fds = NULL;
-    while (active) {
-        fds = realloc(fds, vector_size(sockets) * sizeof(*fds));
-
-        for (size_t i = 0; i < vector_size(sockets); i++) {
-            tcpsock_t* socket = vector_at(sockets, i);
-            fds[i] = (struct pollfd){
-                .fd = socket->sd,
-                .events = POLLIN,
-            };
-        }
-
-        int n = poll(fds, vector_size(sockets), TIMEOUT * 1000);
-        assert(n != -1);
-
-        if (n == 0) {
-            // quit the connmgr (TIMEOUT was reached)
-            printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
-            active = false;
-        } else {
-            // loop over sockets
-            size_t size = vector_size(sockets); // cache up front because some sockets may get added
-            for (size_t i = 0; i < size; i++) {
-                tcpsock_t* socket = vector_at(sockets, i);
-                if (i != 0 && time(NULL) > *tcp_last_seen(socket) + TIMEOUT) {
-                    printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(socket));
-                    tcp_close(&socket);
-                    vector_remove_at_index(sockets, i);
-                    break;
-                } else if ((fds[i].revents & POLLIN) != 0) {
-                    *tcp_last_seen(socket) = time(NULL);
-                    if (i == 0) { // a new sensor is connected
-                        tcpsock_t* new_socket = NULL;
-                        tcp_wait_for_connection(socket, &new_socket);
-                        // this does not invalidate our loop since we only iterate over the original sockets
-                        vector_add(sockets, new_socket);
-                    } else { // data from existing connection is obtained
-                        sensor_data_t data;
-                        int bytes = sizeof(data.id);
-                        tcp_receive(socket, &data.id, &bytes);
-
-                        bytes = sizeof(data.value);
-                        tcp_receive(socket, &data.value, &bytes);
-
-                        bytes = sizeof(data.ts);
-                        const int result = tcp_receive(socket, &data.ts, &bytes);
-
-                        if (!socket->announced) {
-                            printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data.id);
-                            socket->announced = true;
-                        }
-
-                        if ((result == TCP_NO_ERROR) && bytes) {
-                            *tcp_last_seen_sensor_id(socket) = data.id;
-#if DEBUG
-                            ASSERT_ELSE_PERROR(write(fd, &data.id, sizeof(data.id)) == sizeof(data.id));
-                            ASSERT_ELSE_PERROR(write(fd, &data.value, sizeof(data.value)) == sizeof(data.value));
-                            ASSERT_ELSE_PERROR(write(fd, &data.ts, sizeof(data.ts)) == sizeof(data.ts));
+static int open_datagram_socket(int port) {
+    int sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ASSERT_ELSE_PERROR(sd != -1);
+    // there is no flow control: a burst has to fit while the thread waits for room in a buffer
+    int size = DATAGRAM_SOCKET_BUFFER;
+    ASSERT_ELSE_PERROR(setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == 0);
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        perror("bind() of the datagram socket failed");
+        exit(EXIT_FAILURE);
+    }
+    return sd;
+}
+
+static datagram_batch_t* datagram_batch_create() {
+    datagram_batch_t* batch = malloc(sizeof(*batch));
+    assert(batch != NULL);
+    for (size_t i = 0; i < DATAGRAM_BATCH; i++) {
+        batch->iovecs[i] = (struct iovec){.iov_base = batch->data[i], .iov_len = DATAGRAM_SIZE};
+        batch->headers[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &batch->iovecs[i], .msg_iovlen = 1}};
+    }
+    return batch;
+}
+
+static void track_datagram_sensor(connmgr_thread_t* self, sensor_id_t id, time_t now) {
+    datagram_sensor_t* sensor = self->datagram_sensors[id];
+    if (sensor == NULL) {
+        sensor = pool_alloc(self->shared->datagram_sensor_pool);
+        assert(sensor != NULL);
+        sensor->id = id;
+        sensor->timer.next = NULL;
+        timer_wheel_add(self->datagram_timeouts, &sensor->timer, now + TIMEOUT + 1);
+        self->datagram_sensors[id] = sensor;
+        logger_log(LOGGER_INFO, "A new sensor with id = %" PRIu16 " is sending datagrams\n", id);
+    }
+    sensor->last_seen = now;
+}
+
+// a datagram holds whole readings, v1 records or one v2 frame; anything left over makes it malformed
+static void parse_datagram(connmgr_thread_t* self, const char* bytes, size_t size, time_t now) {
+    protocol_parser_t parser;
+    protocol_parser_init(&parser);
+    size_t parsed = 0;
+    protocol_result_t result;
+    sensor_data_t data;
+    size_t consumed;
+    while ((result = protocol_parse(&parser, bytes + parsed, size - parsed, &data, &consumed)) == PROTOCOL_READING) {
+        parsed += consumed;
+        track_datagram_sensor(self, data.id, now);
+        if (admit(self, NULL, data.id))
+            handle_reading(self, &data);
+        else
+            count_throttled(self->shared, data.id);
+    }
+    parsed += consumed;
+    if (result == PROTOCOL_MALFORMED || parsed < size)
+        logger_log(LOGGER_WARNING, "Dropped a malformed datagram\n");
+}
+
+// reads datagrams until the socket is empty, DATAGRAM_BATCH at a time
+static void receive_datagrams(connmgr_thread_t* self, time_t now) {
+    datagram_batch_t* batch = self->datagrams;
+    int n;
+    do {
+        n = recvmmsg(self->datagram_sd, batch->headers, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+        if (n == -1) {
+            ASSERT_ELSE_PERROR(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (batch->headers[i].msg_hdr.msg_flags & MSG_TRUNC)
+                logger_log(LOGGER_WARNING, "Dropped a datagram of more than " TO_STRING(DATAGRAM_SIZE) " bytes\n");
+            else
+                parse_datagram(self, batch->data[i], batch->headers[i].msg_len, now);
+        }
+    } while (n == DATAGRAM_BATCH);
+}
+
+/**
+ * Decides whether the server has been idle for TIMEOUT seconds, in which case it tells the other threads
+ * Otherwise sets 'wait_ms' to how long the event loop may sleep
+ */
+static bool server_is_idle(connmgr_thread_t* self, int* wait_ms) {
+    connmgr_shared_t* shared = self->shared;
+    int64_t idle_until = atomic_load_explicit(&shared->last_activity_ms, memory_order_relaxed) + TIMEOUT * 1000;
+    int64_t now_ms = monotonic_ms();
+    if (now_ms >= idle_until && atomic_load(&shared->busy) == 0) {
+        // quit the connmgr (TIMEOUT was reached), the first thread to notice tells the others
+        if (!atomic_exchange(&shared->stopping, true)) {
+            logger_log(LOGGER_INFO, "No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
+            ASSERT_ELSE_PERROR(eventfd_write(shared->shutdown_fd, 1) == 0);
+        }
+        return true;
+    }
+
+    // while another thread is busy, check back now and then
+    *wait_ms = now_ms < idle_until ? (int) (idle_until - now_ms) : 100;
+    int64_t deadlines_ms[] = {timer_wheel_next_deadline(self->resumes), self->accept_retry_ms};
+    for (size_t i = 0; i < sizeof(deadlines_ms) / sizeof(deadlines_ms[0]); i++) {
+        if (deadlines_ms[i] == -1)
+            continue;
+        int64_t deadline_ms = deadlines_ms[i] - throttle_clock(shared);
+        if (deadline_ms < *wait_ms)
+            *wait_ms = deadline_ms > 0 ? (int) deadline_ms : 0;
+    }
+    time_t now = time(NULL);
+    timer_wheel_t* wheels[] = {self->timeouts, self->datagram_timeouts};
+    for (size_t i = 0; i < sizeof(wheels) / sizeof(wheels[0]); i++) {
+        time_t next_timeout = timer_wheel_next_deadline(wheels[i]);
+        if (next_timeout == -1)
+            continue;
+        int timeout_ms = next_timeout > now ? (int) (next_timeout - now) * 1000 : 0;
+        if (timeout_ms < *wait_ms)
+            *wait_ms = timeout_ms;
+    }
+    return false;
+}
+
+// whether a paused connection is due to be retried
+static bool resumes_due(connmgr_thread_t* self) {
+    time_t next_resume = timer_wheel_next_deadline(self->resumes);
+    return next_resume != -1 && next_resume <= throttle_clock(self->shared);
+}
+
+// whether the listeners are due to be accepted from again after running out of descriptors
+static bool accepts_due(connmgr_thread_t* self) {
+    return self->accept_retry_ms != -1 && self->accept_retry_ms <= throttle_clock(self->shared);
+}
+
+// a thread is busy from the moment it has events, or paused connections to retry, until everything they produced is published
+// retrying a paused connection is no activity by itself, only the readings it then gets admitted are
+static void begin_wakeup(connmgr_thread_t* self, bool events) {
+    atomic_fetch_add(&self->shared->busy, 1);
+    if (events)
+        record_activity(self->shared);
+}
+
+static void end_wakeup(connmgr_thread_t* self, time_t now) {
+    // hand everything this wakeup produced to the buffers in one go
+    bool published = false;
+    for (size_t shard = 0; shard < self->shared->shards; shard++) {
+        published |= self->pending_count[shard] > 0;
+        publish_pending(self->shared->buffers[shard], self->pending[shard], &self->pending_count[shard]);
+    }
+    // only after every ready socket was served
+    expire_sensors(self, now);
+    // publishing may have blocked, the server was not idle during that time
+    if (published)
+        record_activity(self->shared);
+    atomic_fetch_sub(&self->shared->busy, 1);
+}
+
+#if CONNMGR_IO_URING
+/*
+    The io_uring backend keeps one multishot receive in flight per connection. The kernel
+    fills buffers it picks from a ring of provided buffers, so a single io_uring_enter both
+    submits new requests and collects the data of every connection that got some. The data
+    is copied into the connection's receive buffer and parsed like with epoll.
+
+    A completion carries its connection as user_data, so a connection is only freed once its
+    receive completed for the last time: closing one means shutting the socket down first.
+*/
+
+// number of submission queue entries per thread
+    #define URING_ENTRIES 256
+// number of provided receive buffers per thread, a power of two
+    #define URING_BUFFERS 64
+// a provided buffer and a partial record always fit in a connection's receive buffer
+    #define URING_BUFFER_SIZE (RECEIVE_BUFFER - PROTOCOL_RECORD_SIZE)
+    #define URING_BUFFER_GROUP 0
+
+// user_data of the requests that are not a connection's receive, connections are aligned
+    #define URING_ACCEPT 1
+    #define URING_SHUTDOWN 2
+    #define URING_DATAGRAMS 3
+    #define URING_ACCEPT_LOCAL 4
+
+struct uring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_head;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring; // the same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued; // submission entries not handed to the kernel yet
+    struct io_uring_buf_ring* buffers;
+    char* buffer_memory;
+    bool multishot;      // cleared on kernels that reject multishot receives
+    vector_t* closing;   // shut down connections waiting for their last completion
+};
+
+static int uring_enter(uring_t* ring, unsigned wait_for, int timeout_ms) {
+    struct __kernel_timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {.ts = (uint64_t) (uintptr_t) &timeout};
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait_for, flags, &arg, sizeof(arg));
+    if (submitted >= 0) {
+        ring->queued -= submitted;
+        return 0;
+    }
+    ASSERT_ELSE_PERROR(errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN);
+    return -1;
+}
+
+// returns a zeroed submission entry, hand it over with uring_queue
+static struct io_uring_sqe* uring_sqe(uring_t* ring) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        uring_enter(ring, 0, 0);
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_queue(uring_t* ring) {
+    unsigned tail = *ring->sq_tail;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+static void uring_poll(uring_t* ring, int fd, uint64_t user_data, bool multishot) {
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    uring_queue(ring);
+}
+
+static void uring_receive(uring_t* ring, connection_t* connection) {
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->socket->sd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = ring->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->len = ring->multishot ? 0 : URING_BUFFER_SIZE;
+    sqe->user_data = (uint64_t) (uintptr_t) connection;
+    uring_queue(ring);
+}
+
+// gives a provided buffer back to the kernel
+static void uring_recycle(uring_t* ring, unsigned short id) {
+    unsigned short tail = ring->buffers->tail;
+    struct io_uring_buf* buffer = &ring->buffers->bufs[tail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->buffer_memory + (size_t) id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    __atomic_store_n(&ring->buffers->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_destroy(uring_t* ring) {
+    if (ring->buffers != NULL)
+        munmap(ring->buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->closing != NULL)
+        vector_destroy(ring->closing);
+    free(ring->buffer_memory);
+    free(ring);
+}
+
+// returns NULL if the kernel lacks anything the backend needs
+static uring_t* uring_create() {
+    uring_t* ring = calloc(1, sizeof(*ring));
+    assert(ring != NULL);
+    struct io_uring_params params = {0};
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 || (params.features & IORING_FEAT_EXT_ARG) == 0) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ASSERT_ELSE_PERROR(ring->sq_ring != MAP_FAILED);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ASSERT_ELSE_PERROR(ring->cq_ring != MAP_FAILED);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ASSERT_ELSE_PERROR(ring->sqes != MAP_FAILED);
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned*) (sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // the buffer ring has to be page aligned
+    ring->buffers = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_ELSE_PERROR(ring->buffers != MAP_FAILED);
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uint64_t) (uintptr_t) ring->buffers,
+        .ring_entries = URING_BUFFERS,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        uring_destroy(ring);
+        return NULL;
+    }
+    ring->buffer_memory = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    assert(ring->buffer_memory != NULL);
+    for (unsigned short id = 0; id < URING_BUFFERS; id++)
+        uring_recycle(ring, id);
+
+    // a paused connection must have no receive in flight, with multishot it always has one
+    ring->multishot = !THROTTLE_PAUSES;
+    ring->closing = vector_create();
+    return ring;
+}
+
+static void uring_forget_closing(uring_t* ring, connection_t* connection) {
+    for (size_t i = 0; i < vector_size(ring->closing); i++) {
+        if (vector_at(ring->closing, i) == connection) {
+            vector_remove_at_index(ring->closing, i);
+            return;
+        }
+    }
+}
+
+static void uring_complete(connmgr_thread_t* self, struct io_uring_cqe* cqe, time_t now) {
+    uring_t* ring = self->ring;
+    if (cqe->user_data == URING_SHUTDOWN)
+        return; // the loop condition takes care of it
+    if (cqe->user_data == URING_DATAGRAMS) {
+        receive_datagrams(self, now);
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+            uring_poll(ring, self->datagram_sd, URING_DATAGRAMS, true);
+        return;
+    }
+    if (cqe->user_data == URING_ACCEPT || cqe->user_data == URING_ACCEPT_LOCAL) { // new sensors are connected
+        tcpsock_t* listener = cqe->user_data == URING_ACCEPT ? self->connection_socket : self->local_socket;
+        accept_connections(self, listener, now);
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+            uring_poll(ring, listener->sd, cqe->user_data, true);
+        return;
+    }
+
+    connection_t* connection = (connection_t*) (uintptr_t) cqe->user_data;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (cqe->res > 0) {
+        unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!connection->closing) {
+            memcpy(connection->buffer + connection->buffered, ring->buffer_memory + (size_t) id * URING_BUFFER_SIZE, cqe->res);
+            connection->buffered += cqe->res;
+            *tcp_last_seen(connection->socket) = now;
+            if (!parse_records(self, connection))
+                retire_connection(self, connection);
+        }
+        uring_recycle(ring, id);
+    } else if (cqe->res == -EINVAL && ring->multishot && !connection->closing) {
+        // this kernel has no multishot receive, fall back to one receive at a time
+        ring->multishot = false;
+    } else if (cqe->res != -ENOBUFS || connection->closing) {
+        // end of the stream, or an error
+        if (!more) {
+            if (connection->closing) {
+                uring_forget_closing(ring, connection);
+            } else {
+                logger_log(LOGGER_INFO, "Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(connection->socket));
+            }
+            close_connection(self, connection);
+        }
+        return;
+    }
+    // out of provided buffers, or a receive that stopped: ask again
+    if (!more) {
+        if (connection->closing) {
+            uring_forget_closing(ring, connection);
+            close_connection(self, connection);
+        } else if (!connection->paused) {
+            uring_receive(ring, connection);
+        }
+    }
+}
+
+// handles every completion there is, returns how many there were
+static unsigned uring_reap(connmgr_thread_t* self, time_t now) {
+    uring_t* ring = self->ring;
+    unsigned head = *ring->cq_head;
+    unsigned count = 0;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        // free the entry before handling it, handling may submit and thereby complete more
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        uring_complete(self, &cqe, now);
+        count++;
+    }
+    return count;
+}
+
+static bool uring_has_completions(uring_t* ring) {
+    return *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+static void uring_run(connmgr_thread_t* self) {
+    uring_t* ring = self->ring;
+    // accept() runs on the listening socket as before, io_uring only says when to call it
+    uring_poll(ring, self->connection_socket->sd, URING_ACCEPT, true);
+    uring_poll(ring, self->shared->shutdown_fd, URING_SHUTDOWN, false);
+    if (self->datagram_sd >= 0)
+        uring_poll(ring, self->datagram_sd, URING_DATAGRAMS, true);
+    if (self->local_socket != NULL)
+        uring_poll(ring, self->local_socket->sd, URING_ACCEPT_LOCAL, true);
+
+    int wait_ms;
+    while (!atomic_load(&self->shared->stopping) && !server_is_idle(self, &wait_ms)) {
+        uring_enter(ring, 1, wait_ms);
+        bool events = uring_has_completions(ring);
+        if (!events && !resumes_due(self) && !accepts_due(self)) {
+            // another thread may have seen activity in the meantime
+            expire_sensors(self, time(NULL));
+            continue;
+        }
+        begin_wakeup(self, events);
+        time_t now = time(NULL);
+        uring_reap(self, now);
+        resume_connections(self, now);
+        retry_accepts(self, now);
+        end_wakeup(self, now);
+    }
+
+    // shut every connection down and give their receives a moment to complete
+    wheel_timer_t* timer;
+    while ((timer = timer_wheel_pop(self->timeouts)) != NULL)
+        retire_connection(self, connection_of(timer));
+    for (int i = 0; i < 10 && vector_size(ring->closing) > 0; i++) {
+        uring_enter(ring, 1, 100);
+        uring_reap(self, time(NULL));
+    }
+    for (size_t i = 0; i < vector_size(ring->closing); i++) {
+        connection_t* connection = vector_at(ring->closing, i);
+        tcp_close(&connection->socket);
+        pool_free(self->shared->connection_pool, connection);
+    }
+}
+#endif
+
+// takes a connection out of service: right away with epoll, after its last completion with io_uring
+static void retire_connection(connmgr_thread_t* self, connection_t* connection) {
+#if CONNMGR_IO_URING
+    if (self->ring != NULL && !connection->paused) {
+        timer_wheel_remove(self->timeouts, &connection->timer);
+        connection->closing = true;
+        shutdown(connection->socket->sd, SHUT_RDWR);
+        vector_add(self->ring->closing, connection);
+        return;
+    }
+#endif
+    close_connection(self, connection);
+}
+
+// accepts every connection queued on 'listener' and starts reading from them
+static void accept_connections(connmgr_thread_t* self, tcpsock_t* listener, time_t now) {
+    tcpsock_t* new_socket = NULL;
+    while (accept_next(self, listener, &new_socket)) {
+        if (!admit_connection(self, &new_socket))
+            continue;
+#if CONNMGR_IO_URING
+        if (self->ring != NULL) {
+            uring_receive(self->ring, connection_create(self, new_socket, now));
+            continue;
+        }
 #endif
-                            printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld\n", data.id, data.value, data.ts);
-                            sbuffer_lock(buffer);
-                            int ret = sbuffer_insert_first(buffer, &data);
-                            assert(ret == SBUFFER_SUCCESS);
-                            sbuffer_unlock(buffer);
-                        } else if (result == TCP_CONNECTION_CLOSED) {
-                            printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(socket));
-                            tcp_close(&socket);
-                            vector_remove_at_index(sockets, i);
-                            break;
-                        }
-                    }
+        ASSERT_ELSE_PERROR(tcp_set_nonblocking(new_socket, true) == TCP_NO_ERROR);
+        watch(self->epoll_fd, new_socket->sd, connection_create(self, new_socket, now));
+    }
+}
+
+// accepts from both listeners again once the wait after running out of descriptors is over
+static void retry_accepts(connmgr_thread_t* self, time_t now) {
+    if (!accepts_due(self))
+        return;
+    self->accept_retry_ms = -1;
+    accept_connections(self, self->connection_socket, now);
+    if (self->local_socket != NULL)
+        accept_connections(self, self->local_socket, now);
+}
+
+/**
+ * Reads everything 'connection' has for us, a buffer at a time, until the socket is empty
+ * A short read means it is empty and new bytes come with a new edge, unless the peer already hung up:
+ * then 'hung_up' has it read on until the end of the stream
+ */
+static void epoll_serve(connmgr_thread_t* self, connection_t* connection, bool hung_up, time_t now) {
+    tcpsock_t* socket = connection->socket;
+    *tcp_last_seen(socket) = now;
+    bool drained = false;
+    while (!drained) {
+        int bytes = RECEIVE_BUFFER - connection->buffered;
+        const int result = tcp_receive(socket, connection->buffer + connection->buffered, &bytes);
+        if (result == TCP_WOULD_BLOCK || (result == TCP_SOCKOP_ERROR && errno == EINTR))
+            return;
+        if (result != TCP_NO_ERROR) {
+            logger_log(LOGGER_INFO, "Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(socket));
+            close_connection(self, connection);
+            return;
+        }
+        drained = connection->buffered + bytes < RECEIVE_BUFFER && !hung_up;
+        connection->buffered += bytes;
+        if (!parse_records(self, connection)) {
+            close_connection(self, connection);
+            return;
+        }
+        // the rest stays in the socket, so TCP flow control pushes back on the sensor
+        if (connection->paused)
+            return;
+    }
+}
+
+// retries the paused connections whose buckets should hold a token by now, those that fit again are read from as before
+static void resume_connections(connmgr_thread_t* self, time_t now) {
+    int64_t now_ms = throttle_clock(self->shared);
+    wheel_timer_t* resume;
+    // parse_records() arms the timer of a connection it pauses again at least a millisecond ahead, so this ends
+    while ((resume = timer_wheel_expire(self->resumes, now_ms)) != NULL) {
+        connection_t* connection = paused_connection_of(resume);
+        // it has readings waiting, it is not the sensor that went silent
+        *tcp_last_seen(connection->socket) = now;
+        if (!parse_records(self, connection)) {
+            connection->paused = false; // nothing in flight
+            close_connection(self, connection);
+            continue;
+        }
+        if (connection->paused)
+            continue;
+#if CONNMGR_IO_URING
+        if (self->ring != NULL) {
+            uring_receive(self->ring, connection);
+            continue;
+        }
+#endif
+        // bytes, or the end of the stream, may have been waiting without a new edge
+        epoll_serve(self, connection, true, now);
+    }
+}
+
+static void epoll_run(connmgr_thread_t* self) {
+    connmgr_shared_t* shared = self->shared;
+    tcpsock_t* connection_socket = self->connection_socket;
+
+    // every descriptor is registered once, edge-triggered: a wakeup means new bytes, so each one is drained
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_ELSE_PERROR(epoll_fd != -1);
+    self->epoll_fd = epoll_fd;
+    watch(epoll_fd, connection_socket->sd, connection_socket);
+    watch(epoll_fd, shared->shutdown_fd, shared);
+    if (self->datagram_sd >= 0)
+        watch(epoll_fd, self->datagram_sd, &self->datagram_sd);
+    if (self->local_socket != NULL)
+        watch(epoll_fd, self->local_socket->sd, self->local_socket);
+
+    struct epoll_event events[MAX_EVENTS];
+    int wait_ms;
+    while (!atomic_load(&shared->stopping) && !server_is_idle(self, &wait_ms)) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        ASSERT_ELSE_PERROR(n != -1 || errno == EINTR);
+        if (n <= 0 && !resumes_due(self) && !accepts_due(self)) {
+            // another thread may have seen activity in the meantime
+            expire_sensors(self, time(NULL));
+            continue;
+        }
+
+        begin_wakeup(self, n > 0);
+        time_t now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            void* source = events[i].data.ptr;
+            if (source == shared)
+                continue; // shutting down, the loop condition takes care of it
+            if (source == &self->datagram_sd) {
+                receive_datagrams(self, now);
+                continue;
+            }
+            if (source == connection_socket || source == self->local_socket) { // new sensors are connected
+                accept_connections(self, source, now);
+                continue;
+            }
+            // data from an existing connection is obtained, unless it is paused: then it waits in the socket
+            connection_t* connection = source;
+            if (!connection->paused)
+                epoll_serve(self, connection, (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0, now);
+        }
+        resume_connections(self, now);
+        retry_accepts(self, now);
+        end_wakeup(self, now);
+    }
+    close(epoll_fd);
+
+    wheel_timer_t* timer;
+    while ((timer = timer_wheel_pop(self->timeouts)) != NULL)
+        close_connection(self, connection_of(timer));
+}
+
+static void* connmgr_run(void* arg) {
+    connmgr_thread_t* self = arg;
+    size_t shards = self->shared->shards;
+    self->timeouts = timer_wheel_create(2 * (TIMEOUT + 1), time(NULL));
+    self->datagram_timeouts = timer_wheel_create(2 * (TIMEOUT + 1), time(NULL));
+    if (self->datagram_sd >= 0) {
+        self->datagram_sensors = calloc(SENSOR_IDS, sizeof(*self->datagram_sensors));
+        assert(self->datagram_sensors != NULL);
+        self->datagrams = datagram_batch_create();
+    }
+    self->resumes = timer_wheel_create(RESUME_SLOTS, throttle_clock(self->shared));
+    self->pending = malloc(shards * sizeof(*self->pending));
+    self->pending_count = calloc(shards, sizeof(*self->pending_count));
+    assert(self->pending != NULL && self->pending_count != NULL);
+
+#if CONNMGR_IO_URING
+    self->ring = uring_create();
+    if (self->ring != NULL) {
+        uring_run(self);
+        uring_destroy(self->ring);
+    } else {
+        epoll_run(self);
+    }
+#else
+    epoll_run(self);
+#endif
+
+    wheel_timer_t* timer;
+    while ((timer = timer_wheel_pop(self->datagram_timeouts)) != NULL)
+        pool_free(self->shared->datagram_sensor_pool, datagram_sensor_of(timer));
+    free(self->datagram_sensors);
+    free(self->datagrams);
+    timer_wheel_destroy(self->datagram_timeouts);
+    if (self->datagram_sd >= 0)
+        close(self->datagram_sd);
+
+    free(self->pending);
+    free(self->pending_count);
+    timer_wheel_destroy(self->resumes);
+    timer_wheel_destroy(self->timeouts);
+    tcp_close(&self->connection_socket);
+    if (self->local_socket != NULL)
+        tcp_close(&self->local_socket);
+    return NULL;
+}
+
+/*
+    Sensors on this host write their readings into the shared memory ring, this thread takes
+    them out and publishes them like the other threads publish what they receive. A reading
+    over the rate limit is left in the ring while pausing, so the producers find it full; the
+    ring keeps its order, so the sensors behind it wait as well. The thread sleeps until the
+    buckets of that reading hold a token again, and only readings it takes in count as activity.
+*/
+static void* local_run(void* arg) {
+    connmgr_thread_t* self = arg;
+    connmgr_shared_t* shared = self->shared;
+    self->pending = malloc(shared->shards * sizeof(*self->pending));
+    self->pending_count = calloc(shared->shards, sizeof(*self->pending_count));
+    assert(self->pending != NULL && self->pending_count != NULL);
+
+    uint32_t paused_ms = 0; // how long the reading that paused the ring has to wait for a token, 0 while not paused
+    uint64_t abandoned = 0; // slots skipped so far because their producer died before filling them
+    while (!atomic_load(&shared->stopping)) {
+        // a paused ring has readings waiting, so waiting for one would return right away
+        if (paused_ms > 0)
+            nanosleep(&(struct timespec){.tv_sec = paused_ms / 1000, .tv_nsec = (paused_ms % 1000) * 1000000L}, NULL);
+        else
+            shmring_wait(shared->ring, -1);
+        if (shmring_peek(shared->ring) == NULL)
+            continue;
+
+        atomic_fetch_add(&shared->busy, 1);
+        bool was_paused = paused_ms > 0;
+        paused_ms = 0;
+        size_t admitted = 0;
+        const sensor_data_t* data;
+        for (size_t taken = 0; taken < LOCAL_BATCH && (data = shmring_peek(shared->ring)) != NULL; taken++) {
+            if (!admit(self, NULL, data->id)) {
+                if (THROTTLE_PAUSES) {
+                    if (!was_paused)
+                        count_throttled(shared, data->id);
+                    paused_ms = throttle_delay_ms(self, NULL, data->id);
+                    break;
                 }
+                count_throttled(shared, data->id);
+            } else {
+                handle_reading(self, data);
+                admitted++;
             }
+            shmring_consume(shared->ring);
+        }
+        if (shmring_abandoned(shared->ring) > abandoned) {
+            logger_log(LOGGER_WARNING, "Skipped %" PRIu64 " slots of the shared memory ring that a sensor claimed and never filled\n",
+                       shmring_abandoned(shared->ring) - abandoned);
+            abandoned = shmring_abandoned(shared->ring);
         }
+        if (admitted > 0) {
+            record_activity(shared);
+            for (size_t shard = 0; shard < shared->shards; shard++)
+                publish_pending(shared->buffers[shard], self->pending[shard], &self->pending_count[shard]);
+            // publishing may have blocked, the server was not idle during that time
+            record_activity(shared);
+        }
+        atomic_fetch_sub(&shared->busy, 1);
+    }
+
+    free(self->pending);
+    free(self->pending_count);
+    return NULL;
+}
+
+void connmgr_listen(int port_number, sbuffer_t** buffers, size_t shards) {
+    connmgr_shared_t shared = {
+        .buffers = buffers,
+        .shards = shards,
+        .last_activity_ms = monotonic_ms(),
+        .busy = 0,
+        .stopping = false,
+        .shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+        .record_fd = -1,
+        .connection_pool = pool_create(sizeof(connection_t)),
+        .datagram_sensor_pool = pool_create(sizeof(datagram_sensor_t)),
+        .start_ms = monotonic_ms(),
+        .connections = 0,
+        .refused = 0,
+        .accept_backoffs = 0,
+        .throttled = calloc(SENSOR_IDS, sizeof(_Atomic size_t)),
+    };
+    assert(shared.throttled != NULL);
+    if (CONNMGR_SENSOR_RATE > 0) {
+        shared.sensor_buckets = malloc(SENSOR_IDS * sizeof(*shared.sensor_buckets));
+        assert(shared.sensor_buckets != NULL);
+        for (size_t id = 0; id < SENSOR_IDS; id++)
+            shared.sensor_buckets[id] = bucket_full(CONNMGR_SENSOR_BURST);
     }
-    free(fds);
+    ASSERT_ELSE_PERROR(shared.shutdown_fd != -1);
+
 #if DEBUG
-    close(fd);
+    shared.record_fd =
+        open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(shared.record_fd > 0);
 #endif
 
-    for (size_t i = 0; i < vector_size(sockets); i++) {
-        tcpsock_t* socket = vector_at(sockets, i);
-        tcp_close(&socket);
+    // every thread listens on its own socket, the kernel spreads new connections over them (SO_REUSEPORT)
+    // datagrams all go to one socket instead: a sensor's source port may change from one datagram to the next,
+    // and spread over threads the readings of one sensor would be tracked, and could be reordered, by several of them
+    connmgr_thread_t threads[CONNMGR_THREADS];
+    for (size_t i = 0; i < CONNMGR_THREADS; i++) {
+        threads[i] = (connmgr_thread_t){.shared = &shared, .datagram_sd = -1, .accept_retry_ms = -1, .epoll_fd = -1};
+        if (tcp_passive_open_shared(&threads[i].connection_socket, port_number) != TCP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        ASSERT_ELSE_PERROR(tcp_set_nonblocking(threads[i].connection_socket, true) == TCP_NO_ERROR);
+    }
+    threads[0].datagram_sd = open_datagram_socket(port_number);
+
+    // the local transports are a shortcut, the server still runs without them
+    char ring_name[SHMRING_NAME_SIZE];
+    char socket_path[SHMRING_NAME_SIZE];
+    snprintf(ring_name, sizeof(ring_name), SHMRING_NAME_FORMAT, port_number);
+    snprintf(socket_path, sizeof(socket_path), SHMRING_SOCKET_FORMAT, port_number);
+    connmgr_thread_t local = {.shared = &shared};
+    pthread_t local_id;
+    if (CONNMGR_LOCAL) {
+        shared.ring = shmring_create(ring_name);
+        if (shared.ring == NULL)
+            logger_log(LOGGER_WARNING, "Cannot create the shared memory ring %s: %s\n", ring_name, strerror(errno));
+        else
+            ASSERT_ELSE_PERROR(pthread_create(&local_id, NULL, local_run, &local) == 0);
+        if (tcp_passive_open_local(&threads[0].local_socket, socket_path) == TCP_NO_ERROR)
+            ASSERT_ELSE_PERROR(tcp_set_nonblocking(threads[0].local_socket, true) == TCP_NO_ERROR);
+        else
+            logger_log(LOGGER_WARNING, "Cannot listen on the Unix socket %s: %s\n", socket_path, strerror(errno));
     }
-    vector_destroy(sockets);
+
+    pthread_t ids[CONNMGR_THREADS];
+    for (size_t i = 1; i < CONNMGR_THREADS; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&ids[i], NULL, connmgr_run, &threads[i]) == 0);
+    // the calling thread is one of them
+    connmgr_run(&threads[0]);
+    for (size_t i = 1; i < CONNMGR_THREADS; i++)
+        pthread_join(ids[i], NULL);
+    if (shared.ring != NULL) {
+        // the network threads only stopped once the ring was quiet for TIMEOUT seconds as well
+        shmring_wake(shared.ring);
+        pthread_join(local_id, NULL);
+        shmring_close(shared.ring);
+    }
+    if (CONNMGR_LOCAL)
+        unlink(socket_path);
+
+    // who was held back, so a misbehaving sensor can be found
+    for (size_t id = 0; id < SENSOR_IDS; id++) {
+        if (shared.throttled[id] > 0)
+            logger_log(LOGGER_WARNING, "Sensor with id %zu was throttled %zu times\n", id, (size_t) shared.throttled[id]);
+    }
+    if (shared.refused > 0)
+        logger_log(LOGGER_WARNING, "Refused %zu connections over the limit of " TO_STRING(CONNMGR_MAX_CONNECTIONS) "\n", (size_t) shared.refused);
+    if (shared.accept_backoffs > 0)
+        logger_log(LOGGER_WARNING, "Ran out of descriptors or memory accepting connections %zu times\n", (size_t) shared.accept_backoffs);
+    free(shared.throttled);
+    free(shared.sensor_buckets);
+
+    close(shared.shutdown_fd);
+    pool_destroy(shared.connection_pool);
+    pool_destroy(shared.datagram_sensor_pool);
+#if DEBUG
+    close(shared.record_fd);
+#endif
 }
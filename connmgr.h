@@ -14,9 +14,59 @@
 #include <time.h>
 #include <unistd.h>
 
+// number of threads accepting and reading sensor connections, each with its own listening socket
+#ifndef CONNMGR_THREADS
+    #define CONNMGR_THREADS 4
+#endif
+
+// build with -DCONNMGR_IO_URING=0 to always use epoll, otherwise io_uring is used where the kernel supports it
+#ifndef CONNMGR_IO_URING
+    #define CONNMGR_IO_URING 1
+#endif
+
+// connections open at once over all threads, further ones are closed right after accepting them
+#ifndef CONNMGR_MAX_CONNECTIONS
+    #define CONNMGR_MAX_CONNECTIONS 1024
+#endif
+
+// readings per second one sensor id may send, 0 for no limit, with bursts of up to CONNMGR_SENSOR_BURST
+#ifndef CONNMGR_SENSOR_RATE
+    #define CONNMGR_SENSOR_RATE 0
+#endif
+#ifndef CONNMGR_SENSOR_BURST
+    #define CONNMGR_SENSOR_BURST 100
+#endif
+
+// the same for each connection, whatever sensor ids it carries
+#ifndef CONNMGR_CONNECTION_RATE
+    #define CONNMGR_CONNECTION_RATE 0
+#endif
+#ifndef CONNMGR_CONNECTION_BURST
+    #define CONNMGR_CONNECTION_BURST 100
+#endif
+
+// 1: a connection over a limit is not read from until it fits again, so TCP pushes back on the sensor
+// 0: the readings over a limit are dropped; datagrams over a limit are always dropped
+#ifndef CONNMGR_THROTTLE_PAUSE
+    #define CONNMGR_THROTTLE_PAUSE 1
+#endif
+
+// 1: sensors on this host may also write to the shared memory ring SHMRING_NAME_FORMAT, or connect to the
+// Unix socket SHMRING_SOCKET_FORMAT, both named after the port; 0: the server only listens on the network
+#ifndef CONNMGR_LOCAL
+    #define CONNMGR_LOCAL 1
+#endif
+
 /*
     This method holds the core functionality of the connmgr.
     It starts listening on the given port and when when a sensor
     node connects it writes the data to a sensor_data_recv file.
+    Sensors may also send datagrams to the same port (UDP), each holding one or more readings;
+    such a sensor times out like a connection once it stays silent for TIMEOUT seconds.
+    With CONNMGR_LOCAL, readings written to the shared memory ring by sensors on the same host are
+    merged in by a thread of their own, and the Unix socket takes connections like the port does.
+    Readings of sensor 'id' are inserted in buffers[id % shards].
+    It runs CONNMGR_THREADS event loops, the calling thread being one of them, and returns
+    once none of them saw any activity for TIMEOUT seconds.
 */
-void connmgr_listen(int port_number, sbuffer_t* buffer);
+void connmgr_listen(int port_number, sbuffer_t** buffers, size_t shards);
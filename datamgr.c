@@ -4,15 +4,21 @@
 
 #include "datamgr.h"
 
-#include "lib/vector.h"
+#include "lib/logger.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
+#if DATAMGR_SIMD && defined(__x86_64__)
+    #include <immintrin.h>
+#endif
 
 // Definitions for HVAC Control
 
@@ -28,64 +34,696 @@
     #define SET_MAX_TEMP 25
 #endif
 
+// weight of the newest reading in the exponentially weighted moving average, between 0 and 1
+#if !defined EWMA_ALPHA
+    #define EWMA_ALPHA 0.2
+#endif
+
+/*
+    Every statistic is updated in O(1) per reading, whatever RUN_AVG_LENGTH is. The window's
+    mean and sum of squared deviations follow Welford's update, extended to replace the reading
+    that drops out of a full window. Its rounding errors would pile up over a long run, so each
+    time the window's buffer wraps around, the mean and sum of squared deviations are worked
+    out from the buffer afresh, which takes O(1) per reading too. Its minimum and maximum come from monotonic queues: the
+    readings of the window that may still become its extreme, oldest first. A new reading
+    removes every one it beats from the back, so each reading enters and leaves a queue once.
+*/
+
+// reading numbers, oldest first, whose values are candidates for the window minimum or maximum
+typedef struct {
+    uint64_t numbers[RUN_AVG_LENGTH];
+    unsigned head;
+    unsigned size;
+} window_queue_t;
+
+/*
+    Rollups are tumbling windows keyed by the readings' own timestamps. A sensor's watermark
+    is the latest timestamp it reported; a window closes once the watermark is ROLLUP_GRACE
+    seconds past its end. Since the grace is shorter than the window, at most two windows of
+    a length are open at once, the one the watermark is in and the one before it, so every
+    length has two slots and a window goes in the slot given by the parity of its number.
+    Readings of windows that closed already are counted as late and left out.
+*/
+
+static const sensor_ts_t rollup_lengths[] = {ROLLUP_WINDOWS};
+#define ROLLUP_LENGTHS (sizeof(rollup_lengths) / sizeof(*rollup_lengths))
+
+// an open window, the slot is free while 'count' is 0
 typedef struct {
-    uint16_t sensor_id;
-    time_t last_modified;
-    double buffer[RUN_AVG_LENGTH];
-    unsigned count;
-} sensor_t;
+    sensor_ts_t start;
+    uint32_t count;
+    double min;
+    double max;
+    double sum;
+} rollup_slot_t;
+
+typedef struct {
+    rollup_slot_t slots[ROLLUP_LENGTHS][2];
+} sensor_rollups_t;
+
+// sensors seen before the columns first grow
+#define INITIAL_SENSORS 64
+
+// readings the range check classifies at once, one bit each
+#define KERNEL_BATCH 64
+
+// a batch with more readings of one sensor than this is processed one reading at a time
+#if !defined(MAX_ROUNDS)
+    #define MAX_ROUNDS 8
+#endif
+
+/**
+ * Returns a mask with bit i set for every value i of the 'count' values that is outside [SET_MIN_TEMP, SET_MAX_TEMP]
+ */
+typedef uint64_t (*range_kernel_t)(const double* values, size_t count);
+
+/*
+    The means, variances and EWMAs of a batch are updated a vector at a time too. The batch
+    goes in rounds, each taking the first reading left of every sensor in it, so no two lanes
+    of a round share a sensor and every sensor's readings keep their order. A reading whose
+    sensor's window is still filling up is left to the scalar update. A batch whose readings
+    pile up on a few sensors would take about as many rounds as readings, each of them
+    looking at every reading left, so such a batch goes one reading at a time instead.
+*/
+// readings that take the place of the oldest reading of a full window, with their sensors' statistics, side by side
+typedef struct {
+    double value[KERNEL_BATCH];
+    double oldest[KERNEL_BATCH]; // the reading that leaves the window
+    double mean[KERNEL_BATCH];
+    double m2[KERNEL_BATCH];
+    double ewma[KERNEL_BATCH];
+} window_lanes_t;
+
+/**
+ * Updates the mean, m2 and ewma of lanes 'first' up to 'count' for their new value
+ */
+typedef void (*window_kernel_t)(window_lanes_t* lanes, size_t first, size_t count);
+
+/*
+    Other threads read the statistics without ever holding up the data manager: after every
+    reading it publishes the sensor's statistics under a seqlock. The sequence is odd while it
+    writes them, and a reader that sees it odd, or changed by the time it copied them out,
+    simply copies them again. Sensor ids index the published statistics so a reader needs none
+    of the data manager's own bookkeeping.
+*/
+typedef struct {
+    _Atomic uint64_t sequence; // 0 until the sensor's first reading
+    datamgr_sensor_stats_t stats;
+} published_stats_t;
+
+/*
+    The sensors are stored as a structure of arrays: every field is a column of its own, and a
+    sensor is a position in all of them, given out in the order the sensors were first seen.
+    'index' maps every possible sensor id to its position plus one, so 0 is a sensor not seen
+    yet. The index is calloc'd, so only the pages holding ids that are in use are ever backed
+    by memory; the same goes for the other tables with an entry per possible sensor.
+*/
+struct datamgr {
+    uint32_t* index; // SENSOR_IDS entries
+    size_t count;
+    size_t capacity;
+    sensor_id_t* ids;             // SENSOR_IDS entries, it never moves so other threads can walk it
+    _Atomic size_t listed;        // entries of 'ids' other threads may read
+    published_stats_t* published; // SENSOR_IDS entries
+    sensor_ts_t* last_modified;
+    uint64_t* readings;
+    double* mean; // of the window
+    double* m2;   // sum of squared deviations from 'mean' over the window
+    double* ewma;
+    double* window; // RUN_AVG_LENGTH readings per sensor, reading number n at n % RUN_AVG_LENGTH
+    window_queue_t* window_min;
+    window_queue_t* window_max;
+    uint64_t* round; // the last round of a batch that took a reading of the sensor, see also datamgr_duplicates
+    uint64_t rounds;
+    sensor_ts_t* watermark; // latest timestamp of the sensor
+    uint64_t* late;
+    sensor_rollups_t* rollups;
+    range_kernel_t out_of_range;
+    window_kernel_t window_update;
+    datamgr_rollup_sink_t rollup_sink;
+    void* rollup_arg;
+};
+
+static uint64_t window_queue_at(const window_queue_t* queue, unsigned i) {
+    return queue->numbers[(queue->head + i) % RUN_AVG_LENGTH];
+}
+
+/**
+ * Adds reading 'number', which is not in 'buffer' yet, to 'queue'
+ * 'beats' tells whether a value is a better extreme than another one, the older one is dropped on a tie
+ */
+static void window_queue_push(window_queue_t* queue, const double* buffer, uint64_t number, double value, bool (*beats)(double, double)) {
+    // the reading that leaves the window, its buffer slot is about to be overwritten
+    if (queue->size > 0 && number - window_queue_at(queue, 0) >= RUN_AVG_LENGTH) {
+        queue->head = (queue->head + 1) % RUN_AVG_LENGTH;
+        queue->size--;
+    }
+    while (queue->size > 0 && !beats(buffer[window_queue_at(queue, queue->size - 1) % RUN_AVG_LENGTH], value))
+        queue->size--;
+    queue->numbers[(queue->head + queue->size++) % RUN_AVG_LENGTH] = number;
+}
+
+static bool is_lower(double a, double b) {
+    return a < b;
+}
+
+static bool is_higher(double a, double b) {
+    return a > b;
+}
+
+// computes the mean and sum of squared deviations of a full window from its readings, dropping what the updates rounded off
+static void window_resync(datamgr_t* datamgr, size_t sensor) {
+    const double* buffer = &datamgr->window[sensor * RUN_AVG_LENGTH];
+    double sum = 0;
+    for (size_t i = 0; i < RUN_AVG_LENGTH; i++)
+        sum += buffer[i];
+    double mean = sum / RUN_AVG_LENGTH;
+    double m2 = 0;
+    for (size_t i = 0; i < RUN_AVG_LENGTH; i++)
+        m2 += (buffer[i] - mean) * (buffer[i] - mean);
+    datamgr->mean[sensor] = mean;
+    datamgr->m2[sensor] = m2;
+}
+
+// adds 'value' to the window of 'sensor', once its statistics took it in
+static void window_push(datamgr_t* datamgr, size_t sensor, sensor_value_t value) {
+    double* buffer = &datamgr->window[sensor * RUN_AVG_LENGTH];
+    uint64_t number = datamgr->readings[sensor];
+    window_queue_push(&datamgr->window_min[sensor], buffer, number, value, is_lower);
+    window_queue_push(&datamgr->window_max[sensor], buffer, number, value, is_higher);
+    buffer[number % RUN_AVG_LENGTH] = value;
+    datamgr->readings[sensor]++;
+    // every path gets here after the same readings, so batches still match readings one by one to the bit
+    if (datamgr->readings[sensor] % RUN_AVG_LENGTH == 0)
+        window_resync(datamgr, sensor);
+}
+
+// updates the statistics of a sensor whose window is still filling up, the window_kernel_t takes over once it is full
+static void sensor_fill(datamgr_t* datamgr, size_t sensor, sensor_value_t value) {
+    uint64_t number = datamgr->readings[sensor];
+    assert(number < RUN_AVG_LENGTH);
+    double* mean = &datamgr->mean[sensor];
+    double* m2 = &datamgr->m2[sensor];
+    double* ewma = &datamgr->ewma[sensor];
+    double delta = value - *mean;
+    *mean += delta / (number + 1);
+    *m2 += delta * (value - *mean);
+    *ewma = number == 0 ? value : *ewma + EWMA_ALPHA * (value - *ewma);
+    // rounding may leave a window of equal readings slightly below zero
+    if (*m2 < 0)
+        *m2 = 0;
+    window_push(datamgr, sensor, value);
+}
+
+static void sensor_get_stats(const datamgr_t* datamgr, size_t sensor, datamgr_sensor_stats_t* stats) {
+    const double* buffer = &datamgr->window[sensor * RUN_AVG_LENGTH];
+    uint64_t readings = datamgr->readings[sensor];
+    stats->count = readings;
+    stats->window = readings < RUN_AVG_LENGTH ? readings : RUN_AVG_LENGTH;
+    stats->last_modified = datamgr->last_modified[sensor];
+    stats->average = datamgr->mean[sensor];
+    stats->min = buffer[window_queue_at(&datamgr->window_min[sensor], 0) % RUN_AVG_LENGTH];
+    stats->max = buffer[window_queue_at(&datamgr->window_max[sensor], 0) % RUN_AVG_LENGTH];
+    stats->variance = datamgr->m2[sensor] / stats->window;
+    stats->ewma = datamgr->ewma[sensor];
+    stats->late = datamgr->late[sensor];
+}
+
+static void sensor_publish(datamgr_t* datamgr, size_t sensor) {
+    published_stats_t* published = &datamgr->published[datamgr->ids[sensor]];
+    uint64_t sequence = atomic_load_explicit(&published->sequence, memory_order_relaxed);
+    atomic_store_explicit(&published->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sensor_get_stats(datamgr, sensor, &published->stats);
+    atomic_store_explicit(&published->sequence, sequence + 2, memory_order_release);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// start of the window of 'length' that 'ts' falls in, rounding down for timestamps before the epoch too
+static sensor_ts_t window_start(sensor_ts_t ts, sensor_ts_t length) {
+    sensor_ts_t offset = ts % length;
+    return ts - (offset < 0 ? offset + length : offset);
+}
+
+static rollup_slot_t* rollup_slot(datamgr_t* datamgr, size_t sensor, size_t length, sensor_ts_t start) {
+    return &datamgr->rollups[sensor].slots[length][(start / rollup_lengths[length]) & 1];
+}
+
+static void rollup_emit(datamgr_t* datamgr, size_t sensor, size_t length, rollup_slot_t* slot) {
+    datamgr_rollup_t rollup = {
+        .id = datamgr->ids[sensor],
+        .length = rollup_lengths[length],
+        .start = slot->start,
+        .count = slot->count,
+        .min = slot->min,
+        .average = slot->sum / slot->count,
+        .max = slot->max,
+    };
+    datamgr->rollup_sink(&rollup, datamgr->rollup_arg);
+    slot->count = 0;
+}
+
+// emits the windows of the sensor that ended ROLLUP_GRACE before 'until', all of them if 'until' is NULL, the older slot first
+static void rollup_close(datamgr_t* datamgr, size_t sensor, const sensor_ts_t* until) {
+    for (size_t length = 0; length < ROLLUP_LENGTHS; length++) {
+        rollup_slot_t* slots = datamgr->rollups[sensor].slots[length];
+        size_t older = slots[1].start < slots[0].start;
+        for (size_t i = 0; i < 2; i++) {
+            rollup_slot_t* slot = &slots[older ^ i];
+            if (slot->count > 0 && (until == NULL || slot->start + rollup_lengths[length] + ROLLUP_GRACE <= *until))
+                rollup_emit(datamgr, sensor, length, slot);
+        }
+    }
+}
+
+static void rollup_update(datamgr_t* datamgr, size_t sensor, const sensor_data_t* data) {
+    sensor_ts_t* watermark = &datamgr->watermark[sensor];
+    if (data->ts > *watermark) {
+        *watermark = data->ts;
+        rollup_close(datamgr, sensor, watermark);
+    }
+    bool late = false;
+    for (size_t length = 0; length < ROLLUP_LENGTHS; length++) {
+        sensor_ts_t start = window_start(data->ts, rollup_lengths[length]);
+        if (start + rollup_lengths[length] + ROLLUP_GRACE <= *watermark) {
+            late = true;
+            continue;
+        }
+        // any other window in the slot would be closed already, or have made this reading late
+        rollup_slot_t* slot = rollup_slot(datamgr, sensor, length, start);
+        assert(slot->count == 0 || slot->start == start);
+        if (slot->count == 0)
+            *slot = (rollup_slot_t){.start = start, .min = data->value, .max = data->value};
+        slot->count++;
+        slot->sum += data->value;
+        if (data->value < slot->min)
+            slot->min = data->value;
+        if (data->value > slot->max)
+            slot->max = data->value;
+    }
+    datamgr->late[sensor] += late;
+}
+
+static uint64_t out_of_range_scalar(const double* values, size_t count) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < count; i++)
+        mask |= (uint64_t) (values[i] < SET_MIN_TEMP || values[i] > SET_MAX_TEMP) << i;
+    return mask;
+}
+
+#if DATAMGR_SIMD && defined(__x86_64__)
+// SSE2 is part of x86-64, so this one needs no check
+static uint64_t out_of_range_sse2(const double* values, size_t count) {
+    const __m128d min = _mm_set1_pd(SET_MIN_TEMP);
+    const __m128d max = _mm_set1_pd(SET_MAX_TEMP);
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        __m128d outside = _mm_or_pd(_mm_cmplt_pd(v, min), _mm_cmpgt_pd(v, max));
+        mask |= (uint64_t) _mm_movemask_pd(outside) << i;
+    }
+    // a full batch leaves no tail, and shifting by 64 is undefined
+    return i < count ? mask | out_of_range_scalar(values + i, count - i) << i : mask;
+}
 
-static vector_t* sensors = NULL;
+// 256-bit compares of doubles only take AVX, AVX2 adds nothing to them
+__attribute__((target("avx"))) static uint64_t out_of_range_avx(const double* values, size_t count) {
+    const __m256d min = _mm256_set1_pd(SET_MIN_TEMP);
+    const __m256d max = _mm256_set1_pd(SET_MAX_TEMP);
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        __m256d outside = _mm256_or_pd(_mm256_cmp_pd(v, min, _CMP_LT_OQ), _mm256_cmp_pd(v, max, _CMP_GT_OQ));
+        mask |= (uint64_t) _mm256_movemask_pd(outside) << i;
+    }
+    return i < count ? mask | out_of_range_sse2(values + i, count - i) << i : mask;
+}
+#endif
 
-static sensor_value_t sensor_running_average(sensor_t* sensor) {
-    sensor_value_t sum = 0;
-    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-        sum += sensor->buffer[i];
+// the evaluation order matches in every kernel, so they all give the same results to the bit
+static void window_update_scalar(window_lanes_t* lanes, size_t first, size_t count) {
+    for (size_t i = first; i < count; i++) {
+        double value = lanes->value[i];
+        double oldest = lanes->oldest[i];
+        double mean = lanes->mean[i];
+        double new_mean = mean + (value - oldest) / RUN_AVG_LENGTH;
+        double m2 = lanes->m2[i] + (value - oldest) * (value - new_mean + oldest - mean);
+        // rounding may leave a window of equal readings slightly below zero
+        lanes->m2[i] = m2 < 0 ? 0 : m2;
+        lanes->mean[i] = new_mean;
+        lanes->ewma[i] += EWMA_ALPHA * (value - lanes->ewma[i]);
     }
-    return sum / RUN_AVG_LENGTH;
 }
 
-static bool sensor_equals(void* s1, void* s2) {
-    return ((sensor_t*) s1)->sensor_id == ((sensor_t*) s2)->sensor_id;
+#if DATAMGR_SIMD && defined(__x86_64__)
+static void window_update_sse2(window_lanes_t* lanes, size_t first, size_t count) {
+    const __m128d length = _mm_set1_pd(RUN_AVG_LENGTH);
+    const __m128d alpha = _mm_set1_pd(EWMA_ALPHA);
+    const __m128d zero = _mm_setzero_pd();
+    size_t i = first;
+    for (; i + 2 <= count; i += 2) {
+        __m128d value = _mm_loadu_pd(lanes->value + i);
+        __m128d oldest = _mm_loadu_pd(lanes->oldest + i);
+        __m128d mean = _mm_loadu_pd(lanes->mean + i);
+        __m128d ewma = _mm_loadu_pd(lanes->ewma + i);
+        __m128d change = _mm_sub_pd(value, oldest);
+        __m128d new_mean = _mm_add_pd(mean, _mm_div_pd(change, length));
+        __m128d spread = _mm_sub_pd(_mm_add_pd(_mm_sub_pd(value, new_mean), oldest), mean);
+        __m128d m2 = _mm_add_pd(_mm_loadu_pd(lanes->m2 + i), _mm_mul_pd(change, spread));
+        // with 'zero' first a NaN is kept, like the scalar comparison does
+        _mm_storeu_pd(lanes->m2 + i, _mm_max_pd(zero, m2));
+        _mm_storeu_pd(lanes->mean + i, new_mean);
+        _mm_storeu_pd(lanes->ewma + i, _mm_add_pd(ewma, _mm_mul_pd(alpha, _mm_sub_pd(value, ewma))));
+    }
+    window_update_scalar(lanes, i, count);
 }
 
-static sensor_t* datamgr_find_sensor(uint16_t sensor_id) {
-    sensor_t sensor = {.sensor_id = sensor_id};
-    return vector_find(sensors, &sensor, sensor_equals);
+__attribute__((target("avx"))) static void window_update_avx(window_lanes_t* lanes, size_t first, size_t count) {
+    const __m256d length = _mm256_set1_pd(RUN_AVG_LENGTH);
+    const __m256d alpha = _mm256_set1_pd(EWMA_ALPHA);
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = first;
+    for (; i + 4 <= count; i += 4) {
+        __m256d value = _mm256_loadu_pd(lanes->value + i);
+        __m256d oldest = _mm256_loadu_pd(lanes->oldest + i);
+        __m256d mean = _mm256_loadu_pd(lanes->mean + i);
+        __m256d ewma = _mm256_loadu_pd(lanes->ewma + i);
+        __m256d change = _mm256_sub_pd(value, oldest);
+        __m256d new_mean = _mm256_add_pd(mean, _mm256_div_pd(change, length));
+        __m256d spread = _mm256_sub_pd(_mm256_add_pd(_mm256_sub_pd(value, new_mean), oldest), mean);
+        __m256d m2 = _mm256_add_pd(_mm256_loadu_pd(lanes->m2 + i), _mm256_mul_pd(change, spread));
+        _mm256_storeu_pd(lanes->m2 + i, _mm256_max_pd(zero, m2));
+        _mm256_storeu_pd(lanes->mean + i, new_mean);
+        _mm256_storeu_pd(lanes->ewma + i, _mm256_add_pd(ewma, _mm256_mul_pd(alpha, _mm256_sub_pd(value, ewma))));
+    }
+    window_update_sse2(lanes, i, count);
 }
+#endif
 
-void datamgr_init() {
-    sensors = vector_create();
-    assert(sensors);
+// the widest range check this processor runs
+static range_kernel_t pick_range_kernel() {
+#if DATAMGR_SIMD && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        return out_of_range_avx;
+    return out_of_range_sse2;
+#else
+    return out_of_range_scalar;
+#endif
 }
 
-void datamgr_process_reading(const sensor_data_t* data) {
-    sensor_t* obtained_sensor = datamgr_find_sensor(data->id);
-    if (!obtained_sensor) { // sensor with id not found
-        printf("Received sensor data with new sensor node id %d \n", data->id);
+// the widest statistics update this processor runs
+static window_kernel_t pick_window_kernel() {
+#if DATAMGR_SIMD && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        return window_update_avx;
+    return window_update_sse2;
+#else
+    return window_update_scalar;
+#endif
+}
+
+static void* grow(void* column, size_t capacity, size_t size) {
+    column = realloc(column, capacity * size);
+    assert(column);
+    return column;
+}
+
+static void datamgr_grow(datamgr_t* datamgr, size_t capacity) {
+    datamgr->capacity = capacity;
+    datamgr->last_modified = grow(datamgr->last_modified, capacity, sizeof(*datamgr->last_modified));
+    datamgr->readings = grow(datamgr->readings, capacity, sizeof(*datamgr->readings));
+    datamgr->mean = grow(datamgr->mean, capacity, sizeof(*datamgr->mean));
+    datamgr->m2 = grow(datamgr->m2, capacity, sizeof(*datamgr->m2));
+    datamgr->ewma = grow(datamgr->ewma, capacity, sizeof(*datamgr->ewma));
+    datamgr->window = grow(datamgr->window, capacity, RUN_AVG_LENGTH * sizeof(*datamgr->window));
+    datamgr->window_min = grow(datamgr->window_min, capacity, sizeof(*datamgr->window_min));
+    datamgr->window_max = grow(datamgr->window_max, capacity, sizeof(*datamgr->window_max));
+    datamgr->round = grow(datamgr->round, capacity, sizeof(*datamgr->round));
+    datamgr->watermark = grow(datamgr->watermark, capacity, sizeof(*datamgr->watermark));
+    datamgr->late = grow(datamgr->late, capacity, sizeof(*datamgr->late));
+    datamgr->rollups = grow(datamgr->rollups, capacity, sizeof(*datamgr->rollups));
+}
+
+// returns the position of the sensor, -1 if there is none
+static ssize_t datamgr_find_sensor(const datamgr_t* datamgr, sensor_id_t sensor_id) {
+    return (ssize_t) datamgr->index[sensor_id] - 1;
+}
+
+static size_t datamgr_add_sensor(datamgr_t* datamgr, sensor_id_t sensor_id, sensor_ts_t ts) {
+    if (datamgr->count == datamgr->capacity)
+        datamgr_grow(datamgr, 2 * datamgr->capacity);
+    size_t sensor = datamgr->count++;
+    datamgr->ids[sensor] = sensor_id;
+    datamgr->last_modified[sensor] = 0;
+    datamgr->readings[sensor] = 0;
+    datamgr->mean[sensor] = 0;
+    datamgr->m2[sensor] = 0;
+    datamgr->ewma[sensor] = 0;
+    datamgr->window_min[sensor] = (window_queue_t){0};
+    datamgr->window_max[sensor] = (window_queue_t){0};
+    datamgr->round[sensor] = 0;
+    datamgr->watermark[sensor] = ts;
+    datamgr->late[sensor] = 0;
+    datamgr->rollups[sensor] = (sensor_rollups_t){0};
+    datamgr->index[sensor_id] = datamgr->count;
+    atomic_store_explicit(&datamgr->listed, datamgr->count, memory_order_release);
+    return sensor;
+}
+
+datamgr_t* datamgr_init() {
+    datamgr_t* datamgr = calloc(1, sizeof(*datamgr));
+    assert(datamgr);
+    datamgr->index = calloc(SENSOR_IDS, sizeof(*datamgr->index));
+    assert(datamgr->index);
+    datamgr->ids = calloc(SENSOR_IDS, sizeof(*datamgr->ids));
+    assert(datamgr->ids);
+    datamgr->published = calloc(SENSOR_IDS, sizeof(*datamgr->published));
+    assert(datamgr->published);
+    datamgr_grow(datamgr, INITIAL_SENSORS);
+    datamgr->out_of_range = pick_range_kernel();
+    datamgr->window_update = pick_window_kernel();
+    for (size_t length = 0; length < ROLLUP_LENGTHS; length++)
+        assert(rollup_lengths[length] > ROLLUP_GRACE && rollup_lengths[length] <= UINT32_MAX);
+    return datamgr;
+}
+
+void datamgr_set_rollup_sink(datamgr_t* datamgr, datamgr_rollup_sink_t sink, void* arg) {
+    assert(datamgr && datamgr->count == 0);
+    datamgr->rollup_sink = sink;
+    datamgr->rollup_arg = arg;
+}
+
+// returns the position of the sensor that took the reading, adding it if it is new
+static size_t datamgr_sensor(datamgr_t* datamgr, const sensor_data_t* data) {
+    ssize_t obtained_sensor = datamgr_find_sensor(datamgr, data->id);
+    if (obtained_sensor < 0) { // sensor with id not found
+        logger_log(LOGGER_INFO, "Received sensor data with new sensor node id %d \n", data->id);
         // put new sensor in sensor list
-        obtained_sensor = calloc(1, sizeof(*obtained_sensor)); // initialize to zero
-        obtained_sensor->sensor_id = data->id;
-        vector_add(sensors, obtained_sensor);
+        obtained_sensor = datamgr_add_sensor(datamgr, data->id, data->ts);
     }
+    return obtained_sensor;
+}
 
-    obtained_sensor->last_modified = data->ts;
-    obtained_sensor->buffer[obtained_sensor->count % RUN_AVG_LENGTH] = data->value;
-    obtained_sensor->count++;
+// the rest of processing a reading once the statistics of its sensor took it in, 'out_of_range' is what the range check said about it
+static void datamgr_process(datamgr_t* datamgr, size_t obtained_sensor, const sensor_data_t* data, bool out_of_range) {
+    datamgr->last_modified[obtained_sensor] = data->ts;
+    if (datamgr->rollup_sink != NULL)
+        rollup_update(datamgr, obtained_sensor, data);
+    sensor_publish(datamgr, obtained_sensor);
 
-    sensor_value_t running_average = sensor_running_average(obtained_sensor);
-    if (obtained_sensor->count >= RUN_AVG_LENGTH) {
+    if (out_of_range && datamgr->readings[obtained_sensor] >= RUN_AVG_LENGTH) {
         if (data->value < SET_MIN_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n", data->id, data->value);
+            logger_log(LOGGER_WARNING, "Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n", data->id, data->value);
         }
         if (data->value > SET_MAX_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n", data->id, data->value);
+            logger_log(LOGGER_WARNING, "Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n", data->id, data->value);
         }
     }
 }
 
-void datamgr_free() {
-    for (size_t i = 0; i < vector_size(sensors); i++)
-        free(vector_at(sensors, i));
-    vector_destroy(sensors);
+// processes the first of the 'pending' readings of every sensor, returns the readings still pending
+static uint64_t datamgr_process_round(datamgr_t* datamgr, const sensor_data_t* data, const size_t* sensors, uint64_t pending, uint64_t out_of_range) {
+    uint64_t round = ++datamgr->rounds;
+    uint64_t taken = 0;
+    uint64_t vectorised = 0;
+    window_lanes_t lanes;
+    size_t count = 0;
+    for (uint64_t left = pending; left != 0; left &= left - 1) {
+        unsigned i = __builtin_ctzll(left);
+        size_t sensor = sensors[i];
+        if (datamgr->round[sensor] == round)
+            continue;
+        datamgr->round[sensor] = round;
+        taken |= (uint64_t) 1 << i;
+        uint64_t number = datamgr->readings[sensor];
+        if (number < RUN_AVG_LENGTH)
+            continue;
+        vectorised |= (uint64_t) 1 << i;
+        lanes.value[count] = data[i].value;
+        lanes.oldest[count] = datamgr->window[sensor * RUN_AVG_LENGTH + number % RUN_AVG_LENGTH];
+        lanes.mean[count] = datamgr->mean[sensor];
+        lanes.m2[count] = datamgr->m2[sensor];
+        lanes.ewma[count] = datamgr->ewma[sensor];
+        count++;
+    }
+    datamgr->window_update(&lanes, 0, count);
+
+    size_t lane = 0;
+    for (uint64_t left = taken; left != 0; left &= left - 1) {
+        unsigned i = __builtin_ctzll(left);
+        size_t sensor = sensors[i];
+        if ((vectorised >> i) & 1) {
+            datamgr->mean[sensor] = lanes.mean[lane];
+            datamgr->m2[sensor] = lanes.m2[lane];
+            datamgr->ewma[sensor] = lanes.ewma[lane];
+            lane++;
+            window_push(datamgr, sensor, data[i].value);
+        } else {
+            sensor_fill(datamgr, sensor, data[i].value);
+        }
+        datamgr_process(datamgr, sensor, &data[i], (out_of_range >> i) & 1);
+    }
+    return pending & ~taken;
+}
+
+// processes the 'count' readings in order, with the scalar statistics update
+static void datamgr_process_serial(datamgr_t* datamgr, const sensor_data_t* data, const size_t* sensors, size_t count, uint64_t out_of_range) {
+    window_lanes_t lanes;
+    for (size_t i = 0; i < count; i++) {
+        size_t sensor = sensors[i];
+        uint64_t number = datamgr->readings[sensor];
+        if (number < RUN_AVG_LENGTH) {
+            sensor_fill(datamgr, sensor, data[i].value);
+        } else {
+            lanes.value[0] = data[i].value;
+            lanes.oldest[0] = datamgr->window[sensor * RUN_AVG_LENGTH + number % RUN_AVG_LENGTH];
+            lanes.mean[0] = datamgr->mean[sensor];
+            lanes.m2[0] = datamgr->m2[sensor];
+            lanes.ewma[0] = datamgr->ewma[sensor];
+            window_update_scalar(&lanes, 0, 1);
+            datamgr->mean[sensor] = lanes.mean[0];
+            datamgr->m2[sensor] = lanes.m2[0];
+            datamgr->ewma[sensor] = lanes.ewma[0];
+            window_push(datamgr, sensor, data[i].value);
+        }
+        datamgr_process(datamgr, sensor, &data[i], (out_of_range >> i) & 1);
+    }
+}
+
+// the most readings any one sensor has among the 'count' of a batch
+static size_t datamgr_duplicates(datamgr_t* datamgr, const size_t* sensors, size_t count) {
+    // counts up from 'base' in the round column, the rounds that follow start past what it used
+    uint64_t base = datamgr->rounds + 1;
+    datamgr->rounds += count;
+    size_t most = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t* seen = &datamgr->round[sensors[i]];
+        *seen = *seen < base ? base : *seen + 1;
+        if (*seen - base + 1 > most)
+            most = *seen - base + 1;
+    }
+    return most;
+}
+
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data) {
+    datamgr_process_batch(datamgr, data, 1);
+}
+
+void datamgr_process_batch(datamgr_t* datamgr, const sensor_data_t* data, size_t count) {
+    assert(datamgr && (data || count == 0));
+    for (size_t first = 0; first < count; first += KERNEL_BATCH) {
+        size_t n = count - first < KERNEL_BATCH ? count - first : KERNEL_BATCH;
+        // the values side by side, so the range check loads them a vector at a time
+        double values[KERNEL_BATCH];
+        for (size_t i = 0; i < n; i++)
+            values[i] = data[first + i].value;
+        uint64_t out_of_range = datamgr->out_of_range(values, n);
+        size_t sensors[KERNEL_BATCH];
+        for (size_t i = 0; i < n; i++)
+            sensors[i] = datamgr_sensor(datamgr, &data[first + i]);
+        if (datamgr_duplicates(datamgr, sensors, n) > MAX_ROUNDS) {
+            datamgr_process_serial(datamgr, &data[first], sensors, n, out_of_range);
+            continue;
+        }
+        uint64_t pending = n == KERNEL_BATCH ? UINT64_MAX : ((uint64_t) 1 << n) - 1;
+        while (pending != 0)
+            pending = datamgr_process_round(datamgr, &data[first], sensors, pending, out_of_range);
+    }
+}
+
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_sensor_stats_t* stats) {
+    assert(datamgr && stats);
+    ssize_t sensor = datamgr_find_sensor(datamgr, sensor_id);
+    if (sensor < 0)
+        return false;
+    sensor_get_stats(datamgr, sensor, stats);
+    stats->stddev = sqrt(stats->variance);
+    return true;
+}
+
+bool datamgr_snapshot(const datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_sensor_stats_t* stats) {
+    assert(datamgr && stats);
+    published_stats_t* published = &datamgr->published[sensor_id];
+    while (true) {
+        uint64_t sequence = atomic_load_explicit(&published->sequence, memory_order_acquire);
+        if (sequence == 0)
+            return false;
+        if (sequence & 1) {
+            cpu_relax();
+            continue;
+        }
+        *stats = published->stats;
+        // keeps the copy above from moving past the check below
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&published->sequence, memory_order_relaxed) == sequence)
+            break;
+    }
+    stats->stddev = sqrt(stats->variance);
+    return true;
+}
+
+bool datamgr_snapshot_next(const datamgr_t* datamgr, size_t* cursor, sensor_id_t* sensor_id, datamgr_sensor_stats_t* stats) {
+    assert(datamgr && cursor && sensor_id && stats);
+    size_t listed = atomic_load_explicit(&datamgr->listed, memory_order_acquire);
+    while (*cursor < listed) {
+        sensor_id_t id = datamgr->ids[(*cursor)++];
+        // a sensor is listed just before its first statistics are published
+        if (datamgr_snapshot(datamgr, id, stats)) {
+            *sensor_id = id;
+            return true;
+        }
+    }
+    return false;
+}
+
+void datamgr_free(datamgr_t* datamgr) {
+    if (datamgr->rollup_sink != NULL) {
+        for (size_t sensor = 0; sensor < datamgr->count; sensor++)
+            rollup_close(datamgr, sensor, NULL);
+    }
+    free(datamgr->ids);
+    free(datamgr->last_modified);
+    free(datamgr->readings);
+    free(datamgr->mean);
+    free(datamgr->m2);
+    free(datamgr->ewma);
+    free(datamgr->window);
+    free(datamgr->window_min);
+    free(datamgr->window_max);
+    free(datamgr->round);
+    free(datamgr->watermark);
+    free(datamgr->late);
+    free(datamgr->rollups);
+    free(datamgr->index);
+    free(datamgr->published);
+    free(datamgr);
 }
@@ -10,21 +10,108 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// build with -DDATAMGR_SIMD=0 to check and average readings without SSE/AVX, otherwise the widest the processor has is picked
+#ifndef DATAMGR_SIMD
+    #define DATAMGR_SIMD 1
+#endif
+
+// lengths in seconds of the tumbling windows every sensor's readings are rolled up in, aligned to the epoch
+#ifndef ROLLUP_WINDOWS
+    #define ROLLUP_WINDOWS 60, 300, 3600
+#endif
+
+// seconds a window stays open after it ended for readings that arrive late, shorter than every window
+#ifndef ROLLUP_GRACE
+    #define ROLLUP_GRACE 10
+#endif
+
+typedef struct datamgr datamgr_t;
+
+// what a data manager knows about one sensor, the window being its last RUN_AVG_LENGTH readings
+typedef struct {
+    uint64_t count;                // readings so far
+    size_t window;                 // readings in the window, fewer than RUN_AVG_LENGTH at first
+    sensor_ts_t last_modified;     // timestamp of the last reading
+    sensor_value_t average;        // of the readings in the window
+    sensor_value_t min;            // of the readings in the window
+    sensor_value_t max;            // of the readings in the window
+    sensor_value_t variance;       // population variance of the readings in the window
+    sensor_value_t stddev;         // square root of the variance
+    sensor_value_t ewma;           // exponentially weighted moving average over all readings, see EWMA_ALPHA
+    uint64_t late;                 // readings that came after the window they fall in was rolled up, left out of it
+} datamgr_sensor_stats_t;
+
+// summary of the readings of one sensor in one closed tumbling window [start, start + length)
+typedef struct {
+    sensor_id_t id;
+    uint32_t length; // seconds, one of ROLLUP_WINDOWS
+    sensor_ts_t start;
+    uint32_t count;
+    sensor_value_t min;
+    sensor_value_t average;
+    sensor_value_t max;
+} datamgr_rollup_t;
+
 /**
- * Initializes the data manager
+ * Called with every window a data manager closes, on the thread that handed it the reading that closed it
  */
-void datamgr_init();
+typedef void (*datamgr_rollup_sink_t)(const datamgr_rollup_t* rollup, void* arg);
+
+/**
+ * Initializes a data manager, it keeps the state of every sensor it is handed readings of
+ * A data manager is not thread safe: give every thread its own and route each sensor to one of them
+ */
+datamgr_t* datamgr_init();
+
+/**
+ * Has the data manager roll readings up into ROLLUP_WINDOWS and hand every window it closes to 'sink'
+ * A window closes once a reading of its sensor at least ROLLUP_GRACE seconds past its end came in, or when the data manager is freed
+ * Set it before the first reading, without a sink nothing is rolled up
+ */
+void datamgr_set_rollup_sink(datamgr_t* datamgr, datamgr_rollup_sink_t sink, void* arg);
 
 /**
  * processes a single temperature measurement
  */
-void datamgr_process_reading(const sensor_data_t* data);
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data);
+
+/**
+ * Processes 'count' temperature measurements, ending up exactly where datamgr_process_reading() one by one does but faster:
+ * the threshold checks and the mean, variance and EWMA updates of a whole batch run as vector instructions
+ * Every sensor's readings are taken in order, readings of different sensors may be interleaved differently
+ */
+void datamgr_process_batch(datamgr_t* datamgr, const sensor_data_t* data, size_t count);
+
+/**
+ * Fills out 'stats' with the statistics of sensor 'sensor_id', each of them kept up to date in O(1) per reading
+ * \return false if the data manager never got a reading of that sensor
+ */
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_sensor_stats_t* stats);
+
+/**
+ * Fills out 'stats' like datamgr_get_stats(), as of the last reading the data manager finished processing
+ * Unlike the rest of the data manager, this can be called from any thread: it never blocks the thread processing readings,
+ * it only retries if that one updated the sensor while the statistics were copied
+ * \return false if the data manager never got a reading of that sensor
+ */
+bool datamgr_snapshot(const datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_sensor_stats_t* stats);
+
+/**
+ * Walks every sensor of the data manager from any thread, like datamgr_snapshot(), in the order they were first seen
+ * Start with '*cursor' at 0, every call moves it on, sensors first seen during the walk are included
+ * \return false once there are no more sensors, leaving 'sensor_id' and 'stats' alone
+ */
+bool datamgr_snapshot_next(const datamgr_t* datamgr, size_t* cursor, sensor_id_t* sensor_id, datamgr_sensor_stats_t* stats);
 
 /**
  * This method cleans up the datamgr, and frees all used memory.
+ * Windows still open are handed to the rollup sink first, with the readings they got so far.
+ * No other thread may be taking snapshots anymore.
  */
-void datamgr_free();
+void datamgr_free(datamgr_t* datamgr);
@@ -0,0 +1,520 @@
+#include "logger.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+    Every thread that logs owns a single-producer ring, the logger thread is its only consumer.
+    The rings form a list that only grows; a thread that exits leaves its ring behind for the
+    next thread that starts logging, like the caches of lib/pool.
+
+    A record keeps the raw arguments. Both sides walk the format string the same way to know
+    their types: the caller to take them from its va_list, the logger thread to format them.
+*/
+
+// how long the logger thread sleeps after finding every ring empty
+#define LOGGER_IDLE_MS 10
+
+// longest line written, longer ones are cut
+#define LOGGER_LINE 1024
+
+// bytes collected before they are written out
+#define LOGGER_OUTPUT (64 * 1024)
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void* p;
+    size_t text; // offset of a copied string in the record's strings
+} arg_t;
+
+typedef struct {
+    uint64_t sequence;
+    struct timespec time;
+    const char* format;
+    logger_level_t level;
+    arg_t args[LOGGER_MAX_ARGS];
+    char text[LOGGER_TEXT];
+    char* heap; // the strings once they outgrew 'text', freed by the logger thread
+    size_t heap_size;
+} record_t;
+
+typedef struct ring {
+    alignas(64) _Atomic size_t head; // next record the logger thread reads
+    alignas(64) _Atomic size_t tail; // next record the owning thread writes
+    _Atomic size_t dropped;
+    size_t taken;      // logger thread: records of the current batch end here
+    bool orphaned;     // the owning thread exited, guarded by rings_mutex
+    struct ring* next; // never changes once the ring is on the list
+    record_t records[LOGGER_RING_RECORDS];
+} ring_t;
+
+typedef enum { ARG_NONE, ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_TEXT, ARG_POINTER } arg_kind_t;
+
+typedef enum { LENGTH_NONE, LENGTH_HH, LENGTH_H, LENGTH_L, LENGTH_LL, LENGTH_Z, LENGTH_J, LENGTH_T } length_t;
+
+// one conversion of a format string
+typedef struct {
+    const char* start;
+    size_t size;
+    arg_kind_t kind;
+    length_t length;
+} spec_t;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(ring_t*) rings = NULL;
+
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static pthread_t logger_thread;
+static _Atomic int max_level = LOGGER_LEVEL;
+static _Atomic uint64_t next_sequence = 0;
+static _Atomic size_t freed_rings_dropped = 0; // drops counted by the rings logger_shutdown freed
+
+static const char* const level_names[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
+
+// thread exit: leave the ring for the next thread, the logger thread still drains it
+static void ring_orphan(void* arg) {
+    ring_t* ring = arg;
+    pthread_mutex_lock(&rings_mutex);
+    ring->orphaned = true;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void key_create() {
+    int ret = pthread_key_create(&ring_key, ring_orphan);
+    assert(ret == 0);
+    (void) ret;
+}
+
+static ring_t* ring_get() {
+    ring_t* ring = pthread_getspecific(ring_key);
+    if (ring != NULL)
+        return ring;
+
+    pthread_mutex_lock(&rings_mutex);
+    for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        if (ring->orphaned) {
+            ring->orphaned = false;
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = aligned_alloc(alignof(ring_t), sizeof(ring_t));
+        if (ring != NULL) {
+            memset(ring, 0, sizeof(*ring));
+            ring->next = atomic_load(&rings);
+            atomic_store_explicit(&rings, ring, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    if (ring != NULL)
+        pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+// finds the next conversion in 'format', returns where the text after it starts or NULL if there is none
+static const char* next_spec(const char* format, spec_t* spec) {
+    const char* p = strchr(format, '%');
+    if (p == NULL)
+        return NULL;
+    spec->start = p++;
+    p += strspn(p, "-+ #0'");
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+        p++;
+        p += strspn(p, "0123456789");
+    }
+
+    spec->length = LENGTH_NONE;
+    switch (*p) {
+    case 'h':
+        spec->length = p[1] == 'h' ? LENGTH_HH : LENGTH_H;
+        break;
+    case 'l':
+        spec->length = p[1] == 'l' ? LENGTH_LL : LENGTH_L;
+        break;
+    case 'z':
+        spec->length = LENGTH_Z;
+        break;
+    case 'j':
+        spec->length = LENGTH_J;
+        break;
+    case 't':
+        spec->length = LENGTH_T;
+        break;
+    }
+    p += spec->length == LENGTH_HH || spec->length == LENGTH_LL ? 2 : spec->length != LENGTH_NONE;
+
+    switch (*p) {
+    case 'd':
+    case 'i':
+    case 'c':
+        spec->kind = ARG_INT;
+        break;
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+        spec->kind = ARG_UINT;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->kind = ARG_DOUBLE;
+        break;
+    case 's':
+        spec->kind = ARG_TEXT;
+        break;
+    case 'p':
+        spec->kind = ARG_POINTER;
+        break;
+    default: // '%%'
+        assert(*p == '%');
+        spec->kind = ARG_NONE;
+        break;
+    }
+    if (*p != '\0')
+        p++;
+    spec->size = p - spec->start;
+    return p;
+}
+
+static long long read_int(va_list* args, length_t length) {
+    switch (length) {
+    case LENGTH_L:
+        return va_arg(*args, long);
+    case LENGTH_LL:
+        return va_arg(*args, long long);
+    case LENGTH_Z:
+        return va_arg(*args, ssize_t);
+    case LENGTH_J:
+        return va_arg(*args, intmax_t);
+    case LENGTH_T:
+        return va_arg(*args, ptrdiff_t);
+    default: // char and short are promoted to int
+        return va_arg(*args, int);
+    }
+}
+
+static unsigned long long read_uint(va_list* args, length_t length) {
+    switch (length) {
+    case LENGTH_L:
+        return va_arg(*args, unsigned long);
+    case LENGTH_LL:
+        return va_arg(*args, unsigned long long);
+    case LENGTH_Z:
+        return va_arg(*args, size_t);
+    case LENGTH_J:
+        return va_arg(*args, uintmax_t);
+    case LENGTH_T:
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, unsigned);
+    }
+}
+
+// formats one conversion of 'record' with the type the caller passed it as
+static int format_arg(char* out, size_t size, const char* spec, const spec_t* s, const record_t* record, const arg_t* arg) {
+    switch (s->kind) {
+    case ARG_INT:
+        switch (s->length) {
+        case LENGTH_L:
+            return snprintf(out, size, spec, (long) arg->i);
+        case LENGTH_LL:
+            return snprintf(out, size, spec, arg->i);
+        case LENGTH_Z:
+            return snprintf(out, size, spec, (ssize_t) arg->i);
+        case LENGTH_J:
+            return snprintf(out, size, spec, (intmax_t) arg->i);
+        case LENGTH_T:
+            return snprintf(out, size, spec, (ptrdiff_t) arg->i);
+        default:
+            return snprintf(out, size, spec, (int) arg->i);
+        }
+    case ARG_UINT:
+        switch (s->length) {
+        case LENGTH_L:
+            return snprintf(out, size, spec, (unsigned long) arg->u);
+        case LENGTH_LL:
+            return snprintf(out, size, spec, arg->u);
+        case LENGTH_Z:
+            return snprintf(out, size, spec, (size_t) arg->u);
+        case LENGTH_J:
+            return snprintf(out, size, spec, (uintmax_t) arg->u);
+        case LENGTH_T:
+            return snprintf(out, size, spec, (ptrdiff_t) arg->u);
+        default:
+            return snprintf(out, size, spec, (unsigned) arg->u);
+        }
+    case ARG_DOUBLE:
+        return snprintf(out, size, spec, arg->d);
+    case ARG_TEXT:
+        return snprintf(out, size, spec, (record->heap != NULL ? record->heap : record->text) + arg->text);
+    case ARG_POINTER:
+        return snprintf(out, size, spec, arg->p);
+    default:
+        return snprintf(out, size, "%%");
+    }
+}
+
+// writes 'record' as one line: sequence number, time, level and message
+static size_t format_record(char* line, const record_t* record) {
+    struct tm local;
+    localtime_r(&record->time.tv_sec, &local);
+    int used = snprintf(line, LOGGER_LINE, "%" PRIu64 " %02d:%02d:%02d.%03ld %-7s ", record->sequence, local.tm_hour,
+                        local.tm_min, local.tm_sec, record->time.tv_nsec / 1000000, level_names[record->level]);
+
+    const char* format = record->format;
+    const arg_t* arg = record->args;
+    spec_t s;
+    const char* rest;
+    while (used < LOGGER_LINE - 1 && (rest = next_spec(format, &s)) != NULL) {
+        size_t literal = s.start - format;
+        if (literal > (size_t) (LOGGER_LINE - 1 - used))
+            literal = LOGGER_LINE - 1 - used;
+        memcpy(line + used, format, literal);
+        used += literal;
+        char spec[32];
+        snprintf(spec, sizeof(spec), "%.*s", (int) s.size, s.start);
+        int n = format_arg(line + used, LOGGER_LINE - used, spec, &s, record, s.kind == ARG_NONE ? NULL : arg++);
+        used += n > 0 ? n : 0;
+        if (used > LOGGER_LINE - 1)
+            used = LOGGER_LINE - 1;
+        format = rest;
+    }
+    used += snprintf(line + used, LOGGER_LINE - used, "%s", format);
+    if (used > LOGGER_LINE - 2)
+        used = LOGGER_LINE - 2;
+    if (line[used - 1] != '\n')
+        line[used++] = '\n';
+    return used;
+}
+
+static void free_strings(record_t* record) {
+    free(record->heap);
+    record->heap = NULL;
+}
+
+static int by_sequence(const void* a, const void* b) {
+    uint64_t x = (*(const record_t* const*) a)->sequence;
+    uint64_t y = (*(const record_t* const*) b)->sequence;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    record_t** records;
+    size_t capacity;
+    char* output;
+    size_t dropped_reported;
+} batch_t;
+
+// formats and writes everything the rings hold right now, returns the number of records
+static size_t drain(batch_t* batch) {
+    size_t count = 0;
+    for (ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        ring->taken = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (count + (ring->taken - head) > batch->capacity) {
+            batch->capacity = 2 * (count + (ring->taken - head));
+            batch->records = realloc(batch->records, batch->capacity * sizeof(*batch->records));
+            assert(batch->records != NULL);
+        }
+        for (; head != ring->taken; head++)
+            batch->records[count++] = &ring->records[head & (LOGGER_RING_RECORDS - 1)];
+    }
+
+    // the rings are in order each, across threads the sequence numbers decide
+    qsort(batch->records, count, sizeof(*batch->records), by_sequence);
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (used > LOGGER_OUTPUT - LOGGER_LINE) {
+            fwrite(batch->output, 1, used, stdout);
+            used = 0;
+        }
+        used += format_record(batch->output + used, batch->records[i]);
+        free_strings(batch->records[i]);
+    }
+    fwrite(batch->output, 1, used, stdout);
+
+    for (ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next)
+        atomic_store_explicit(&ring->head, ring->taken, memory_order_release);
+
+    size_t dropped = logger_dropped();
+    if (dropped > batch->dropped_reported) {
+        printf("Logger dropped %zu records, %zu in total\n", dropped - batch->dropped_reported, dropped);
+        batch->dropped_reported = dropped;
+    }
+    if (count > 0)
+        fflush(stdout);
+    return count;
+}
+
+static void* logger_run(void* arg) {
+    (void) arg;
+    batch_t batch = {.records = NULL, .capacity = 0, .output = malloc(LOGGER_OUTPUT), .dropped_reported = 0};
+    assert(batch.output != NULL);
+    while (true) {
+        // read before draining: whatever was logged before the stop gets written
+        bool stop = atomic_load(&stopping);
+        if (drain(&batch) > 0)
+            continue;
+        if (stop)
+            break;
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = LOGGER_IDLE_MS * 1000000L};
+        nanosleep(&idle, NULL);
+    }
+    free(batch.records);
+    free(batch.output);
+    return NULL;
+}
+
+void logger_init() {
+    pthread_once(&key_once, key_create);
+    fflush(stdout);
+    atomic_store(&stopping, false);
+    int ret = pthread_create(&logger_thread, NULL, logger_run, NULL);
+    assert(ret == 0);
+    (void) ret;
+    atomic_store(&running, true);
+}
+
+void logger_shutdown() {
+    if (!atomic_exchange(&running, false))
+        return;
+    atomic_store(&stopping, true);
+    pthread_join(logger_thread, NULL);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring_t* ring = atomic_exchange(&rings, NULL);
+    pthread_mutex_unlock(&rings_mutex);
+    // threads still running keep a dangling ring, they must not exit through its destructor
+    pthread_key_delete(ring_key);
+    while (ring != NULL) {
+        ring_t* next = ring->next;
+        atomic_fetch_add(&freed_rings_dropped, atomic_load(&ring->dropped));
+        // records logged after the logger thread stopped are never written
+        for (size_t i = atomic_load(&ring->head); i != atomic_load(&ring->tail); i++)
+            free_strings(&ring->records[i & (LOGGER_RING_RECORDS - 1)]);
+        free(ring);
+        ring = next;
+    }
+}
+
+void logger_set_level(logger_level_t level) {
+    atomic_store_explicit(&max_level, level, memory_order_relaxed);
+}
+
+// copies 'string' behind the 'used' bytes of the record's strings and returns where it went
+// strings that do not fit in the record's text move to the heap, only if that fails they are cut, ending in "..."
+static size_t copy_string(record_t* record, size_t* used, const char* string) {
+    size_t at = *used;
+    size_t length = strlen(string);
+    char* strings = record->heap != NULL ? record->heap : record->text;
+    size_t capacity = record->heap != NULL ? record->heap_size : LOGGER_TEXT;
+    if (at + length + 1 > capacity) {
+        size_t size = 2 * capacity > at + length + 1 ? 2 * capacity : at + length + 1;
+        char* heap = realloc(record->heap, size);
+        if (heap != NULL) {
+            if (record->heap == NULL)
+                memcpy(heap, record->text, at);
+            record->heap = strings = heap;
+            record->heap_size = capacity = size;
+        }
+    }
+    bool cut = at + length + 1 > capacity;
+    if (cut)
+        length = capacity - 1 - at;
+    memcpy(strings + at, string, length);
+    if (cut && length >= 3)
+        memcpy(strings + at + length - 3, "...", 3);
+    strings[at + length] = '\0';
+    // a cut string leaves the last byte for the next one to end in '\0'
+    *used += cut ? length : length + 1;
+    return at;
+}
+
+void logger_log(logger_level_t level, const char* format, ...) {
+    if ((int) level > atomic_load_explicit(&max_level, memory_order_relaxed))
+        return;
+    va_list args;
+    va_start(args, format);
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    // a dropped record still takes a sequence number, so the output shows the gap
+    uint64_t sequence = atomic_fetch_add_explicit(&next_sequence, 1, memory_order_relaxed);
+    ring_t* ring = ring_get();
+    if (ring == NULL) {
+        va_end(args);
+        return;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOGGER_RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    record_t* record = &ring->records[tail & (LOGGER_RING_RECORDS - 1)];
+    record->sequence = sequence;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->format = format;
+    record->level = level;
+    size_t argc = 0;
+    size_t text = 0;
+    spec_t s;
+    for (const char* p = format; (p = next_spec(p, &s)) != NULL;) {
+        if (s.kind == ARG_NONE)
+            continue;
+        assert(argc < LOGGER_MAX_ARGS);
+        arg_t* arg = &record->args[argc++];
+        switch (s.kind) {
+        case ARG_INT:
+            arg->i = read_int(&args, s.length);
+            break;
+        case ARG_UINT:
+            arg->u = read_uint(&args, s.length);
+            break;
+        case ARG_DOUBLE:
+            arg->d = va_arg(args, double);
+            break;
+        case ARG_POINTER:
+            arg->p = va_arg(args, const void*);
+            break;
+        default:
+            arg->text = copy_string(record, &text, va_arg(args, const char*));
+            break;
+        }
+    }
+    va_end(args);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+size_t logger_dropped() {
+    size_t dropped = atomic_load(&freed_rings_dropped);
+    for (ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next)
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    return dropped;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <unistd.h>
+
+/*
+    An asynchronous logger. logger_log() only copies its format string pointer and arguments
+    into a ring of the calling thread, without locks or formatting; a logger thread formats
+    the records of all threads in batches, ordered by sequence number, and writes them out.
+    A full ring drops the record and counts it instead of blocking the caller, the gap in
+    the sequence numbers shows where.
+
+    The format must be a string literal, or live as long as the logger. Every printf
+    conversion works except '*' widths and 'L' long doubles; '%s' arguments are copied, into
+    the record up to LOGGER_TEXT bytes together and to the heap beyond that.
+*/
+
+typedef enum {
+    LOGGER_ERROR,
+    LOGGER_WARNING,
+    LOGGER_INFO,
+    LOGGER_DEBUG,
+} logger_level_t;
+
+// most verbose level written, records above it are discarded before they reach a ring
+#ifndef LOGGER_LEVEL
+    #define LOGGER_LEVEL LOGGER_INFO
+#endif
+
+// records a thread can have waiting for the logger thread, a power of two
+#ifndef LOGGER_RING_RECORDS
+    #define LOGGER_RING_RECORDS 2048
+#endif
+
+#define LOGGER_MAX_ARGS 8
+#define LOGGER_TEXT 128
+
+/**
+ * Starts the logger thread, until then logger_log() writes to stdout directly
+ */
+void logger_init();
+
+/**
+ * Writes out every record still waiting, stops the logger thread and frees the rings
+ * Later calls to logger_log() write to stdout directly, the logger cannot be started again
+ */
+void logger_shutdown();
+
+void logger_set_level(logger_level_t level);
+
+/**
+ * Queues a line formatted like printf(format, ...) for the logger thread
+ */
+void logger_log(logger_level_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Returns how many records were dropped because a ring was full
+ */
+size_t logger_dropped();
@@ -0,0 +1,186 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+    Every block is preceded by a header naming the cache of the thread that allocated it.
+    A cache has a private free list that only its thread touches, and a lock-free stack
+    that other threads push the blocks they free on. The owner takes that whole stack
+    over once its private list runs dry, and only then goes to the heap for a new slab.
+
+    Caches outlive their threads: blocks may still be freed to them afterwards. A thread
+    that exits leaves its cache behind for the next thread that starts using the pool.
+*/
+
+typedef struct cache cache_t;
+
+typedef union header {
+    struct {
+        cache_t* owner;
+        union header* next; // only meaningful while the block is free
+    };
+    max_align_t align;
+} header_t;
+
+struct cache {
+    pool_t* pool;
+    header_t* local;           // only touched by the owning thread
+    _Atomic(header_t*) remote; // pushed on by other threads
+    bool orphaned;             // the owning thread exited, guarded by the pool mutex
+    _Atomic size_t allocations;
+    _Atomic size_t frees;
+    _Atomic size_t remote_frees;
+    _Atomic size_t heap_calls;
+    cache_t* next_cache;
+};
+
+struct pool {
+    size_t block_size; // including the header
+    pthread_key_t key;
+    pthread_mutex_t mutex; // guards the caches and slabs lists, only taken on slow paths
+    cache_t* caches;
+    void** slabs;
+    size_t slab_count;
+};
+
+// thread exit: leave the cache for the next thread, blocks may still come back to it
+static void cache_orphan(void* arg) {
+    cache_t* cache = arg;
+    pthread_mutex_lock(&cache->pool->mutex);
+    cache->orphaned = true;
+    pthread_mutex_unlock(&cache->pool->mutex);
+}
+
+static cache_t* cache_get(pool_t* pool) {
+    cache_t* cache = pthread_getspecific(pool->key);
+    if (cache != NULL)
+        return cache;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (cache = pool->caches; cache != NULL; cache = cache->next_cache) {
+        if (cache->orphaned) {
+            cache->orphaned = false;
+            break;
+        }
+    }
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache != NULL) {
+            cache->pool = pool;
+            cache->next_cache = pool->caches;
+            pool->caches = cache;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (cache != NULL)
+        pthread_setspecific(pool->key, cache);
+    return cache;
+}
+
+// carves a new slab into blocks on the private free list of 'cache'
+static bool cache_refill(pool_t* pool, cache_t* cache) {
+    char* slab = malloc(POOL_SLAB_BLOCKS * pool->block_size);
+    if (slab == NULL)
+        return false;
+    pthread_mutex_lock(&pool->mutex);
+    void** slabs = realloc(pool->slabs, (pool->slab_count + 1) * sizeof(*slabs));
+    if (slabs != NULL) {
+        pool->slabs = slabs;
+        pool->slabs[pool->slab_count++] = slab;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (slabs == NULL) {
+        free(slab);
+        return false;
+    }
+    for (size_t i = 0; i < POOL_SLAB_BLOCKS; i++) {
+        header_t* header = (header_t*) (slab + i * pool->block_size);
+        header->owner = cache;
+        header->next = cache->local;
+        cache->local = header;
+    }
+    atomic_fetch_add_explicit(&cache->heap_calls, 1, memory_order_relaxed);
+    return true;
+}
+
+pool_t* pool_create(size_t block_size) {
+    pool_t* pool = calloc(1, sizeof(*pool));
+    assert(pool);
+    size_t align = alignof(max_align_t);
+    pool->block_size = sizeof(header_t) + (block_size + align - 1) / align * align;
+    int ret = pthread_key_create(&pool->key, cache_orphan);
+    assert(ret == 0);
+    ret = pthread_mutex_init(&pool->mutex, NULL);
+    assert(ret == 0);
+    (void) ret;
+    return pool;
+}
+
+void pool_destroy(pool_t* pool) {
+    if (pool == NULL)
+        return;
+    pthread_key_delete(pool->key);
+    while (pool->caches != NULL) {
+        cache_t* cache = pool->caches;
+        pool->caches = cache->next_cache;
+        free(cache);
+    }
+    for (size_t i = 0; i < pool->slab_count; i++)
+        free(pool->slabs[i]);
+    free(pool->slabs);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void* pool_alloc(pool_t* pool) {
+    assert(pool);
+    cache_t* cache = cache_get(pool);
+    if (cache == NULL)
+        return NULL;
+    if (cache->local == NULL)
+        cache->local = atomic_exchange_explicit(&cache->remote, NULL, memory_order_acquire);
+    if (cache->local == NULL && !cache_refill(pool, cache))
+        return NULL;
+    header_t* header = cache->local;
+    cache->local = header->next;
+    atomic_fetch_add_explicit(&cache->allocations, 1, memory_order_relaxed);
+    return header + 1;
+}
+
+void pool_free(pool_t* pool, void* block) {
+    assert(pool);
+    if (block == NULL)
+        return;
+    header_t* header = (header_t*) block - 1;
+    cache_t* owner = header->owner;
+    atomic_fetch_add_explicit(&owner->frees, 1, memory_order_relaxed);
+    if (owner == pthread_getspecific(pool->key)) {
+        header->next = owner->local;
+        owner->local = header;
+        return;
+    }
+    atomic_fetch_add_explicit(&owner->remote_frees, 1, memory_order_relaxed);
+    header_t* top = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+    do {
+        header->next = top;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote, &top, header, memory_order_release, memory_order_relaxed));
+}
+
+void pool_get_stats(pool_t* pool, pool_stats_t* stats) {
+    assert(pool && stats);
+    *stats = (pool_stats_t){0};
+    pthread_mutex_lock(&pool->mutex);
+    for (cache_t* cache = pool->caches; cache != NULL; cache = cache->next_cache) {
+        stats->allocations += atomic_load_explicit(&cache->allocations, memory_order_relaxed);
+        stats->frees += atomic_load_explicit(&cache->frees, memory_order_relaxed);
+        stats->remote_frees += atomic_load_explicit(&cache->remote_frees, memory_order_relaxed);
+        stats->heap_calls += atomic_load_explicit(&cache->heap_calls, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    stats->in_use = stats->allocations - stats->frees;
+}
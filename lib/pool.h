@@ -0,0 +1,50 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <unistd.h>
+
+// number of blocks carved out of one heap allocation
+#ifndef POOL_SLAB_BLOCKS
+    #define POOL_SLAB_BLOCKS 64
+#endif
+
+/*
+    A pool hands out fixed-size blocks. Every thread allocates from its own free list,
+    so the common path takes no lock. A block freed by another thread goes back to the
+    free list of the thread that allocated it.
+*/
+typedef struct pool pool_t;
+
+typedef struct {
+    size_t allocations;  // blocks handed out
+    size_t frees;        // blocks given back, including remote_frees
+    size_t remote_frees; // blocks given back by a thread other than the one that allocated them
+    size_t heap_calls;   // slabs taken from the heap, stays put once the pool has warmed up
+    size_t in_use;       // blocks currently handed out
+} pool_stats_t;
+
+/**
+ * Creates a pool of blocks of 'block_size' bytes, aligned like malloc
+ */
+pool_t* pool_create(size_t block_size);
+
+/**
+ * Frees every slab of the pool, all blocks must have been given back
+ */
+void pool_destroy(pool_t* pool);
+
+/**
+ * Returns a block from the calling thread's free list, NULL if the heap is exhausted
+ */
+void* pool_alloc(pool_t* pool);
+
+/**
+ * Gives 'block' back to the thread that allocated it, may be called from any thread
+ */
+void pool_free(pool_t* pool, void* block);
+
+void pool_get_stats(pool_t* pool, pool_stats_t* stats);
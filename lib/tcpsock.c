@@ -11,10 +11,14 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -52,8 +56,20 @@
  */
 
 static tcpsock_t* tcp_sock_create();
+static void tcp_sock_free(tcpsock_t* s);
 
-int tcp_passive_open(tcpsock_t** sock, int port) {
+// sockets and their address strings come from pools, so accepting and closing connections stays off the heap
+static pool_t* socket_pool = NULL;
+static pool_t* ip_addr_pool = NULL;
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+
+static void tcp_pools_create() {
+    socket_pool = pool_create(sizeof(tcpsock_t));
+    ip_addr_pool = pool_create(sizeof(char) * CHAR_IP_ADDR_LENGTH);
+}
+
+// 'shared' sets SO_REUSEPORT, see tcp_passive_open_shared()
+static int tcp_passive_open_port(tcpsock_t** sock, int port, bool shared) {
     int result;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
@@ -61,7 +77,14 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
     s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(s->sd < 0, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(s->sd < 0, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    if (shared) {
+        // several sockets may listen on the same port, the kernel spreads the incoming connections over them
+        int reuse = 1;
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -69,10 +92,10 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     addr.sin_port = htons(port);
     result = bind(s->sd, (struct sockaddr*) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
     result = listen(s->sd, MAX_PENDING);
     TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
     s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
     s->port = port;
     s->cookie = MAGIC_COOKIE;
@@ -80,6 +103,48 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     return TCP_NO_ERROR;
 }
 
+int tcp_passive_open(tcpsock_t** sock, int port) {
+    return tcp_passive_open_port(sock, port, false);
+}
+
+int tcp_passive_open_shared(tcpsock_t** sock, int port) {
+    return tcp_passive_open_port(sock, port, true);
+}
+
+// fills out 'addr' for the Unix domain socket 'path', returns false if the path does not fit
+static bool tcp_local_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (path == NULL || strlen(path) >= sizeof(addr->sun_path))
+        return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+int tcp_passive_open_local(tcpsock_t** sock, const char* path) {
+    int result;
+    struct sockaddr_un addr;
+    TCP_ERR_HANDLER(!tcp_local_address(&addr, path), return TCP_ADDRESS_ERROR);
+    tcpsock_t* s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+    s->sd = socket(AF_UNIX, TYPE, 0);
+    TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(s->sd < 0, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    // a socket file outlives its listener, bind() fails while it is there
+    unlink(path);
+    result = bind(s->sd, (struct sockaddr*) &addr, sizeof(addr));
+    TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    result = listen(s->sd, MAX_PENDING);
+    TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    s->ip_addr = NULL;
+    s->port = -1;
+    s->cookie = MAGIC_COOKIE;
+    *sock = s;
+    return TCP_NO_ERROR;
+}
+
 int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     struct sockaddr_in addr;
     tcpsock_t* client;
@@ -92,24 +157,24 @@ int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
     client->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(client->sd < 0, free(client); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(client->sd < 0, tcp_sock_free(client); return TCP_SOCKOP_ERROR);
     /* Construct the server address structure */
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
     result = inet_aton(remote_ip, (struct in_addr*) &addr.sin_addr.s_addr);
-    TCP_ERR_HANDLER(result == 0, free(client); return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(result == 0, close(client->sd); tcp_sock_free(client); return TCP_ADDRESS_ERROR);
     addr.sin_port = htons(remote_port);
     result = connect(client->sd, (struct sockaddr*) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(client->sd); tcp_sock_free(client); return TCP_SOCKOP_ERROR);
     memset(&addr, 0, sizeof(struct sockaddr_in));
     length = sizeof(addr);
     result = getsockname(client->sd, (struct sockaddr*) &addr, (socklen_t*) &length);
     TCP_DEBUG_PRINTF(result == -1, "getsockname() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(client->sd); tcp_sock_free(client); return TCP_SOCKOP_ERROR);
     p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
-    client->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(client->ip_addr == NULL, free(client); return TCP_MEMORY_ERROR);
+    client->ip_addr = (char*) pool_alloc(ip_addr_pool);
+    TCP_ERR_HANDLER(client->ip_addr == NULL, close(client->sd); tcp_sock_free(client); return TCP_MEMORY_ERROR);
     client->ip_addr = strncpy(client->ip_addr, p, CHAR_IP_ADDR_LENGTH);
     client->port = ntohs(addr.sin_port);
     client->cookie = MAGIC_COOKIE;
@@ -117,6 +182,23 @@ int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     return TCP_NO_ERROR;
 }
 
+int tcp_active_open_local(tcpsock_t** sock, const char* path) {
+    int result;
+    struct sockaddr_un addr;
+    TCP_ERR_HANDLER(!tcp_local_address(&addr, path), return TCP_ADDRESS_ERROR);
+    tcpsock_t* client = tcp_sock_create();
+    TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
+    client->sd = socket(AF_UNIX, TYPE, 0);
+    TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(client->sd < 0, tcp_sock_free(client); return TCP_SOCKOP_ERROR);
+    result = connect(client->sd, (struct sockaddr*) &addr, sizeof(addr));
+    TCP_DEBUG_PRINTF(result == -1, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(client->sd); tcp_sock_free(client); return TCP_SOCKOP_ERROR);
+    client->cookie = MAGIC_COOKIE;
+    *sock = client;
+    return TCP_NO_ERROR;
+}
+
 int tcp_close(tcpsock_t** socket) {
     int result;
     if (socket == NULL)
@@ -127,7 +209,7 @@ int tcp_close(tcpsock_t** socket) {
     {
         if ((*socket)->ip_addr != NULL) // then assume memory is allocated and must be freed
         {
-            free((*socket)->ip_addr);
+            pool_free(ip_addr_pool, (*socket)->ip_addr);
         }
         if ((*socket)->sd >= 0) {
             // maybe a connection is still open?
@@ -145,27 +227,35 @@ int tcp_close(tcpsock_t** socket) {
     (*socket)->port = -1;
     (*socket)->sd = -1;
     (*socket)->ip_addr = NULL;
-    free(*socket);
+    tcp_sock_free(*socket);
     *socket = NULL;
     return TCP_NO_ERROR;
 }
 
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
+    struct sockaddr_storage peer;
     struct sockaddr_in addr;
     tcpsock_t* s;
-    unsigned int length = sizeof(struct sockaddr_in);
+    unsigned int length = sizeof(peer);
     char* p;
 
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
     s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
-    s->sd = accept(socket->sd, (struct sockaddr*) &addr, &length);
+    s->sd = accept(socket->sd, (struct sockaddr*) &peer, &length);
+    TCP_ERR_HANDLER(s->sd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK), tcp_sock_free(s); return TCP_WOULD_BLOCK);
     TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(s->sd == -1, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(s->sd == -1, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    if (peer.ss_family != AF_INET) { // a Unix domain socket: no address, no port
+        s->cookie = MAGIC_COOKIE;
+        *new_socket = s;
+        return TCP_NO_ERROR;
+    }
+    memcpy(&addr, &peer, sizeof(addr));
     p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
-    s->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s); return TCP_MEMORY_ERROR);
+    s->ip_addr = (char*) pool_alloc(ip_addr_pool);
+    TCP_ERR_HANDLER(s->ip_addr == NULL, close(s->sd); tcp_sock_free(s); return TCP_MEMORY_ERROR);
     s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
     s->port = ntohs(addr.sin_port);
     s->cookie = MAGIC_COOKIE;
@@ -173,6 +263,33 @@ int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
     return TCP_NO_ERROR;
 }
 
+// turns what send() or writev() returned into a TCP_ error code, '*buf_size' becomes the bytes sent
+static int tcp_send_result(ssize_t sent, int* buf_size) {
+    *buf_size = sent;
+    TCP_DEBUG_PRINTF((*buf_size == 0), "Send() : no connection to peer\n");
+    TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
+    TCP_DEBUG_PRINTF(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))),
+                     "Send() : no connection to peer\n");
+    TCP_ERR_HANDLER(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))), return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER((*buf_size < 0) && (errno == EAGAIN || errno == EWOULDBLOCK), *buf_size = 0; return TCP_WOULD_BLOCK);
+    TCP_DEBUG_PRINTF(*buf_size < 0, "Send() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+// turns what recv() or readv() returned into a TCP_ error code, '*buf_size' becomes the bytes received
+static int tcp_receive_result(ssize_t received, int* buf_size) {
+    *buf_size = received;
+    TCP_DEBUG_PRINTF(*buf_size == 0, "Recv() : no connection to peer\n");
+    TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
+    TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
+    TCP_ERR_HANDLER((*buf_size < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER((*buf_size < 0) && (errno == EAGAIN || errno == EWOULDBLOCK), *buf_size = 0; return TCP_WOULD_BLOCK);
+    TCP_DEBUG_PRINTF(*buf_size < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
 int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -184,15 +301,7 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size) {
     // if socket is not connected, a SIGPIPE signal is sent which terminates the program (default behaviour)
     //*buf_size = sendto(socket->sd, (const void*)buffer,*buf_size, 0, NULL, 0);
     // use MSG_NOSIGNAL flag to avoid a signal to be sent
-    *buf_size = sendto(socket->sd, (const void*) buffer, *buf_size, 0, NULL, 0);
-    TCP_DEBUG_PRINTF((*buf_size == 0), "Send() : no connection to peer\n");
-    TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
-    TCP_DEBUG_PRINTF(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))),
-                     "Send() : no connection to peer\n");
-    TCP_ERR_HANDLER(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))), return TCP_CONNECTION_CLOSED);
-    TCP_DEBUG_PRINTF(*buf_size < 0, "Send() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
-    return TCP_NO_ERROR;
+    return tcp_send_result(sendto(socket->sd, (const void*) buffer, *buf_size, 0, NULL, 0), buf_size);
 }
 
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
@@ -203,13 +312,82 @@ int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
         *buf_size = 0;
         return TCP_NO_ERROR;
     }
-    *buf_size = recv(socket->sd, buffer, *buf_size, 0);
-    TCP_DEBUG_PRINTF(*buf_size == 0, "Recv() : no connection to peer\n");
-    TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
-    TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
-    TCP_ERR_HANDLER((*buf_size < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
-    TCP_DEBUG_PRINTF(*buf_size < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
+    return tcp_receive_result(recv(socket->sd, buffer, *buf_size, 0), buf_size);
+}
+
+// empty buffers would look like a closed connection to the result checks
+static size_t tcp_vec_size(const struct iovec* buffers, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += buffers[i].iov_len;
+    return total;
+}
+
+int tcp_send_vec(tcpsock_t* socket, const struct iovec* buffers, int count, int* buf_size) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(buffers == NULL && count > 0, return TCP_SOCKET_ERROR);
+    if (tcp_vec_size(buffers, count) == 0) { // nothing to send
+        *buf_size = 0;
+        return TCP_NO_ERROR;
+    }
+    // like sendto() in tcp_send(), a connection closed by the peer raises SIGPIPE
+    return tcp_send_result(writev(socket->sd, buffers, count), buf_size);
+}
+
+int tcp_receive_vec(tcpsock_t* socket, const struct iovec* buffers, int count, int* buf_size) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(buffers == NULL && count > 0, return TCP_SOCKET_ERROR);
+    if (tcp_vec_size(buffers, count) == 0) { // nothing to read
+        *buf_size = 0;
+        return TCP_NO_ERROR;
+    }
+    return tcp_receive_result(readv(socket->sd, buffers, count), buf_size);
+}
+
+int tcp_receive_exact(tcpsock_t* socket, void* buffer, int size, int* received) {
+    TCP_ERR_HANDLER(received == NULL || *received < 0 || *received > size, return TCP_SOCKET_ERROR);
+    while (*received < size) {
+        int bytes = size - *received;
+        int result = tcp_receive(socket, (char*) buffer + *received, &bytes);
+        if (result == TCP_SOCKOP_ERROR && errno == EINTR)
+            continue;
+        if (result != TCP_NO_ERROR)
+            return result;
+        *received += bytes;
+    }
+    return TCP_NO_ERROR;
+}
+
+int tcp_set_nonblocking(tcpsock_t* socket, bool nonblocking) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int flags = fcntl(socket->sd, F_GETFL);
+    TCP_DEBUG_PRINTF(flags == -1, "Fcntl() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(flags == -1, return TCP_SOCKOP_ERROR);
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    int result = fcntl(socket->sd, F_SETFL, flags);
+    TCP_DEBUG_PRINTF(result == -1, "Fcntl() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int tcp_set_option(tcpsock_t* socket, tcp_option_t option, int value) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int level, name;
+    switch (option) {
+        case TCP_OPTION_NODELAY: level = IPPROTO_TCP, name = TCP_NODELAY; break;
+        case TCP_OPTION_CORK: level = IPPROTO_TCP, name = TCP_CORK; break;
+        case TCP_OPTION_RCVBUF: level = SOL_SOCKET, name = SO_RCVBUF; break;
+        case TCP_OPTION_SNDBUF: level = SOL_SOCKET, name = SO_SNDBUF; break;
+        case TCP_OPTION_BUSY_POLL: level = SOL_SOCKET, name = SO_BUSY_POLL; break;
+        default: return TCP_SOCKET_ERROR;
+    }
+    int result = setsockopt(socket->sd, level, name, &value, sizeof(value));
+    TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
     return TCP_NO_ERROR;
 }
 
@@ -221,8 +399,15 @@ time_t* tcp_last_seen(tcpsock_t* socket) {
     return &socket->last_seen;
 }
 
+void tcp_get_pool_stats(pool_stats_t* sockets, pool_stats_t* ip_addrs) {
+    pthread_once(&pools_once, tcp_pools_create);
+    pool_get_stats(socket_pool, sockets);
+    pool_get_stats(ip_addr_pool, ip_addrs);
+}
+
 static tcpsock_t* tcp_sock_create() {
-    tcpsock_t* s = (tcpsock_t*) malloc(sizeof(tcpsock_t));
+    pthread_once(&pools_once, tcp_pools_create);
+    tcpsock_t* s = (tcpsock_t*) pool_alloc(socket_pool);
     if (s) {           // init the socket to default values
         s->cookie = 0; // socket is not yet bound!
         s->port = -1;
@@ -234,3 +419,7 @@ static tcpsock_t* tcp_sock_create() {
     }
     return s;
 }
+
+static void tcp_sock_free(tcpsock_t* s) {
+    pool_free(socket_pool, s);
+}
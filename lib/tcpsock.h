@@ -11,7 +11,10 @@
     #define _GNU_SOURCE
 #endif
 
+#include "pool.h"
+
 #include <stdbool.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define MIN_PORT 1024
@@ -23,9 +26,19 @@
 #define TCP_SOCKOP_ERROR 3      // socket operator (socket, listen, bind, accept,...) error
 #define TCP_CONNECTION_CLOSED 4 // send/receive indicate connection is closed
 #define TCP_MEMORY_ERROR 5      // mem alloc error
+#define TCP_WOULD_BLOCK 6       // a non-blocking socket has nothing to receive, or no room to send, right now
 #define CHAR_IP_ADDR_LENGTH 16  // 4 numbers of 3 digits, 3 dots and \0
 #define MAX_PENDING 10
 
+// socket options tcp_set_option() can change
+typedef enum {
+    TCP_OPTION_NODELAY,   // 1: send small segments right away instead of coalescing them (Nagle)
+    TCP_OPTION_CORK,      // 1: hold back partial segments until it is set to 0 again
+    TCP_OPTION_RCVBUF,    // bytes the kernel buffers for receiving, it may double them
+    TCP_OPTION_SNDBUF,    // bytes the kernel buffers for sending, it may double them
+    TCP_OPTION_BUSY_POLL, // microseconds a receive busy-polls the device queue before it sleeps, 0 for never
+} tcp_option_t;
+
 struct tcpsock {
     long cookie; /**< if the socket is bound, cookie should be equal to MAGIC_COOKIE */
     // remark: the use of magic cookies doesn't guarantee a 'bullet proof' test
@@ -52,6 +65,24 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t** socket, int port);
 
+/**
+ * Like tcp_passive_open(), but with SO_REUSEPORT, so several sockets of this process can listen on the same port
+ * The kernel then spreads the incoming connections over them; any other process of the same user may join in as well
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_shared(tcpsock_t** socket, int port);
+
+/**
+ * Like tcp_passive_open(), but listens on the Unix domain socket 'path' instead of a port, for processes on the same host
+ * A file left at 'path' by an earlier listener is removed first, the caller removes it again once it is done
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param path the file system path of the socket, shorter than sizeof(sockaddr_un.sun_path)
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_local(tcpsock_t** socket, const char* path);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -67,6 +98,15 @@ int tcp_passive_open(tcpsock_t** socket, int port);
  */
 int tcp_active_open(tcpsock_t** socket, int remote_port, char* remote_ip);
 
+/**
+ * Like tcp_active_open(), but connects to the Unix domain socket 'path' of a server on the same host
+ * The socket has no IP address and port number
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param path the file system path of the socket
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_active_open_local(tcpsock_t** socket, const char* path);
+
 /**
  * The socket '*socket' is closed , allocated resources are freed and '*socket' is set to NULL
  * If '*socket' is connected, a TCP shutdown on the connection is executed
@@ -81,6 +121,7 @@ int tcp_close(tcpsock_t** socket);
  * Puts the socket 'socket' in a blocking wait mode
  * Returns when an incoming TCP connection setup request is received
  * A newly created socket identifying the remote system that initiated the connection request is returned as '*new_socket'
+ * A connection to a Unix domain socket has no IP address and port number
  * If memory allocation for the new socket fails, TCP_MEMORY_ERROR is returned
  * If a socket operation (socket, listen, bind, accept, ...) fails, TCP_SOCKOP_ERROR is returned
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
@@ -114,6 +155,65 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
  */
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size);
 
+/**
+ * Like tcp_send(), but sends the 'count' buffers of 'buffers' one after the other with a single system call (writev)
+ * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than their total
+ * If the socket is non-blocking and there is no room to send anything, TCP_WOULD_BLOCK is returned
+ * \param socket the socket where the data needs to be sent on
+ * \param buffers the buffers that hold the data that needs to be sent
+ * \param count the number of buffers, at most IOV_MAX
+ * \param buf_size set to the amount of bytes that were sent
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_send_vec(tcpsock_t* socket, const struct iovec* buffers, int count, int* buf_size);
+
+/**
+ * Like tcp_receive(), but fills the 'count' buffers of 'buffers' one after the other with a single system call (readv)
+ * The function sets '*buf_size' to the number of bytes that were really received, which might be less than their total
+ * If the socket is non-blocking and there is nothing to receive, TCP_WOULD_BLOCK is returned
+ * \param socket the socket where the data needs to be received from
+ * \param buffers the buffers that can store the data that is received
+ * \param count the number of buffers, at most IOV_MAX
+ * \param buf_size set to the amount of bytes that were received
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_receive_vec(tcpsock_t* socket, const struct iovec* buffers, int count, int* buf_size);
+
+/**
+ * Receives until 'buffer' holds exactly 'size' bytes, unlike tcp_receive() a short read is not the end of it
+ * '*received' counts the bytes 'buffer' holds already: a call that returns TCP_WOULD_BLOCK on a non-blocking socket
+ * leaves it at the bytes received so far, and calling again once there is more to read picks up from there
+ * If the connection is closed before all bytes arrived, TCP_CONNECTION_CLOSED is returned
+ * \param socket the socket where the data needs to be received from
+ * \param buffer a pointer to the buffer that can store 'size' bytes
+ * \param size the amount of bytes to receive in total
+ * \param received the amount of bytes in 'buffer' already, updated with what was received
+ * \return TCP_NO_ERROR once 'buffer' holds 'size' bytes
+ */
+int tcp_receive_exact(tcpsock_t* socket, void* buffer, int size, int* received);
+
+/**
+ * Switches 'socket' between blocking and non-blocking mode
+ * In non-blocking mode, a send, receive or wait for a connection that would have to wait returns TCP_WOULD_BLOCK
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the socket to change
+ * \param nonblocking true for non-blocking mode, false for blocking mode
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_nonblocking(tcpsock_t* socket, bool nonblocking);
+
+/**
+ * Sets socket option 'option' of 'socket' to 'value', see tcp_option_t
+ * TCP_OPTION_NODELAY and TCP_OPTION_CORK only apply to TCP connections, not to Unix domain sockets
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If the kernel refuses the option, for instance a busy-poll time above net.core.busy_poll without CAP_NET_ADMIN, TCP_SOCKOP_ERROR is returned
+ * \param socket the socket to change
+ * \param option the option to set
+ * \param value the new value of the option
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_option(tcpsock_t* socket, tcp_option_t option, int value);
+
 /**
  * Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
  * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
@@ -144,3 +244,10 @@ int tcp_get_sd(tcpsock_t* socket, int* sd);
 
 int* tcp_last_seen_sensor_id(tcpsock_t* socket);
 time_t* tcp_last_seen(tcpsock_t* socket);
+
+/**
+ * Fills out the statistics of the pools sockets and their IP address strings are allocated from
+ * \param sockets filled out with the statistics of the socket pool
+ * \param ip_addrs filled out with the statistics of the IP address pool
+ */
+void tcp_get_pool_stats(pool_stats_t* sockets, pool_stats_t* ip_addrs);
@@ -0,0 +1,130 @@
+#include "timerwheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct timer_wheel {
+    wheel_timer_t* slots; // list heads, a timer goes in slot 'deadline & mask'
+    size_t mask;
+    time_t current; // every timer due before this tick has been expired
+    size_t count;
+    time_t earliest;     // the earliest deadline of all armed timers, while 'earliest_known'
+    bool earliest_known; // cleared when the timer with the earliest deadline goes, the next timer_wheel_next_deadline() looks for it
+};
+
+static bool slot_is_empty(wheel_timer_t* head) {
+    return head->next == head;
+}
+
+timer_wheel_t* timer_wheel_create(size_t slots, time_t now) {
+    timer_wheel_t* wheel = malloc(sizeof(*wheel));
+    assert(wheel);
+    size_t size = 1;
+    while (size < slots)
+        size <<= 1;
+    wheel->slots = malloc(size * sizeof(*wheel->slots));
+    assert(wheel->slots);
+    for (size_t i = 0; i < size; i++)
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+    wheel->mask = size - 1;
+    wheel->current = now;
+    wheel->count = 0;
+    wheel->earliest_known = false;
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+    if (wheel == NULL)
+        return;
+    free(wheel->slots);
+    free(wheel);
+}
+
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, time_t deadline) {
+    assert(wheel && timer);
+    // a deadline in the past expires on the next call to timer_wheel_expire
+    if (deadline < wheel->current)
+        deadline = wheel->current;
+    timer->deadline = deadline;
+    wheel_timer_t* head = &wheel->slots[deadline & wheel->mask];
+    timer->prev = head;
+    timer->next = head->next;
+    head->next->prev = timer;
+    head->next = timer;
+    if (wheel->count == 0 || (wheel->earliest_known && deadline < wheel->earliest)) {
+        wheel->earliest = deadline;
+        wheel->earliest_known = true;
+    }
+    wheel->count++;
+}
+
+void timer_wheel_remove(timer_wheel_t* wheel, wheel_timer_t* timer) {
+    assert(wheel && timer);
+    if (!timer_wheel_is_armed(timer))
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    wheel->count--;
+    if (timer->deadline == wheel->earliest)
+        wheel->earliest_known = false;
+}
+
+bool timer_wheel_is_armed(wheel_timer_t* timer) {
+    return timer->next != NULL;
+}
+
+wheel_timer_t* timer_wheel_expire(timer_wheel_t* wheel, time_t now) {
+    assert(wheel);
+    while (wheel->count > 0 && wheel->current <= now) {
+        wheel_timer_t* head = &wheel->slots[wheel->current & wheel->mask];
+        // timers of a later round share the slot, they stay
+        for (wheel_timer_t* timer = head->next; timer != head; timer = timer->next) {
+            if (timer->deadline <= now) {
+                timer_wheel_remove(wheel, timer);
+                return timer;
+            }
+        }
+        // timers added for 'now' later on still have to land in a slot we look at
+        if (wheel->current == now)
+            break;
+        wheel->current++;
+    }
+    if (wheel->count == 0 && wheel->current < now)
+        wheel->current = now;
+    return NULL;
+}
+
+time_t timer_wheel_next_deadline(timer_wheel_t* wheel) {
+    assert(wheel);
+    if (wheel->count == 0)
+        return -1;
+    if (wheel->earliest_known)
+        return wheel->earliest;
+    // deadlines are never before 'current', so the first tick with a timer due is the earliest deadline
+    for (size_t i = 0; i <= wheel->mask; i++) {
+        time_t tick = wheel->current + (time_t) i;
+        wheel_timer_t* head = &wheel->slots[tick & wheel->mask];
+        for (wheel_timer_t* timer = head->next; timer != head; timer = timer->next) {
+            if (timer->deadline <= tick) {
+                wheel->earliest = tick;
+                wheel->earliest_known = true;
+                return tick;
+            }
+        }
+    }
+    // everything is at least a round away
+    return wheel->current + (time_t) wheel->mask + 1;
+}
+
+wheel_timer_t* timer_wheel_pop(timer_wheel_t* wheel) {
+    assert(wheel);
+    for (size_t i = 0; wheel->count > 0 && i <= wheel->mask; i++) {
+        if (!slot_is_empty(&wheel->slots[i])) {
+            wheel_timer_t* timer = wheel->slots[i].next;
+            timer_wheel_remove(wheel, timer);
+            return timer;
+        }
+    }
+    return NULL;
+}
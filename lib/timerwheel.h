@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    A hashed timer wheel with one slot per tick (a second, like time()). Adding, removing
+    and expiring a timer is O(1); deadlines beyond the wheel simply wait for another round.
+    Timers are embedded in the caller's own structs, the wheel never allocates for them.
+*/
+typedef struct timer_wheel timer_wheel_t;
+
+typedef struct wheel_timer {
+    struct wheel_timer* prev;
+    struct wheel_timer* next;
+    time_t deadline;
+} wheel_timer_t;
+
+/**
+ * Creates a wheel of at least 'slots' slots, starting at time 'now'
+ */
+timer_wheel_t* timer_wheel_create(size_t slots, time_t now);
+
+/**
+ * Frees the wheel, timers still armed are simply forgotten
+ */
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+/**
+ * Arms 'timer' to expire once the time reaches 'deadline', it must not be armed already
+ */
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, time_t deadline);
+
+/**
+ * Disarms 'timer', does nothing if it is not armed
+ */
+void timer_wheel_remove(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+bool timer_wheel_is_armed(wheel_timer_t* timer);
+
+/**
+ * Disarms and returns one timer whose deadline is at or before 'now', NULL if there is none
+ * Call it until it returns NULL to expire everything that is due
+ */
+wheel_timer_t* timer_wheel_expire(timer_wheel_t* wheel, time_t now);
+
+/**
+ * Returns a time no later than the earliest deadline, or -1 if no timer is armed
+ * The earliest deadline is remembered, so this only looks through the slots after the timer that had it was disarmed
+ */
+time_t timer_wheel_next_deadline(timer_wheel_t* wheel);
+
+/**
+ * Disarms and returns any armed timer, NULL if there is none, to tear everything down
+ */
+wheel_timer_t* timer_wheel_pop(timer_wheel_t* wheel);
@@ -9,13 +9,17 @@
 #include "config.h"
 #include "connmgr.h"
 #include "datamgr.h"
+#include "lib/logger.h"
 #include "sbuffer.h"
 #include "sensor_db.h"
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -23,64 +27,155 @@
 #include <wait.h>
 #include <math.h>
 
+// number of readings the managers take out of the buffer at once
+#define DRAIN_BATCH 64
+
+// kept around for print_stats, readers stay readable until their buffer is destroyed
+static sbuffer_t* buffers[SHARDS];
+static sbuffer_reader_t* datamgr_readers[SHARDS];
+static sbuffer_reader_t* storagemgr_readers[SHARDS];
+static datamgr_t* datamgrs[SHARDS];
+static atomic_bool stopping = false;
+// the storage manager sleeps on it while every shard is empty, woken by a reading in any of them or a rollup
+static sbuffer_waiter_t* storagemgr_waiter;
+
+// closed rollup windows on their way from the data managers to the storage manager
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t closed_changed;
+    datamgr_rollup_t* records;
+    size_t count;
+    size_t capacity;
+    bool closed; // every data manager is freed, there will be no more
+} rollups = {.lock = PTHREAD_MUTEX_INITIALIZER, .closed_changed = PTHREAD_COND_INITIALIZER};
+
 static int print_usage() {
     printf("Usage: <command> <port number> \n");
     return -1;
 }
 
-static void* datamgr_run(void* buffer) {
-    datamgr_init();
-
-    // datamgr loop
-    while (true) {
-        sbuffer_lock(buffer);
-        // if (!sbuffer_is_empty(buffer)) {
-            sensor_data_t data = sbuffer_remove_last(buffer);
-        if(data.value !=  -INFINITY) {
-            datamgr_process_reading(&data);
-            // everything nice & processed
-        } else if (sbuffer_is_closed(buffer)) {
-            // buffer is both empty & closed: there will never be data again
-            sbuffer_unlock(buffer);
-            break;
-        }
-        // give the others a chance to lock the mutex
-        sbuffer_unlock(buffer);
+// rollup sink of the data managers
+static void queue_rollup(const datamgr_rollup_t* rollup, void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&rollups.lock);
+    if (rollups.count == rollups.capacity) {
+        rollups.capacity = rollups.capacity == 0 ? DRAIN_BATCH : 2 * rollups.capacity;
+        rollups.records = realloc(rollups.records, rollups.capacity * sizeof(*rollups.records));
+        assert(rollups.records);
     }
+    rollups.records[rollups.count++] = *rollup;
+    pthread_mutex_unlock(&rollups.lock);
+    sbuffer_waiter_wake(storagemgr_waiter);
+}
+
+// takes the queued rollups out at once, so the data managers never wait for the database, returns how many there were
+static size_t store_rollups(DBCONN* db) {
+    pthread_mutex_lock(&rollups.lock);
+    datamgr_rollup_t* records = rollups.records;
+    size_t count = rollups.count;
+    rollups.records = NULL;
+    rollups.count = rollups.capacity = 0;
+    pthread_mutex_unlock(&rollups.lock);
+    for (size_t i = 0; i < count; i++)
+        storagemgr_insert_rollup(db, records[i].id, records[i].length, records[i].start, records[i].count,
+                                 records[i].min, records[i].average, records[i].max);
+    free(records);
+    return count;
+}
 
-    datamgr_free();
+// every shard has its own data manager worker, which owns the state of the sensors routed to that shard
+static void* datamgr_run(void* arg) {
+    size_t shard = (size_t) (uintptr_t) arg;
+    sbuffer_reader_t* reader = datamgr_readers[shard];
+    datamgr_t* datamgr = datamgrs[shard];
+
+    // datamgr loop, until the buffer is both empty & closed: there will never be data again
+    sensor_data_t batch[DRAIN_BATCH];
+    int count;
+    while ((count = sbuffer_remove_batch(reader, batch, DRAIN_BATCH, -1)) != SBUFFER_FAILURE)
+        datamgr_process_batch(datamgr, batch, count);
+
+    sbuffer_unsubscribe(reader);
+    datamgr_free(datamgr);
 
     return NULL;
 }
 
-static void* storagemgr_run(void* buffer) {
+// the storage manager writes to one database connection, so it reads from all shards
+static void* storagemgr_run(void* arg) {
+    sbuffer_reader_t** readers = arg;
     DBCONN* db = storagemgr_init_connection(1);
     assert(db != NULL);
 
-    // storagemgr loop
-    while (true) {
-        sbuffer_lock(buffer);
-        // if (!sbuffer_is_empty(buffer)) {
-            sensor_data_t data = sbuffer_remove_last(buffer);
-        if(data.value !=  -INFINITY) {
-            storagemgr_insert_sensor(db, data.id, data.value, data.ts);
-            // everything nice & processed
-        } else if (sbuffer_is_closed(buffer)) {
-            // buffer is both empty & closed: there will never be data again
-            sbuffer_unlock(buffer);
-            break;
+    // storagemgr loop, until every shard is both empty & closed: there will never be data again
+    sensor_data_t batch[DRAIN_BATCH];
+    size_t open = SHARDS;
+    while (open > 0) {
+        // whatever comes in from here on wakes the wait below
+        uint32_t ticket = sbuffer_waiter_prepare(storagemgr_waiter);
+        bool idle = store_rollups(db) == 0;
+        for (size_t shard = 0; shard < SHARDS; shard++) {
+            if (readers[shard] == NULL)
+                continue;
+            int count = sbuffer_remove_batch(readers[shard], batch, DRAIN_BATCH, 0);
+            if (count == SBUFFER_FAILURE) {
+                sbuffer_unsubscribe(readers[shard]);
+                readers[shard] = NULL;
+                open--;
+                continue;
+            }
+            for (int i = 0; i < count; i++)
+                storagemgr_insert_sensor(db, batch[i].id, batch[i].value, batch[i].ts);
+            idle = idle && count == 0;
         }
-        // the buffer is empty but not closed, we wait
-        // else {
-        //     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->storageManagerMutex) == 0);
+        // nothing anywhere: sleep until any shard has readings or closes, unless the last one just did
+        sbuffer_waiter_wait(storagemgr_waiter, ticket, idle && open > 0 ? -1 : 0);
+    }
+
+    // the data managers hand over the windows still open when they are freed, after the buffers ran dry
+    pthread_mutex_lock(&rollups.lock);
+    while (!rollups.closed)
+        pthread_cond_wait(&rollups.closed_changed, &rollups.lock);
+    pthread_mutex_unlock(&rollups.lock);
+    store_rollups(db);
 
+    storagemgr_disconnect(db);
+    return NULL;
+}
 
-        // }
-        // give the others a chance to lock the mutex
-        sbuffer_unlock(buffer);
+static void print_reader_stats(const char* name, sbuffer_reader_t* reader) {
+    sbuffer_reader_stats_t stats;
+    sbuffer_get_reader_stats(reader, &stats);
+    logger_log(LOGGER_INFO, "    %-10s %zu removed, %zu behind, waited %.3f ms for data\n", name, stats.removed, stats.lag, stats.wait_ns / 1e6);
+}
+
+// a growing depth with waiting readers points at the producer, a growing lag at that reader
+static void print_stats() {
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+        sbuffer_stats_t stats;
+        sbuffer_get_stats(buffers[shard], &stats);
+        logger_log(LOGGER_INFO, "Shard %zu: %zu inserted, depth %zu (peak %zu), %zu dropped, %zu spilled\n",
+                   shard, stats.inserted, stats.depth, stats.peak_depth, stats.dropped, stats.spilled);
+        logger_log(LOGGER_INFO, "    producer   waited %.3f ms for space, lock contended %zu times for %.3f ms\n",
+                   stats.producer_wait_ns / 1e6, stats.lock_contended, stats.lock_wait_ns / 1e6);
+        print_reader_stats("datamgr", datamgr_readers[shard]);
+        print_reader_stats("storagemgr", storagemgr_readers[shard]);
+        // the data managers keep going while their sensors are read
+        size_t cursor = 0;
+        sensor_id_t id;
+        datamgr_sensor_stats_t sensor;
+        while (datamgr_snapshot_next(datamgrs[shard], &cursor, &id, &sensor))
+            logger_log(LOGGER_DEBUG, "    sensor %" PRIu16 ": %" PRIu64 " readings, last at %ld, average %.2f, ewma %.2f\n",
+                       id, sensor.count, sensor.last_modified, sensor.average, sensor.ewma);
     }
+}
 
-    storagemgr_disconnect(db);
+// prints the buffer statistics every time the process gets SIGUSR1
+static void* stats_run(void* arg) {
+    sigset_t* signals = arg;
+    int signal;
+    while (sigwait(signals, &signal) == 0 && !atomic_load(&stopping))
+        print_stats();
     return NULL;
 }
 
@@ -93,27 +188,80 @@ int main(int argc, char* argv[]) {
     if (strport[0] == '\0' || error_char[0] != '\0')
         return print_usage();
 
-    sbuffer_t* buffer = sbuffer_create();
+    // only the stats thread takes SIGUSR1, every thread created from here on inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    ASSERT_ELSE_PERROR(pthread_sigmask(SIG_BLOCK, &signals, NULL) == 0);
 
-    pthread_t datamgr_thread;
-    ASSERT_ELSE_PERROR(pthread_create(&datamgr_thread, NULL, datamgr_run, buffer) == 0);
+    // from here on, hot paths hand their output to the logger thread
+    logger_init();
+
+    storagemgr_waiter = sbuffer_waiter_create();
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+        buffers[shard] = sbuffer_create();
+        sbuffer_attach_waiter(buffers[shard], storagemgr_waiter);
+    }
+
+    // subscribe before any data can arrive, so the managers see every reading
+    pthread_t datamgr_threads[SHARDS];
+    sbuffer_reader_t* storagemgr_shards[SHARDS];
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+        datamgr_readers[shard] = sbuffer_subscribe(buffers[shard], SBUFFER_DELIVER_ALL);
+        datamgrs[shard] = datamgr_init();
+        datamgr_set_rollup_sink(datamgrs[shard], queue_rollup, NULL);
+        ASSERT_ELSE_PERROR(pthread_create(&datamgr_threads[shard], NULL, datamgr_run, (void*) (uintptr_t) shard) == 0);
+        storagemgr_readers[shard] = sbuffer_subscribe(buffers[shard], SBUFFER_DELIVER_ALL);
+        storagemgr_shards[shard] = storagemgr_readers[shard];
+    }
 
     pthread_t storagemgr_thread;
-    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, storagemgr_run, buffer) == 0);
+    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, storagemgr_run, storagemgr_shards) == 0);
+
+    pthread_t stats_thread;
+    ASSERT_ELSE_PERROR(pthread_create(&stats_thread, NULL, stats_run, &signals) == 0);
 
-    setManagers(buffer, datamgr_thread, storagemgr_thread);
-    
     // main server loop
-    connmgr_listen(port_number, buffer);
+    connmgr_listen(port_number, buffers, SHARDS);
+
+    // the stats thread reads the data managers, so it stops before they are freed
+    atomic_store(&stopping, true);
+    ASSERT_ELSE_PERROR(pthread_kill(stats_thread, SIGUSR1) == 0);
+    pthread_join(stats_thread, NULL);
 
-    sbuffer_lock(buffer);
-    sbuffer_close(buffer);
-    sbuffer_unlock(buffer);
+    for (size_t shard = 0; shard < SHARDS; shard++)
+        sbuffer_close(buffers[shard]);
 
-    pthread_join(datamgr_thread, NULL);
+    for (size_t shard = 0; shard < SHARDS; shard++)
+        pthread_join(datamgr_threads[shard], NULL);
+    pthread_mutex_lock(&rollups.lock);
+    rollups.closed = true;
+    pthread_cond_signal(&rollups.closed_changed);
+    pthread_mutex_unlock(&rollups.lock);
     pthread_join(storagemgr_thread, NULL);
+    logger_shutdown();
+
+    sbuffer_stats_t total = {0};
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+        sbuffer_stats_t stats;
+        sbuffer_get_stats(buffers[shard], &stats);
+        total.dropped += stats.dropped;
+        total.delayed += stats.delayed;
+        total.spilled += stats.spilled;
+        sbuffer_destroy(buffers[shard]);
+    }
+    sbuffer_waiter_destroy(storagemgr_waiter);
+    if (total.dropped > 0 || total.delayed > 0 || total.spilled > 0)
+        printf("Buffer overload: %zu readings dropped, %zu readings delayed, %zu readings spilled to disk\n", total.dropped, total.delayed, total.spilled);
+
+    pool_stats_t sockets, ip_addrs;
+    tcp_get_pool_stats(&sockets, &ip_addrs);
+    printf("Connection pools: %zu sockets and %zu addresses allocated with %zu heap calls\n",
+           sockets.allocations, ip_addrs.allocations, sockets.heap_calls + ip_addrs.heap_calls);
 
-    sbuffer_destroy(buffer);
+    size_t log_dropped = logger_dropped();
+    if (log_dropped > 0)
+        printf("Logger: %zu records dropped\n", log_dropped);
 
     wait(NULL);
 
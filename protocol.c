@@ -0,0 +1,111 @@
+#include "protocol.h"
+
+#include <endian.h>
+#include <string.h>
+
+#define PROTOCOL_VERSION 2
+
+void protocol_parser_init(protocol_parser_t* parser) {
+    assert(parser);
+    parser->version = PROTOCOL_UNKNOWN;
+    parser->frame_left = 0;
+}
+
+static sensor_data_t decode_v1(const char* bytes) {
+    sensor_data_t data;
+    memcpy(&data.id, bytes, sizeof(data.id));
+    memcpy(&data.value, bytes + sizeof(data.id), sizeof(data.value));
+    memcpy(&data.ts, bytes + sizeof(data.id) + sizeof(data.value), sizeof(data.ts));
+    return data;
+}
+
+static sensor_data_t decode_v2(const char* bytes) {
+    uint16_t id;
+    uint64_t value, ts;
+    memcpy(&id, bytes, sizeof(id));
+    memcpy(&value, bytes + sizeof(id), sizeof(value));
+    memcpy(&ts, bytes + sizeof(id) + sizeof(value), sizeof(ts));
+    value = le64toh(value);
+    sensor_data_t data = {.id = le16toh(id), .ts = (sensor_ts_t) le64toh(ts)};
+    memcpy(&data.value, &value, sizeof(data.value));
+    return data;
+}
+
+static void encode_v2(char* out, const sensor_data_t* data) {
+    uint16_t id = htole16(data->id);
+    uint64_t value, ts = htole64((uint64_t) data->ts);
+    memcpy(&value, &data->value, sizeof(value));
+    value = htole64(value);
+    memcpy(out, &id, sizeof(id));
+    memcpy(out + sizeof(id), &value, sizeof(value));
+    memcpy(out + sizeof(id) + sizeof(value), &ts, sizeof(ts));
+}
+
+// returns false if the header does not describe a frame of whole readings
+static bool decode_header(const char* bytes, size_t* count) {
+    uint16_t readings;
+    uint32_t length;
+    memcpy(&readings, bytes + 6, sizeof(readings));
+    memcpy(&length, bytes + 8, sizeof(length));
+    readings = le16toh(readings);
+    if (memcmp(bytes, PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE) != 0 || bytes[4] != PROTOCOL_VERSION || bytes[5] != 0)
+        return false;
+    if (le32toh(length) != readings * PROTOCOL_RECORD_SIZE)
+        return false;
+    *count = readings;
+    return true;
+}
+
+protocol_result_t protocol_parse(protocol_parser_t* parser, const char* bytes, size_t size, sensor_data_t* data, size_t* consumed) {
+    assert(parser && data && consumed);
+    *consumed = 0;
+    if (parser->version == PROTOCOL_UNKNOWN) {
+        if (size < PROTOCOL_MAGIC_SIZE)
+            return PROTOCOL_NEED_MORE;
+        parser->version = memcmp(bytes, PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE) == 0 ? PROTOCOL_V2 : PROTOCOL_V1;
+    }
+
+    if (parser->version == PROTOCOL_V1) {
+        if (size < PROTOCOL_RECORD_SIZE)
+            return PROTOCOL_NEED_MORE;
+        *data = decode_v1(bytes);
+        *consumed = PROTOCOL_RECORD_SIZE;
+        return PROTOCOL_READING;
+    }
+
+    // empty frames are allowed, they are skipped like any other header
+    while (parser->frame_left == 0) {
+        if (size - *consumed < PROTOCOL_HEADER_SIZE)
+            return PROTOCOL_NEED_MORE;
+        if (!decode_header(bytes + *consumed, &parser->frame_left))
+            return PROTOCOL_MALFORMED;
+        *consumed += PROTOCOL_HEADER_SIZE;
+    }
+    if (size - *consumed < PROTOCOL_RECORD_SIZE)
+        return PROTOCOL_NEED_MORE;
+    *data = decode_v2(bytes + *consumed);
+    *consumed += PROTOCOL_RECORD_SIZE;
+    parser->frame_left--;
+    return PROTOCOL_READING;
+}
+
+void protocol_encode_v1(char* out, const sensor_data_t* data) {
+    assert(out && data);
+    memcpy(out, &data->id, sizeof(data->id));
+    memcpy(out + sizeof(data->id), &data->value, sizeof(data->value));
+    memcpy(out + sizeof(data->id) + sizeof(data->value), &data->ts, sizeof(data->ts));
+}
+
+size_t protocol_encode_frame(char* out, const sensor_data_t* readings, uint16_t count) {
+    assert(out && (readings || count == 0));
+    uint16_t readings_le = htole16(count);
+    uint32_t length = htole32((uint32_t) (count * PROTOCOL_RECORD_SIZE));
+    memcpy(out, PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE);
+    out[4] = PROTOCOL_VERSION;
+    out[5] = 0;
+    memcpy(out + 6, &readings_le, sizeof(readings_le));
+    memcpy(out + 8, &length, sizeof(length));
+    for (size_t i = 0; i < count; i++)
+        encode_v2(out + PROTOCOL_FRAME_SIZE(i), &readings[i]);
+    return PROTOCOL_FRAME_SIZE(count);
+}
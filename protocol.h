@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Version 1 sends every reading on its own: id, value and timestamp back to back, in host
+    byte order, without any framing.
+
+    Version 2 sends frames: a header followed by 'count' packed readings, all little-endian.
+        magic   4 bytes  PROTOCOL_MAGIC
+        version 1 byte   2
+        flags   1 byte   0, reserved
+        count   2 bytes  readings in the frame
+        length  4 bytes  bytes following the header, count * PROTOCOL_RECORD_SIZE
+    The magic starts with the bytes of sensor id 65535, which no v1 sensor should use, so the
+    first four bytes of a connection tell the two versions apart.
+*/
+
+// size of one reading on the wire: id, value and timestamp, back to back
+#define PROTOCOL_RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+#define PROTOCOL_MAGIC "\xff\xffSN"
+#define PROTOCOL_MAGIC_SIZE 4
+#define PROTOCOL_HEADER_SIZE 12
+#define PROTOCOL_MAX_FRAME_READINGS UINT16_MAX
+
+// bytes a v2 frame of 'count' readings takes
+#define PROTOCOL_FRAME_SIZE(count) (PROTOCOL_HEADER_SIZE + (size_t) (count) * PROTOCOL_RECORD_SIZE)
+
+typedef enum {
+    PROTOCOL_UNKNOWN, // not enough bytes to tell yet
+    PROTOCOL_V1,
+    PROTOCOL_V2,
+} protocol_version_t;
+
+typedef enum {
+    PROTOCOL_READING,   // a reading was parsed
+    PROTOCOL_NEED_MORE, // the bytes end in the middle of a header or reading
+    PROTOCOL_MALFORMED, // the peer does not speak the protocol, drop it
+} protocol_result_t;
+
+// what a connection parser has to remember between two receives
+typedef struct {
+    protocol_version_t version;
+    size_t frame_left; // v2: readings of the current frame not parsed yet
+} protocol_parser_t;
+
+/**
+ * Prepares 'parser' for a new connection, its version is detected from the first bytes
+ */
+void protocol_parser_init(protocol_parser_t* parser);
+
+/**
+ * Parses the next reading at the start of 'bytes', skipping any v2 frame header in front of it
+ * \param consumed set to the number of bytes used up, also when no reading was parsed
+ * \return PROTOCOL_READING if 'data' was filled in
+ */
+protocol_result_t protocol_parse(protocol_parser_t* parser, const char* bytes, size_t size, sensor_data_t* data, size_t* consumed);
+
+/**
+ * Writes 'data' as a v1 record of PROTOCOL_RECORD_SIZE bytes
+ */
+void protocol_encode_v1(char* out, const sensor_data_t* data);
+
+/**
+ * Writes a v2 frame of 'count' readings, 'out' must hold PROTOCOL_FRAME_SIZE(count) bytes
+ * \return the size of the frame
+ */
+size_t protocol_encode_frame(char* out, const sensor_data_t* readings, uint16_t count);
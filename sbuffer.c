@@ -9,290 +9,1120 @@
 #include "sbuffer.h"
 
 #include "config.h"
+#include "lib/vector.h"
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#define CACHE_LINE_SIZE 64
 
-typedef struct sbuffer_node {
-    struct sbuffer_node* prev;
+// number of times a lock-free reader or producer polls before it parks on its futex
+#ifndef SBUFFER_SPIN
+    #define SBUFFER_SPIN 256
+#endif
+
+#define NO_RELIABLE_READER SIZE_MAX
+
+// after creating a spill segment failed, SBUFFER_OVERLOAD_SPILL drops the newest readings for this long before trying again
+#ifndef SBUFFER_SPILL_RETRY_MS
+    #define SBUFFER_SPILL_RETRY_MS 1000
+#endif
+
+// number of per-CPU counter stripes, a power of two
+#ifndef SBUFFER_STRIPES
+    #define SBUFFER_STRIPES 16
+#endif
+
+/*
+    Positions only ever grow: the reading at position p lives in slot p & mask.
+    Producers claim positions by bumping 'head' and publish a slot by setting its sequence
+    to p + 1, so readers never look at a reading that is still being written. Every reader
+    owns a cursor (the next position it will consume), and a slot can be reused once the
+    slowest SBUFFER_DELIVER_ALL cursor (the 'tail') has passed it. Under
+    SBUFFER_OVERLOAD_DROP_OLDEST nobody waits for the tail, and SBUFFER_DELIVER_LATEST readers
+    are never waited for: before overwriting readings such a reader has not seen yet, the
+    producer moves the reader's cursor past them, so the reader commits its own progress
+    with a compare-and-swap. A reader that may be overwritten copies a slot seqlock-style,
+    checking the sequence again after the copy; a producer only rewrites a slot once the
+    previous lap of it is published, so two laps never write it at the same time.
+
+    Under SBUFFER_OVERLOAD_SPILL the producers move the oldest readings the ring still holds
+    into memory-mapped segment files once the ring gets too full. Everything before
+    'spillEnd' that a reader still needs lives in a segment, so a slot only has to stay
+    untouched until both the tail and 'spillEnd' have passed it. A reader whose cursor is
+    behind 'spillEnd' reads from the segments, and a segment is deleted once every
+    SBUFFER_DELIVER_ALL reader is past it. Segment files are created with no lock held and
+    handed over as the spare; while that fails, say for a full disk, the producers drop the
+    newest readings rather than wait.
+
+    This data path is the same in both modes. By default every operation runs under the
+    buffer mutex and waiting happens on condition variables. With SBUFFER_LOCKFREE nothing
+    takes a lock: readers and producers spin for a while and then park on a futex, and
+    only parked threads cost the other side a wake-up syscall.
+
+    The subscribed readers are an immutable list that (un)subscribing replaces as a whole.
+    Threads look at it without a lock between list_acquire() and list_release(), which count
+    them in the current epoch. Replacing the list starts a new epoch and waits until nobody
+    is left in the previous one, after that the old list and an unsubscribed reader can go.
+
+    A thread reading from several buffers parks on a waiter the buffers share instead. It
+    counts itself as parked before it looks at its readers a last time, so a producer either
+    sees it parked and bumps the waiter's futex word, or published before that last look.
+*/
+typedef struct {
+    _Atomic size_t sequence; // p + 1 once the reading at position p is published, 0 while a slot is being rewritten
     sensor_data_t data;
-    pthread_t readBy;
-} sbuffer_node_t;
+} sbuffer_slot_t;
+
+struct sbuffer_reader {
+    _Atomic size_t cursor;
+    _Atomic size_t skipped;
+    sbuffer_t* buffer;
+    sbuffer_delivery_t delivery;
+    _Atomic bool parked;
+    _Atomic size_t removed;
+    _Atomic uint64_t waitNs; // time spent parked waiting for data
+#if SBUFFER_LOCKFREE
+    _Atomic uint32_t wakeup;
+#else
+    pthread_cond_t condition;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// counters producers bump, striped per CPU so they do not bounce a cache line between them
+typedef struct {
+    _Atomic size_t inserted;
+    _Atomic uint64_t waitNs; // time spent waiting for space
+    _Atomic size_t lockContended;
+    _Atomic uint64_t lockWaitNs;
+    _Atomic size_t listUsers[2]; // threads looking at the reader list, by the parity of the epoch they started in
+} __attribute__((aligned(CACHE_LINE_SIZE))) sbuffer_counters_t;
+
+// a run of spilled readings, backed by a file of SBUFFER_SEGMENT_READINGS readings
+typedef struct {
+    size_t first; // position of the first reading in the segment
+    size_t count;
+    sensor_data_t* readings;
+    char* path;
+} sbuffer_segment_t;
+
+// immutable snapshot of the subscribed readers, replaced as a whole on (un)subscribe
+typedef struct {
+    size_t count;
+    sbuffer_reader_t* readers[];
+} sbuffer_reader_list_t;
 
 struct sbuffer {
-    sbuffer_node_t* head;
-    sbuffer_node_t* tail;
-    bool closed;
-    //pthread_mutex_t mutex;
-    pthread_rwlock_t rwlock;
-    pthread_cond_t dataManagerCondition;
-    pthread_cond_t storageManagerCondition;
-    pthread_mutex_t dataManagerMutex;
-    pthread_mutex_t storageManagerMutex;
-    unsigned long dataManager;
-    unsigned long storageManager;
+    sbuffer_slot_t* slots;
+    size_t capacity;
+    size_t mask;
+    sbuffer_overload_t policy;
+    _Atomic size_t head __attribute__((aligned(CACHE_LINE_SIZE))); // next position a producer will claim
+    _Atomic(sbuffer_reader_list_t*) readers __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic size_t listEpoch; // bumped every time 'readers' is replaced
+    _Atomic bool closed;
+    _Atomic size_t parkedReaders;
+    _Atomic size_t parkedProducers;
+    _Atomic size_t dropped;
+    _Atomic size_t delayed;
+    _Atomic size_t sampled;
+    _Atomic size_t spilled;
+    _Atomic size_t peakDepth;
+    _Atomic size_t spillEnd;  // every reading before this position that a reader needs is in a segment
+    pthread_mutex_t spillMutex; // guards the segments
+    vector_t* segments;         // ordered by position
+    sbuffer_segment_t* spare;   // the next segment to fill, guarded by spillMutex
+    char* spillDir;             // where the segment files go, read from the environment when the buffer is created
+    _Atomic size_t segmentsCreated;
+    _Atomic uint64_t spillFailedNs; // when creating a segment last failed, 0 if the last one worked
+    sbuffer_waiter_t* waiter;       // also woken by inserts and closing, NULL without one
+#if SBUFFER_LOCKFREE
+    _Atomic uint32_t spaceWakeup;
+#else
+    pthread_cond_t notFull;
+#endif
+    pthread_mutex_t mutex; // guards (un)subscribing, and everything else unless SBUFFER_LOCKFREE
+    sbuffer_counters_t counters[SBUFFER_STRIPES];
 };
 
-static sbuffer_node_t* create_node(const sensor_data_t* data) {
-    sbuffer_node_t* node = malloc(sizeof(*node));
-    *node = (sbuffer_node_t){
-        .data = *data,
-        .prev = NULL,
-    };
-    return node;
+struct sbuffer_waiter {
+    _Atomic uint32_t wakeup;
+    _Atomic size_t parked;
+};
+
+static uint64_t now_ns() {
+    struct timespec now;
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static sbuffer_counters_t* local_counters(sbuffer_t* buffer) {
+    int cpu = sched_getcpu();
+    return &buffer->counters[(cpu < 0 ? 0 : cpu) & (SBUFFER_STRIPES - 1)];
+}
+
+// a waiter parks on a futex in both modes
+static int futex_wait(_Atomic uint32_t* word, uint32_t expected, const struct timespec* deadline) {
+    // the deadline is absolute on CLOCK_MONOTONIC, just like the timed condition variable waits
+    if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+        return 0;
+    ASSERT_ELSE_PERROR(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+    return errno == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+static void futex_wake(_Atomic uint32_t* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
+
+// sets 'deadline' to 'timeout_ms' from now on CLOCK_MONOTONIC
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_MONOTONIC, deadline) == 0);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+#if SBUFFER_LOCKFREE
+    #define BUFFER_LOCK(buffer) (void) 0
+    #define BUFFER_UNLOCK(buffer) (void) 0
+#else
+    #define BUFFER_LOCK(buffer) buffer_lock(buffer)
+    #define BUFFER_UNLOCK(buffer) ASSERT_ELSE_PERROR(pthread_mutex_unlock(&(buffer)->mutex) == 0)
+
+// only a contended lock pays for reading the clock
+static void buffer_lock(sbuffer_t* buffer) {
+    int rc = pthread_mutex_trylock(&buffer->mutex);
+    if (rc == 0)
+        return;
+    ASSERT_ELSE_PERROR(rc == EBUSY);
+    uint64_t start = now_ns();
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    sbuffer_counters_t* counters = local_counters(buffer);
+    atomic_fetch_add_explicit(&counters->lockContended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->lockWaitNs, now_ns() - start, memory_order_relaxed);
+}
+#endif
+
+// loads the reader list, which stays valid until list_release() with what 'users' is set to
+static sbuffer_reader_list_t* list_acquire(sbuffer_t* buffer, _Atomic size_t** users) {
+    sbuffer_counters_t* counters = local_counters(buffer);
+    while (true) {
+        size_t epoch = atomic_load(&buffer->listEpoch);
+        *users = &counters->listUsers[epoch & 1];
+        atomic_fetch_add(*users, 1);
+        // otherwise replace_readers() may not have seen us, so count in the new epoch
+        if (atomic_load(&buffer->listEpoch) == epoch)
+            return atomic_load(&buffer->readers);
+        atomic_fetch_sub(*users, 1);
+    }
+}
+
+static void list_release(_Atomic size_t* users) {
+    atomic_fetch_sub_explicit(users, 1, memory_order_release);
+}
+
+// installs 'list' and returns once no thread can still be looking at the old one, which it frees; callers hold the mutex
+static void replace_readers(sbuffer_t* buffer, sbuffer_reader_list_t* list) {
+    sbuffer_reader_list_t* old = atomic_exchange(&buffer->readers, list);
+    size_t parity = atomic_fetch_add(&buffer->listEpoch, 1) & 1;
+    // whoever counts itself in the new epoch loads the new list, the others are only in there for a short loop
+    for (size_t i = 0, spins = 0; i < SBUFFER_STRIPES; spins++) {
+        if (atomic_load_explicit(&buffer->counters[i].listUsers[parity], memory_order_acquire) == 0)
+            i++;
+        else if (spins < SBUFFER_SPIN)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+    free(old);
+}
+
+// whether the producers may overwrite readings 'reader' has not seen yet, moving its cursor along
+static bool may_be_lapped(sbuffer_t* buffer, sbuffer_reader_t* reader) {
+    return reader->delivery == SBUFFER_DELIVER_LATEST || buffer->policy == SBUFFER_OVERLOAD_DROP_OLDEST;
+}
+
+// whether a slot may be rewritten while 'reader' copies it, spilled readings do not hold their slots
+static bool may_change(sbuffer_t* buffer, sbuffer_reader_t* reader) {
+    return may_be_lapped(buffer, reader) || buffer->policy == SBUFFER_OVERLOAD_SPILL;
+}
+
+// slowest SBUFFER_DELIVER_ALL cursor, or NO_RELIABLE_READER if nobody needs the readings to be kept
+static size_t reliable_tail(sbuffer_t* buffer) {
+    _Atomic size_t* users;
+    sbuffer_reader_list_t* list = list_acquire(buffer, &users);
+    size_t tail = NO_RELIABLE_READER;
+    for (size_t i = 0; i < list->count; i++) {
+        sbuffer_reader_t* reader = list->readers[i];
+        if (reader->delivery != SBUFFER_DELIVER_ALL)
+            continue;
+        size_t cursor = atomic_load_explicit(&reader->cursor, memory_order_acquire);
+        if (cursor < tail)
+            tail = cursor;
+    }
+    list_release(users);
+    return tail;
+}
+
+// oldest position whose slot may not be overwritten yet, or NO_RELIABLE_READER if any slot may be
+static size_t protected_tail(sbuffer_t* buffer) {
+    if (buffer->policy == SBUFFER_OVERLOAD_DROP_OLDEST)
+        return NO_RELIABLE_READER;
+    size_t tail = reliable_tail(buffer);
+    if (tail == NO_RELIABLE_READER)
+        return tail;
+    size_t spillEnd = atomic_load_explicit(&buffer->spillEnd, memory_order_acquire);
+    // spilled readings are safe on disk
+    return spillEnd > tail ? spillEnd : tail;
+}
+
+static bool has_space(sbuffer_t* buffer, size_t last) {
+    size_t tail = protected_tail(buffer);
+    return tail == NO_RELIABLE_READER || last < tail + buffer->capacity;
+}
+
+// number of positions that can be claimed right now without overwriting anything, at most 'max'
+static size_t free_slots(sbuffer_t* buffer, size_t head, size_t max) {
+    size_t tail = protected_tail(buffer);
+    if (tail == NO_RELIABLE_READER)
+        return max;
+    size_t free = tail + buffer->capacity > head ? tail + buffer->capacity - head : 0;
+    return free < max ? free : max;
+}
+
+static bool has_data(sbuffer_t* buffer, sbuffer_reader_t* reader) {
+    size_t cursor = atomic_load_explicit(&reader->cursor, memory_order_relaxed);
+    if (cursor < atomic_load_explicit(&buffer->spillEnd, memory_order_acquire))
+        return true;
+    size_t sequence = atomic_load_explicit(&buffer->slots[cursor & buffer->mask].sequence, memory_order_acquire);
+    return sequence > cursor;
+}
+
+// the callers fence first: either they see a thread parked, or it sees what they changed
+static void signal_waiter(sbuffer_waiter_t* waiter) {
+    if (atomic_load_explicit(&waiter->parked, memory_order_relaxed) == 0)
+        return;
+    atomic_fetch_add(&waiter->wakeup, 1);
+    futex_wake(&waiter->wakeup, INT32_MAX);
+}
+
+static void signal_readers(sbuffer_t* buffer) {
+    if (buffer->waiter != NULL)
+        signal_waiter(buffer->waiter);
+    if (atomic_load_explicit(&buffer->parkedReaders, memory_order_relaxed) == 0)
+        return;
+    _Atomic size_t* users;
+    sbuffer_reader_list_t* list = list_acquire(buffer, &users);
+    for (size_t i = 0; i < list->count; i++) {
+        sbuffer_reader_t* reader = list->readers[i];
+        if (!atomic_load_explicit(&reader->parked, memory_order_relaxed))
+            continue;
+#if SBUFFER_LOCKFREE
+        atomic_fetch_add(&reader->wakeup, 1);
+        futex_wake(&reader->wakeup, 1);
+#else
+        pthread_cond_signal(&reader->condition);
+#endif
+    }
+    list_release(users);
+}
+
+static void signal_producers(sbuffer_t* buffer) {
+    if (atomic_load_explicit(&buffer->parkedProducers, memory_order_relaxed) == 0)
+        return;
+#if SBUFFER_LOCKFREE
+    atomic_fetch_add(&buffer->spaceWakeup, 1);
+    futex_wake(&buffer->spaceWakeup, INT32_MAX);
+#else
+    pthread_cond_broadcast(&buffer->notFull);
+#endif
+}
+
+static void wake_readers(sbuffer_t* buffer) {
+    // pairs with the fence in wait_for_data
+    atomic_thread_fence(memory_order_seq_cst);
+    signal_readers(buffer);
+}
+
+static void wake_producers(sbuffer_t* buffer) {
+    // pairs with the fence in park_producer
+    atomic_thread_fence(memory_order_seq_cst);
+    signal_producers(buffer);
+}
+
+// creates an empty segment file and maps it, returns NULL if that fails
+static sbuffer_segment_t* segment_create(sbuffer_t* buffer) {
+    sbuffer_segment_t* segment = malloc(sizeof(*segment));
+    assert(segment != NULL);
+    ASSERT_ELSE_PERROR(asprintf(&segment->path, "%s/sbuffer-%d-%p-%zu.spill", buffer->spillDir, getpid(), (void*) buffer, atomic_fetch_add(&buffer->segmentsCreated, 1)) > 0);
+    size_t size = SBUFFER_SEGMENT_READINGS * sizeof(sensor_data_t);
+    segment->readings = MAP_FAILED;
+    int fd = open(segment->path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        // allocating the blocks up front makes a full disk fail here, instead of as a SIGBUS on a later write
+        int rc = posix_fallocate(fd, 0, size);
+        if (rc == 0)
+            segment->readings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        else
+            errno = rc;
+    }
+    if (segment->readings == MAP_FAILED) {
+        fprintf(stderr, "Could not create sbuffer spill segment %s: %s\n", segment->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(segment->path);
+        }
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    close(fd);
+    segment->first = 0;
+    segment->count = 0;
+    return segment;
+}
+
+static void segment_destroy(sbuffer_segment_t* segment) {
+    munmap(segment->readings, SBUFFER_SEGMENT_READINGS * sizeof(sensor_data_t));
+    unlink(segment->path);
+    free(segment->path);
+    free(segment);
+}
+
+typedef enum {
+    SPILL_MOVED,      // moved at least one reading
+    SPILL_STUCK,      // the oldest reading the ring holds for the readers is still being written, or there is none
+    SPILL_NO_SEGMENT, // the segments are full and there is no spare, see add_spare_segment
+} spill_result_t;
+
+// moves a chunk of the oldest readings the ring holds for the readers to disk
+static spill_result_t spill(sbuffer_t* buffer) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillMutex) == 0);
+    size_t tail = reliable_tail(buffer);
+    size_t end = atomic_load(&buffer->spillEnd);
+    size_t from = tail > end ? tail : end;
+    size_t head = atomic_load(&buffer->head);
+    size_t limit = from + (buffer->capacity + 7) / 8;
+    size_t to = from;
+    sbuffer_segment_t* segment = vector_size(buffer->segments) > 0
+                                     ? vector_at(buffer->segments, vector_size(buffer->segments) - 1)
+                                     : NULL;
+    bool noSegment = false;
+    // stop at the first reading a producer is still writing
+    while (tail != NO_RELIABLE_READER && to < limit && to < head
+           && atomic_load_explicit(&buffer->slots[to & buffer->mask].sequence, memory_order_acquire) == to + 1) {
+        if (segment == NULL || segment->first + segment->count != to || segment->count == SBUFFER_SEGMENT_READINGS) {
+            noSegment = buffer->spare == NULL;
+            if (noSegment)
+                break;
+            segment = buffer->spare;
+            buffer->spare = NULL;
+            segment->first = to;
+            vector_add(buffer->segments, segment);
+        }
+        segment->readings[segment->count++] = buffer->slots[to & buffer->mask].data;
+        to++;
+    }
+    if (to > from) {
+        atomic_fetch_add_explicit(&buffer->spilled, to - from, memory_order_relaxed);
+        atomic_store_explicit(&buffer->spillEnd, to, memory_order_release);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillMutex) == 0);
+    return to > from ? SPILL_MOVED : noSegment ? SPILL_NO_SEGMENT : SPILL_STUCK;
+}
+
+// spills until inserting 'count' more readings keeps the ring below SBUFFER_HIGH_WATER, returns false if that needs a new segment first
+static bool make_room(sbuffer_t* buffer, size_t count) {
+    while (true) {
+        size_t tail = protected_tail(buffer);
+        if (tail == NO_RELIABLE_READER)
+            return true;
+        size_t head = atomic_load(&buffer->head);
+        if (head + count < tail || (head + count - tail) * 100 < buffer->capacity * SBUFFER_HIGH_WATER)
+            return true;
+        spill_result_t result = spill(buffer);
+        if (result != SPILL_MOVED)
+            return result != SPILL_NO_SEGMENT;
+    }
+}
+
+// creates the spare segment with the buffer lock released, returns false if spilling is failing
+static bool add_spare_segment(sbuffer_t* buffer) {
+    uint64_t failed = atomic_load_explicit(&buffer->spillFailedNs, memory_order_relaxed);
+    if (failed != 0 && now_ns() - failed < SBUFFER_SPILL_RETRY_MS * 1000000ull)
+        return false;
+    BUFFER_UNLOCK(buffer);
+    sbuffer_segment_t* segment = segment_create(buffer);
+    BUFFER_LOCK(buffer);
+    if (segment == NULL) {
+        atomic_store_explicit(&buffer->spillFailedNs, now_ns(), memory_order_relaxed);
+        return false;
+    }
+    atomic_store_explicit(&buffer->spillFailedNs, 0, memory_order_relaxed);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillMutex) == 0);
+    // another producer may have been quicker
+    if (buffer->spare == NULL) {
+        buffer->spare = segment;
+        segment = NULL;
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillMutex) == 0);
+    if (segment != NULL)
+        segment_destroy(segment);
+    return true;
+}
+
+// whether spilling can move the oldest reading the ring holds for the readers
+static bool spillable(sbuffer_t* buffer) {
+    size_t from = protected_tail(buffer);
+    return from != NO_RELIABLE_READER && from < atomic_load(&buffer->head)
+           && atomic_load_explicit(&buffer->slots[from & buffer->mask].sequence, memory_order_acquire) == from + 1;
+}
+
+// copies spilled readings starting at 'position', sets 'skip' if the reader has to jump over readings no segment holds
+static size_t take_spilled(sbuffer_t* buffer, size_t position, sensor_data_t* out, size_t max, size_t* skip) {
+    *skip = 0;
+    size_t n = 0;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillMutex) == 0);
+    for (size_t i = 0; i < vector_size(buffer->segments) && n < max; i++) {
+        sbuffer_segment_t* segment = vector_at(buffer->segments, i);
+        size_t next = position + *skip + n;
+        if (next >= segment->first + segment->count)
+            continue;
+        if (next < segment->first) {
+            // only an SBUFFER_DELIVER_LATEST reader can miss readings on disk
+            if (n > 0)
+                break;
+            *skip = segment->first - position;
+            next = segment->first;
+        }
+        size_t run = segment->first + segment->count - next;
+        if (run > max - n)
+            run = max - n;
+        memcpy(out + n, &segment->readings[next - segment->first], run * sizeof(*out));
+        n += run;
+    }
+    if (n == 0) {
+        // nothing on disk covers this position anymore
+        size_t end = atomic_load(&buffer->spillEnd);
+        *skip = end > position ? end - position : 0;
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillMutex) == 0);
+    return n;
+}
+
+// deletes the segments every SBUFFER_DELIVER_ALL reader has passed
+static void drop_passed_segments(sbuffer_t* buffer) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillMutex) == 0);
+    size_t tail = reliable_tail(buffer);
+    while (vector_size(buffer->segments) > 0) {
+        sbuffer_segment_t* segment = vector_at(buffer->segments, 0);
+        bool full = segment->count == SBUFFER_SEGMENT_READINGS || vector_size(buffer->segments) > 1;
+        if (tail != NO_RELIABLE_READER && (tail < segment->first + segment->count || !full))
+            break;
+        vector_remove_at_index(buffer->segments, 0);
+        segment_destroy(segment);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillMutex) == 0);
+}
+
+// waits until the reader has something to read, the buffer is closed or 'deadline' passed (NULL waits forever)
+static void wait_for_data(sbuffer_t* buffer, sbuffer_reader_t* reader, const struct timespec* deadline) {
+#if SBUFFER_LOCKFREE
+    for (int i = 0; i < SBUFFER_SPIN; i++) {
+        if (has_data(buffer, reader) || atomic_load(&buffer->closed))
+            return;
+        cpu_relax();
+    }
+#endif
+    while (!has_data(buffer, reader) && !atomic_load(&buffer->closed)) {
+#if SBUFFER_LOCKFREE
+        uint32_t wakeup = atomic_load(&reader->wakeup);
+#endif
+        atomic_store(&reader->parked, true);
+        atomic_fetch_add(&buffer->parkedReaders, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        int rc = 0;
+        if (!has_data(buffer, reader) && !atomic_load(&buffer->closed)) {
+#if SBUFFER_LOCKFREE
+            rc = futex_wait(&reader->wakeup, wakeup, deadline);
+#else
+            rc = deadline == NULL
+                     ? pthread_cond_wait(&reader->condition, &buffer->mutex)
+                     : pthread_cond_timedwait(&reader->condition, &buffer->mutex, deadline);
+#endif
+        }
+        atomic_fetch_sub(&buffer->parkedReaders, 1);
+        atomic_store(&reader->parked, false);
+        ASSERT_ELSE_PERROR(rc == 0 || rc == ETIMEDOUT);
+        if (rc == ETIMEDOUT)
+            return;
+    }
+}
+
+// whether a producer waiting to write position 'last' has something to try again
+static bool producer_may_go_on(sbuffer_t* buffer, size_t last) {
+    if (has_space(buffer, last) || atomic_load(&buffer->closed))
+        return true;
+    // spilling waits for a producer still writing the oldest reading, which wakes us once it is done
+    return buffer->policy == SBUFFER_OVERLOAD_SPILL && spillable(buffer);
+}
+
+// parks the producer until producer_may_go_on(), it may also return early
+static void park_producer(sbuffer_t* buffer, size_t last) {
+#if SBUFFER_LOCKFREE
+    for (int i = 0; i < SBUFFER_SPIN; i++) {
+        if (producer_may_go_on(buffer, last))
+            return;
+        cpu_relax();
+    }
+    uint32_t wakeup = atomic_load(&buffer->spaceWakeup);
+#endif
+    atomic_fetch_add(&buffer->parkedProducers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!producer_may_go_on(buffer, last)) {
+#if SBUFFER_LOCKFREE
+        futex_wait(&buffer->spaceWakeup, wakeup, NULL);
+#else
+        ASSERT_ELSE_PERROR(pthread_cond_wait(&buffer->notFull, &buffer->mutex) == 0);
+#endif
+    }
+    atomic_fetch_sub(&buffer->parkedProducers, 1);
+}
+
+static void publish(sbuffer_t* buffer, size_t position, sensor_data_t const* data) {
+    sbuffer_slot_t* slot = &buffer->slots[position & buffer->mask];
+    // without waiting for the readers, the producer of the previous lap may still be writing this slot
+    if (position >= buffer->capacity) {
+        size_t previous = position - buffer->capacity + 1;
+        for (int spins = 0; atomic_load_explicit(&slot->sequence, memory_order_acquire) != previous; spins++) {
+            if (spins < SBUFFER_SPIN)
+                cpu_relax();
+            else
+                sched_yield();
+        }
+    }
+    // mark the slot as being rewritten, so a reader copying it can tell
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->data = *data;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+// before positions up to 'last' are written, moves every reader that may be lapped past the readings they overwrite
+static void lap_readers(sbuffer_t* buffer, size_t last) {
+    if (last < buffer->capacity)
+        return;
+    size_t oldest = last - buffer->capacity + 1; // oldest reading left in the ring
+    _Atomic size_t* users;
+    sbuffer_reader_list_t* list = list_acquire(buffer, &users);
+    for (size_t i = 0; i < list->count; i++) {
+        sbuffer_reader_t* reader = list->readers[i];
+        if (!may_be_lapped(buffer, reader))
+            continue;
+        size_t cursor = atomic_load(&reader->cursor);
+        while (cursor < oldest && !atomic_compare_exchange_weak(&reader->cursor, &cursor, oldest))
+            ;
+        if (cursor >= oldest)
+            continue;
+        atomic_fetch_add_explicit(&reader->skipped, oldest - cursor, memory_order_relaxed);
+        if (reader->delivery == SBUFFER_DELIVER_ALL)
+            atomic_fetch_add_explicit(&buffer->dropped, oldest - cursor, memory_order_relaxed);
+    }
+    list_release(users);
+}
+
+// publishes the 'count' readings in 'data' at the claimed positions from 'first' on
+static void publish_run(sbuffer_t* buffer, size_t first, sensor_data_t const* data, size_t count) {
+    if (count == 0)
+        return;
+    lap_readers(buffer, first + count - 1);
+    for (size_t i = 0; i < count; i++)
+        publish(buffer, first + i, &data[i]);
+}
+
+// copies the reading at 'position' if it is published, returns false if it is not or got rewritten while copying
+static bool copy_slot(sbuffer_t* buffer, size_t position, sensor_data_t* out, bool checked) {
+    sbuffer_slot_t* slot = &buffer->slots[position & buffer->mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1)
+        return false;
+    *out = slot->data;
+    // otherwise the producers wait for the reader, so the slot cannot have changed
+    if (!checked)
+        return true;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->sequence, memory_order_relaxed) == position + 1;
+}
+
+// copies up to 'max' published readings for 'reader' into 'out' and advances its cursor
+static size_t take(sbuffer_t* buffer, sbuffer_reader_t* reader, sensor_data_t* out, size_t max) {
+    bool lappable = may_be_lapped(buffer, reader);
+    bool checked = may_change(buffer, reader);
+    size_t cursor = atomic_load_explicit(&reader->cursor, memory_order_acquire);
+    bool fromDisk;
+    size_t skipped;
+    size_t n;
+    do {
+        fromDisk = false;
+        skipped = 0;
+        n = 0;
+        while (n < max) {
+            size_t position = cursor + skipped + n;
+            if (position < atomic_load_explicit(&buffer->spillEnd, memory_order_acquire)) {
+                size_t skip;
+                size_t got = take_spilled(buffer, position, out + n, max - n, &skip);
+                if (skip > 0) {
+                    assert(reader->delivery == SBUFFER_DELIVER_LATEST);
+                    // hand over what we have before jumping
+                    if (n > 0)
+                        break;
+                    skipped += skip;
+                }
+                n += got;
+                fromDisk = true;
+                continue;
+            }
+            if (copy_slot(buffer, position, &out[n], checked)) {
+                n++;
+                continue;
+            }
+            // the reading may have just been moved to disk and overwritten
+            if (position < atomic_load_explicit(&buffer->spillEnd, memory_order_acquire))
+                continue;
+            break;
+        }
+        // a producer that lapped the reader meanwhile moved its cursor on and counted what we copied as skipped
+    } while (lappable && !atomic_compare_exchange_strong(&reader->cursor, &cursor, cursor + skipped + n));
+    if (!lappable)
+        atomic_store_explicit(&reader->cursor, cursor + skipped + n, memory_order_release);
+    if (skipped > 0)
+        atomic_fetch_add_explicit(&reader->skipped, skipped, memory_order_relaxed);
+    if (n > 0)
+        atomic_fetch_add_explicit(&reader->removed, n, memory_order_relaxed);
+    if (fromDisk && reader->delivery == SBUFFER_DELIVER_ALL)
+        drop_passed_segments(buffer);
+    if (n > 0 && reader->delivery == SBUFFER_DELIVER_ALL)
+        wake_producers(buffer);
+    return n;
+}
+
+static sbuffer_reader_list_t* reader_list_create(size_t count) {
+    sbuffer_reader_list_t* list = malloc(sizeof(*list) + count * sizeof(list->readers[0]));
+    assert(list != NULL);
+    list->count = count;
+    return list;
 }
 
 sbuffer_t* sbuffer_create() {
-    sbuffer_t* buffer = malloc(sizeof(sbuffer_t));
+    return sbuffer_create_bounded(SBUFFER_CAPACITY, SBUFFER_OVERLOAD);
+}
+
+sbuffer_t* sbuffer_create_bounded(size_t capacity, sbuffer_overload_t policy) {
+    assert(capacity > 0);
+    sbuffer_t* buffer = aligned_alloc(CACHE_LINE_SIZE, sizeof(sbuffer_t));
     // should never fail due to optimistic memory allocation
     assert(buffer != NULL);
 
-    buffer->head = NULL;
-    buffer->tail = NULL;
-    buffer->closed = false;
-    //ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->mutex, NULL) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_init(&buffer->rwlock, NULL) == 0);        //creatie readwrite lock
-    //buffer->rwlock = PTHREAD_RWLOCK_INITIALIZER;
-    //printf("Creation of ReadWritelock");
-    buffer->dataManager = 0;
-    buffer->storageManager = 0;
-
-    pthread_cond_init(&buffer->dataManagerCondition, NULL);
-    pthread_cond_init(&buffer->storageManagerCondition, NULL);
-    pthread_mutex_init(&buffer->dataManagerMutex, NULL);
-    pthread_mutex_init(&buffer->storageManagerMutex, NULL);
+    buffer->capacity = 1;
+    while (buffer->capacity < capacity)
+        buffer->capacity <<= 1;
+    buffer->mask = buffer->capacity - 1;
+    buffer->policy = policy;
+    buffer->slots = aligned_alloc(CACHE_LINE_SIZE, buffer->capacity * sizeof(*buffer->slots));
+    assert(buffer->slots != NULL);
+    for (size_t i = 0; i < buffer->capacity; i++)
+        atomic_init(&buffer->slots[i].sequence, 0);
+
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->readers, reader_list_create(0));
+    atomic_init(&buffer->listEpoch, 0);
+    atomic_init(&buffer->closed, false);
+    buffer->waiter = NULL;
+    atomic_init(&buffer->parkedReaders, 0);
+    atomic_init(&buffer->parkedProducers, 0);
+    atomic_init(&buffer->dropped, 0);
+    atomic_init(&buffer->delayed, 0);
+    atomic_init(&buffer->sampled, 0);
+    atomic_init(&buffer->spilled, 0);
+    atomic_init(&buffer->peakDepth, 0);
+    for (size_t i = 0; i < SBUFFER_STRIPES; i++) {
+        atomic_init(&buffer->counters[i].inserted, 0);
+        atomic_init(&buffer->counters[i].waitNs, 0);
+        atomic_init(&buffer->counters[i].lockContended, 0);
+        atomic_init(&buffer->counters[i].lockWaitNs, 0);
+        atomic_init(&buffer->counters[i].listUsers[0], 0);
+        atomic_init(&buffer->counters[i].listUsers[1], 0);
+    }
+    atomic_init(&buffer->spillEnd, 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->spillMutex, NULL) == 0);
+    buffer->segments = vector_create();
+    assert(buffer->segments != NULL);
+    buffer->spare = NULL;
+    atomic_init(&buffer->segmentsCreated, 0);
+    atomic_init(&buffer->spillFailedNs, 0);
+    const char* spill_dir = getenv("SBUFFER_SPILL_DIR");
+    buffer->spillDir = strdup(spill_dir != NULL && spill_dir[0] != '\0' ? spill_dir : TO_STRING(SBUFFER_SPILL_DIR));
+    assert(buffer->spillDir != NULL);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->mutex, NULL) == 0);
+#if SBUFFER_LOCKFREE
+    atomic_init(&buffer->spaceWakeup, 0);
+#else
+    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->notFull, NULL) == 0);
+#endif
     return buffer;
 }
 
 void sbuffer_destroy(sbuffer_t* buffer) {
     assert(buffer);
-    // make sure it's empty
-    assert(buffer->head == buffer->tail);
-    //ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->mutex) == 0);
-    printf("Destrucion of rwlock");
-    ASSERT_ELSE_PERROR(pthread_rwlock_destroy(&buffer->rwlock) == 0);
-
-    pthread_cond_destroy(&buffer->dataManagerCondition);
-    pthread_cond_destroy(&buffer->storageManagerCondition);
-    pthread_mutex_destroy(&buffer->dataManagerMutex);
-    pthread_mutex_destroy(&buffer->storageManagerMutex);
+    sbuffer_reader_list_t* list = atomic_load(&buffer->readers);
+    // make sure every reader is gone
+    assert(list->count == 0);
+    free(list);
+    for (size_t i = 0; i < vector_size(buffer->segments); i++)
+        segment_destroy(vector_at(buffer->segments, i));
+    vector_destroy(buffer->segments);
+    if (buffer->spare != NULL)
+        segment_destroy(buffer->spare);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->spillMutex) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->mutex) == 0);
+#if !SBUFFER_LOCKFREE
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->notFull) == 0);
+#endif
+    free(buffer->spillDir);
+    free(buffer->slots);
     free(buffer);
 }
 
-void sbuffer_lock(sbuffer_t* buffer) {
-    // assert(buffer);
-    // ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+sbuffer_reader_t* sbuffer_subscribe(sbuffer_t* buffer, sbuffer_delivery_t delivery) {
+    assert(buffer);
+    sbuffer_reader_t* reader = aligned_alloc(CACHE_LINE_SIZE, sizeof(*reader));
+    assert(reader != NULL);
+    // until the real cursor is known, this holds the producers back
+    atomic_init(&reader->cursor, atomic_load(&buffer->head));
+    atomic_init(&reader->skipped, 0);
+    atomic_init(&reader->parked, false);
+    atomic_init(&reader->removed, 0);
+    atomic_init(&reader->waitNs, 0);
+    reader->buffer = buffer;
+    reader->delivery = delivery;
+#if SBUFFER_LOCKFREE
+    atomic_init(&reader->wakeup, 0);
+#else
+    // timed waits are measured against the monotonic clock, so they survive wall clock changes
+    pthread_condattr_t attr;
+    ASSERT_ELSE_PERROR(pthread_condattr_init(&attr) == 0);
+    ASSERT_ELSE_PERROR(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&reader->condition, &attr) == 0);
+    pthread_condattr_destroy(&attr);
+#endif
+
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    sbuffer_reader_list_t* old = atomic_load(&buffer->readers);
+    sbuffer_reader_list_t* list = reader_list_create(old->count + 1);
+    memcpy(list->readers, old->readers, old->count * sizeof(old->readers[0]));
+    list->readers[old->count] = reader;
+    replace_readers(buffer, list);
+    // every producer that did not see the new list has claimed its positions before this point,
+    // one that did may have lapped the reader already
+    size_t head = atomic_load(&buffer->head);
+    size_t cursor = atomic_load(&reader->cursor);
+    while (cursor < head && !atomic_compare_exchange_weak(&reader->cursor, &cursor, head))
+        ;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    wake_producers(buffer);
+    return reader;
+}
+
+void sbuffer_unsubscribe(sbuffer_reader_t* reader) {
+    assert(reader);
+    sbuffer_t* buffer = reader->buffer;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    sbuffer_reader_list_t* old = atomic_load(&buffer->readers);
+    sbuffer_reader_list_t* list = reader_list_create(old->count - 1);
+    size_t j = 0;
+    for (size_t i = 0; i < old->count; i++) {
+        if (old->readers[i] != reader)
+            list->readers[j++] = old->readers[i];
+    }
+    assert(j == list->count);
+    // nobody looks at this reader anymore once the old list is gone
+    replace_readers(buffer, list);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+#if !SBUFFER_LOCKFREE
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&reader->condition) == 0);
+#endif
+    free(reader);
+    // the slots this reader was holding on to may be free now
+    BUFFER_LOCK(buffer);
+    wake_producers(buffer);
+    BUFFER_UNLOCK(buffer);
 }
-void sbuffer_unlock(sbuffer_t* buffer) {
-    // assert(buffer);
-    // ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+
+size_t sbuffer_skipped(sbuffer_reader_t* reader) {
+    assert(reader);
+    return atomic_load_explicit(&reader->skipped, memory_order_relaxed);
 }
 
 bool sbuffer_is_empty(sbuffer_t* buffer) {
     assert(buffer);
-    //ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0); //wordt enkel uitgevoerd door readers, writer checkt nooit al buffer leeg is
-    bool res = buffer->head == NULL;
-    //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
+    BUFFER_LOCK(buffer);
+    size_t tail = reliable_tail(buffer);
+    bool res = tail == NO_RELIABLE_READER || tail == atomic_load(&buffer->head);
+    BUFFER_UNLOCK(buffer);
     return res;
 }
 
 bool sbuffer_is_closed(sbuffer_t* buffer) {
     assert(buffer);
-    //ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0);    //checkt als er geen writers bezig zijn of staan te wachten, indien neen, gaat crit sec binnen
-    bool res = buffer->closed;
-    //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //unlock rwlock
-    return res;
+    return atomic_load(&buffer->closed);
 }
 
-int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {    //writer steekt iets in buffer
-    assert(buffer && data);
-    if (sbuffer_is_closed(buffer))
-        return SBUFFER_FAILURE;
-
-    // create new node
-    sbuffer_node_t* node = create_node(data);
-    assert(node->prev == NULL);
-
-    //ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);    //accure writer lock
-    bool wasEmpty = buffer->head == NULL;
-    // insert it
-    if (buffer->head != NULL)
-        buffer->head->prev = node;
-    buffer->head = node;
-    
-    if (buffer->tail == NULL) {
-        buffer->tail = node;
-    }        
-    //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-
-    if(wasEmpty) {      //als buffer leeg was, wil dit zeggen dat de readers slapen, dus maak ze wakker
-        pthread_cond_signal(&buffer->dataManagerCondition);
-        pthread_cond_signal(&buffer->storageManagerCondition);
+// number of readings the slowest SBUFFER_DELIVER_ALL reader still has to consume
+static size_t depth(sbuffer_t* buffer) {
+    size_t tail = reliable_tail(buffer);
+    size_t head = atomic_load(&buffer->head);
+    return tail != NO_RELIABLE_READER && head > tail ? head - tail : 0;
+}
+
+void sbuffer_get_stats(sbuffer_t* buffer, sbuffer_stats_t* stats) {
+    assert(buffer && stats);
+    *stats = (sbuffer_stats_t){0};
+    for (size_t i = 0; i < SBUFFER_STRIPES; i++) {
+        sbuffer_counters_t* counters = &buffer->counters[i];
+        stats->inserted += atomic_load_explicit(&counters->inserted, memory_order_relaxed);
+        stats->producer_wait_ns += atomic_load_explicit(&counters->waitNs, memory_order_relaxed);
+        stats->lock_contended += atomic_load_explicit(&counters->lockContended, memory_order_relaxed);
+        stats->lock_wait_ns += atomic_load_explicit(&counters->lockWaitNs, memory_order_relaxed);
     }
+    stats->dropped = atomic_load_explicit(&buffer->dropped, memory_order_relaxed);
+    stats->delayed = atomic_load_explicit(&buffer->delayed, memory_order_relaxed);
+    stats->spilled = atomic_load_explicit(&buffer->spilled, memory_order_relaxed);
+    stats->depth = depth(buffer);
+    stats->peak_depth = atomic_load_explicit(&buffer->peakDepth, memory_order_relaxed);
+    if (stats->depth > stats->peak_depth)
+        stats->peak_depth = stats->depth;
+}
 
-    return SBUFFER_SUCCESS;
+void sbuffer_get_reader_stats(sbuffer_reader_t* reader, sbuffer_reader_stats_t* stats) {
+    assert(reader && stats);
+    size_t head = atomic_load(&reader->buffer->head);
+    size_t cursor = atomic_load_explicit(&reader->cursor, memory_order_relaxed);
+    stats->removed = atomic_load_explicit(&reader->removed, memory_order_relaxed);
+    stats->skipped = atomic_load_explicit(&reader->skipped, memory_order_relaxed);
+    stats->lag = head > cursor ? head - cursor : 0;
+    stats->wait_ns = atomic_load_explicit(&reader->waitNs, memory_order_relaxed);
 }
 
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer) {
-    assert(buffer);
-    //ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0);
-    // if there are no elements in the buffer we check if the buffer is closed, if that is the case we return a new sensor data struct with value -infinite
-    // else we wait untill there are new elements in the buffer
-    if(buffer->head == NULL) {
-        if(buffer->closed) {
-            //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-            ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-            sensor_data_t data;
-            data.value =  -INFINITY;
-            return data;
-        }
-        //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-        while(buffer->head == NULL && !buffer->closed) {    //als buffer leeg is moeten reader threads slapen tot writer er terug iets insteekt
-            if(pthread_self() == buffer->dataManager) {
-                ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //laat read lock los terwijl sleep
-                // printf("Datamanager %ul: sleeping (Current tid: %ul) \n", buffer->dataManager, pthread_self());
-                ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->dataManagerMutex) == 0);
-                ASSERT_ELSE_PERROR(pthread_cond_wait(&(buffer->dataManagerCondition), &(buffer->dataManagerMutex)) == 0);   
-                ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->dataManagerMutex) == 0);
-                ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0);    //neem read lock terug na sleem
-            }  
-            else if(pthread_self() == buffer->storageManager) {
-                ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //laat read lock los terwijl sleep
-                // printf("Storagemanager %ul: sleeping (Current tid: %ul) \n", buffer->dataManager, pthread_self());
-                ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->storageManagerMutex) == 0);
-                ASSERT_ELSE_PERROR(pthread_cond_wait(&(buffer->storageManagerCondition), &(buffer->storageManagerMutex)) == 0);   
-                ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->storageManagerMutex) == 0);
-
-                ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0);    //neem read lock terug na sleem
-            } 
-            else {
-                ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //laat read lock los voor return
-                sensor_data_t data;
-                data.value =  -INFINITY;
-                return data;
+int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
+    return sbuffer_insert_batch(buffer, data, 1);
+}
+
+// inserts as many of 'count' readings as fit right now and drops the rest
+static size_t insert_or_drop_newest(sbuffer_t* buffer, sensor_data_t const* data, size_t count) {
+    size_t head = atomic_load(&buffer->head);
+    size_t n;
+    do {
+        n = free_slots(buffer, head, count);
+    } while (n > 0 && !atomic_compare_exchange_weak(&buffer->head, &head, head + n));
+    publish_run(buffer, head, data, n);
+    if (n < count)
+        atomic_fetch_add_explicit(&buffer->dropped, count - n, memory_order_relaxed);
+    return n;
+}
+
+/*
+    Positions are only claimed once their slots are free: a producer that claimed positions
+    and then gave up waiting would leave readers stuck in front of slots nobody publishes.
+*/
+// inserts the first readings of 'data' that fit once the slowest reader or spilling made room
+// returns how many readings it went through, 'inserted' of them made it in, 0 if the buffer got closed
+static size_t insert_or_wait(sbuffer_t* buffer, sbuffer_counters_t* counters, sensor_data_t const* data, size_t count, size_t* inserted) {
+    uint64_t start = 0;
+    size_t head = atomic_load(&buffer->head);
+    size_t n = 0;
+    while (!atomic_load(&buffer->closed)) {
+        if (buffer->policy == SBUFFER_OVERLOAD_SPILL && !make_room(buffer, count)) {
+            if (add_spare_segment(buffer)) {
+                head = atomic_load(&buffer->head);
+                continue;
             }
+            // most likely the disk is full, the producer is not held back for that
+            *inserted = insert_or_drop_newest(buffer, data, count);
+            return count;
         }
-        // printf("Thread %ul: wakes \n", pthread_self());  
-    }
-    
-    assert(buffer->head != NULL);
-
-    sbuffer_node_t* removed_node = buffer->tail;
-
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-
-    // if there is no set reader set to this thread and return data
-    ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);    //neem writelock om readby te zetten, moet voor if om dataraces te vermijden
-    if(!removed_node->readBy){
-        removed_node->readBy = pthread_self();
-        //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-        ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //unlocken voor return!
-        return removed_node->data;
-    } 
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //voor moest if niet zijn uitgevoerd
-    // printf("READBY: %lu \n" , removed_node->readBy);
-    // if the node is already read by another node delete the node and return data
-    if(removed_node->readBy != pthread_self()) {
-        assert(removed_node != NULL);
-        ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);
-        if (removed_node == buffer->head) {
-            buffer->head = NULL;
-            assert(removed_node == buffer->tail);
+        n = free_slots(buffer, head, count);
+        if (n > 0) {
+            if (atomic_compare_exchange_weak(&buffer->head, &head, head + n))
+                break;
+            continue;
         }
-        buffer->tail = removed_node->prev;
-        //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-        ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-
-        sensor_data_t ret = removed_node->data;
-        free(removed_node);
-        return ret;
+        if (start == 0)
+            start = now_ns();
+        park_producer(buffer, head);
+        head = atomic_load(&buffer->head);
     }
-    sbuffer_node_t* previous_node = removed_node;
-    removed_node = removed_node->prev;
-    while(removed_node != NULL && removed_node->readBy == pthread_self()) {
-        previous_node = removed_node;
-        removed_node = removed_node->prev;
+    if (start != 0) {
+        atomic_fetch_add_explicit(&buffer->delayed, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->waitNs, now_ns() - start, memory_order_relaxed);
     }
+    publish_run(buffer, head, data, n);
+    *inserted = n;
+    return n;
+}
 
-    if(removed_node == NULL) {
-        ASSERT_ELSE_PERROR(pthread_rwlock_rdlock(&buffer->rwlock) == 0);    //neem readlock om te zien als buffer leeg is
-        if(buffer->closed) {
-            ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //laat read lock los voor return
-            //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-            sensor_data_t data;
-            data.value =  -INFINITY;
+static bool above_high_water(sbuffer_t* buffer) {
+    size_t tail = reliable_tail(buffer);
+    size_t head = atomic_load(&buffer->head);
+    return tail != NO_RELIABLE_READER && head > tail && (head - tail) * 100 >= buffer->capacity * SBUFFER_HIGH_WATER;
+}
 
-            return data;
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t const* data, size_t count) {
+    assert(buffer && (data || count == 0));
+    BUFFER_LOCK(buffer);
+    sbuffer_counters_t* counters = local_counters(buffer);
+    while (count > 0) {
+        if (atomic_load(&buffer->closed)) {
+            BUFFER_UNLOCK(buffer);
+            return SBUFFER_FAILURE;
+        }
+        size_t n = count < buffer->capacity ? count : buffer->capacity;
+        size_t inserted = n;
+        if (buffer->policy == SBUFFER_OVERLOAD_DROP_OLDEST) {
+            publish_run(buffer, atomic_fetch_add(&buffer->head, n), data, n);
+        } else if (buffer->policy == SBUFFER_OVERLOAD_BLOCK || buffer->policy == SBUFFER_OVERLOAD_SPILL) {
+            n = insert_or_wait(buffer, counters, data, n, &inserted);
+            if (n == 0) {
+                BUFFER_UNLOCK(buffer);
+                return SBUFFER_FAILURE;
+            }
+        } else if (buffer->policy == SBUFFER_OVERLOAD_SAMPLE && above_high_water(buffer)) {
+            inserted = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (atomic_fetch_add_explicit(&buffer->sampled, 1, memory_order_relaxed) % SBUFFER_SAMPLE_EVERY == 0)
+                    inserted += insert_or_drop_newest(buffer, &data[i], 1);
+                else
+                    atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+            }
+        } else {
+            inserted = insert_or_drop_newest(buffer, data, n);
         }
-        //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-        if(pthread_self() == buffer->dataManager) {
-            ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-            pthread_cond_signal(&buffer->storageManagerCondition);
-            // printf("Datamanager %ul: sleeping \n", pthread_self());
-            pthread_mutex_lock(&buffer->dataManagerMutex);
-            pthread_cond_wait(&(buffer->dataManagerCondition), &(buffer->dataManagerMutex));   
-            pthread_mutex_unlock(&buffer->dataManagerMutex);
-        }  
-        else if(pthread_self() == buffer->storageManager) {
-            ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-            // printf("Storagemanager %ul: sleeping \n", pthread_self());
-            pthread_mutex_lock(&buffer->storageManagerMutex);
-            pthread_cond_wait(&(buffer->storageManagerCondition), &(buffer->storageManagerMutex));   
-            pthread_mutex_unlock(&buffer->storageManagerMutex);
-        } 
-        // printf("Thread %ul: wakes \n", pthread_self()); 
-
-        return sbuffer_remove_last(buffer);
+        atomic_fetch_add_explicit(&counters->inserted, inserted, memory_order_relaxed);
+        data += n;
+        count -= n;
+        atomic_thread_fence(memory_order_seq_cst);
+        signal_readers(buffer);
+        // another producer may be waiting to spill what we just published
+        if (SBUFFER_LOCKFREE && buffer->policy == SBUFFER_OVERLOAD_SPILL)
+            signal_producers(buffer);
     }
+    size_t current = depth(buffer);
+    size_t peak = atomic_load_explicit(&buffer->peakDepth, memory_order_relaxed);
+    while (current > peak && !atomic_compare_exchange_weak_explicit(&buffer->peakDepth, &peak, current, memory_order_relaxed, memory_order_relaxed))
+        ;
+    BUFFER_UNLOCK(buffer);
+    return SBUFFER_SUCCESS;
+}
 
-    ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);    //neem writelock om readby en previous_node te zetten, moet voor if om dataraces te vermijden
-    if(!removed_node->readBy){
-        removed_node->readBy = pthread_self();
-        //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-        ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);    //unlocken voor return!
-        return removed_node->data;
-    } 
-
-    if (removed_node == buffer->head) {
-        buffer->head = previous_node;
-        // assert(removed_node == buffer->tail);
-    }
-    previous_node->prev = removed_node->prev;
-    //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
+sensor_data_t sbuffer_remove_last(sbuffer_reader_t* reader) {
+    sensor_data_t data;
+    if (sbuffer_remove_batch(reader, &data, 1, -1) != 1)
+        data.value = -INFINITY;
+    return data;
+}
 
-    sensor_data_t ret = removed_node->data;
-    free(removed_node);
-    return ret;
+int sbuffer_remove_batch(sbuffer_reader_t* reader, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(reader && (out || max == 0));
+    sbuffer_t* buffer = reader->buffer;
+    struct timespec deadline;
+    if (timeout_ms > 0)
+        deadline_after(&deadline, timeout_ms);
 
+    BUFFER_LOCK(buffer);
+    size_t n = take(buffer, reader, out, max);
+    if (n == 0 && timeout_ms != 0) {
+        uint64_t start = now_ns();
+        wait_for_data(buffer, reader, timeout_ms > 0 ? &deadline : NULL);
+        atomic_fetch_add_explicit(&reader->waitNs, now_ns() - start, memory_order_relaxed);
+        n = take(buffer, reader, out, max);
+    }
+    // readings published before the buffer was closed are still handed out first
+    if (n == 0 && atomic_load(&buffer->closed))
+        n = take(buffer, reader, out, max);
+    int res = n > 0 || !atomic_load(&buffer->closed) ? (int) n : SBUFFER_FAILURE;
+    BUFFER_UNLOCK(buffer);
+    return res;
 }
 
 void sbuffer_close(sbuffer_t* buffer) {
     assert(buffer);
-    //ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);    //write in buffer
-    buffer->closed = true;  
-    //ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
+    BUFFER_LOCK(buffer);
+    atomic_store(&buffer->closed, true);
+    // wake everyone so they can notice the buffer is closed
+    wake_producers(buffer);
+    wake_readers(buffer);
+    BUFFER_UNLOCK(buffer);
+}
+
+sbuffer_waiter_t* sbuffer_waiter_create() {
+    sbuffer_waiter_t* waiter = malloc(sizeof(*waiter));
+    assert(waiter != NULL);
+    atomic_init(&waiter->wakeup, 0);
+    atomic_init(&waiter->parked, 0);
+    return waiter;
 }
 
+void sbuffer_waiter_destroy(sbuffer_waiter_t* waiter) {
+    free(waiter);
+}
+
+void sbuffer_attach_waiter(sbuffer_t* buffer, sbuffer_waiter_t* waiter) {
+    assert(buffer && waiter && buffer->waiter == NULL);
+    buffer->waiter = waiter;
+}
+
+uint32_t sbuffer_waiter_prepare(sbuffer_waiter_t* waiter) {
+    assert(waiter);
+    uint32_t ticket = atomic_load(&waiter->wakeup);
+    atomic_fetch_add(&waiter->parked, 1);
+    // pairs with the fence of a producer: either it sees us parked, or the caller's last look sees its readings
+    atomic_thread_fence(memory_order_seq_cst);
+    return ticket;
+}
+
+void sbuffer_waiter_wait(sbuffer_waiter_t* waiter, uint32_t ticket, int timeout_ms) {
+    assert(waiter);
+    if (timeout_ms != 0) {
+        struct timespec deadline;
+        if (timeout_ms > 0)
+            deadline_after(&deadline, timeout_ms);
+        futex_wait(&waiter->wakeup, ticket, timeout_ms > 0 ? &deadline : NULL);
+    }
+    atomic_fetch_sub(&waiter->parked, 1);
+}
 
-void setManagers(sbuffer_t* buffer, unsigned long datamgr, unsigned long storagemgr) {
-    // printf("Datamanger: %ul, StorageManger; %ul \n", datamgr, storagemgr);
-    ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);
-    buffer->dataManager = datamgr;
-    buffer->storageManager = storagemgr;
-    ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
-    // printf("Datamanger: %ul, StorageManger; %ul \n", buffer->dataManager, buffer->storageManager);
+void sbuffer_waiter_wake(sbuffer_waiter_t* waiter) {
+    assert(waiter);
+    atomic_thread_fence(memory_order_seq_cst);
+    signal_waiter(waiter);
 }
@@ -10,52 +10,208 @@
 
 #include "config.h"
 #include <pthread.h>
+#include <stdint.h>
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 
+// default number of preallocated reading slots in the ring
+#ifndef SBUFFER_CAPACITY
+    #define SBUFFER_CAPACITY 4096
+#endif
+
+// default overload policy, see sbuffer_overload_t; spilling keeps a slow reader from stalling the connection threads without losing readings
+#ifndef SBUFFER_OVERLOAD
+    #define SBUFFER_OVERLOAD SBUFFER_OVERLOAD_SPILL
+#endif
+
+// SBUFFER_OVERLOAD_SAMPLE starts sampling and SBUFFER_OVERLOAD_SPILL starts spilling once the slowest reader is this many percent of the ring behind
+#ifndef SBUFFER_HIGH_WATER
+    #define SBUFFER_HIGH_WATER 75
+#endif
+
+// SBUFFER_OVERLOAD_SAMPLE keeps one in this many readings while sampling
+#ifndef SBUFFER_SAMPLE_EVERY
+    #define SBUFFER_SAMPLE_EVERY 4
+#endif
+
+// directory SBUFFER_OVERLOAD_SPILL writes its segment files to, unless the SBUFFER_SPILL_DIR environment variable names another
+#ifndef SBUFFER_SPILL_DIR
+    #define SBUFFER_SPILL_DIR /var/tmp
+#endif
+
+// number of readings in one spill segment file
+#ifndef SBUFFER_SEGMENT_READINGS
+    #define SBUFFER_SEGMENT_READINGS 65536
+#endif
+
+// build with -DSBUFFER_LOCKFREE=1 to hand readings over without locks, waiting threads then park on a futex
+#ifndef SBUFFER_LOCKFREE
+    #define SBUFFER_LOCKFREE 0
+#endif
+
 typedef struct sbuffer sbuffer_t;
+typedef struct sbuffer_reader sbuffer_reader_t;
+typedef struct sbuffer_waiter sbuffer_waiter_t;
+
+typedef enum {
+    SBUFFER_DELIVER_ALL,    // the producer waits for this reader, it sees every reading
+    SBUFFER_DELIVER_LATEST, // never holds the producer back, readings it falls a full ring behind on are skipped
+} sbuffer_delivery_t;
+
+// what the producer does when the slowest SBUFFER_DELIVER_ALL reader is a full ring behind
+typedef enum {
+    SBUFFER_OVERLOAD_BLOCK,       // wait until that reader catches up
+    SBUFFER_OVERLOAD_DROP_OLDEST, // overwrite, readers that fell a full ring behind skip the overwritten readings
+    SBUFFER_OVERLOAD_DROP_NEWEST, // readings that do not fit are not inserted
+    SBUFFER_OVERLOAD_SAMPLE,      // above SBUFFER_HIGH_WATER keep one in SBUFFER_SAMPLE_EVERY readings, drop the newest when full
+    SBUFFER_OVERLOAD_SPILL,       // above SBUFFER_HIGH_WATER move the oldest readings to segment files in SBUFFER_SPILL_DIR,
+                                  // drop the newest while those cannot be created
+} sbuffer_overload_t;
+
+typedef struct {
+    size_t inserted;           // readings that made it into the buffer
+    size_t dropped;            // readings lost to the overload policy
+    size_t delayed;            // readings the producer had to wait for a free slot for
+    size_t spilled;            // readings moved to disk
+    size_t depth;              // readings the slowest SBUFFER_DELIVER_ALL reader has yet to consume
+    size_t peak_depth;         // highest depth seen after an insert
+    uint64_t producer_wait_ns; // time producers spent waiting for a free slot
+    size_t lock_contended;     // times the buffer lock was already held, always 0 with SBUFFER_LOCKFREE
+    uint64_t lock_wait_ns;     // time spent waiting for the buffer lock
+} sbuffer_stats_t;
+
+typedef struct {
+    size_t removed;   // readings this reader consumed
+    size_t skipped;   // see sbuffer_skipped
+    size_t lag;       // readings inserted that this reader has yet to consume
+    uint64_t wait_ns; // time spent waiting for data while caught up
+} sbuffer_reader_stats_t;
 
 /**
- * Allocate and initialize a new shared buffer
+ * Allocate and initialize a new shared buffer of SBUFFER_CAPACITY slots with the SBUFFER_OVERLOAD policy
  */
 sbuffer_t* sbuffer_create();
 
+/**
+ * Allocate and initialize a new shared buffer
+ * \param capacity the number of readings the ring holds, rounded up to a power of two
+ * \param policy what inserting does when the ring is full
+ */
+sbuffer_t* sbuffer_create_bounded(size_t capacity, sbuffer_overload_t policy);
+
 /**
  * Clean up & free all allocated resources
  */
 void sbuffer_destroy(sbuffer_t* buffer);
 
+/**
+ * Attaches a new reader to the buffer. Every reader has its own cursor and wakes up on its own.
+ * It starts at the next inserted reading, so subscribe before the producers start to see everything.
+ * \param delivery whether the producer has to wait for this reader when the ring is full
+ * \return the reader handle, only to be used by one thread at a time
+ */
+sbuffer_reader_t* sbuffer_subscribe(sbuffer_t* buffer, sbuffer_delivery_t delivery);
+
+/**
+ * Detaches 'reader' from its buffer and frees it, the slots it still held become reusable
+ */
+void sbuffer_unsubscribe(sbuffer_reader_t* reader);
+
+/**
+ * Returns how many readings an SBUFFER_DELIVER_LATEST reader missed because it fell behind
+ */
+size_t sbuffer_skipped(sbuffer_reader_t* reader);
+
+/**
+ * Returns true if every SBUFFER_DELIVER_ALL reader has consumed every inserted reading
+ */
 bool sbuffer_is_empty(sbuffer_t* buffer);
 
 bool sbuffer_is_closed(sbuffer_t* buffer);
 
-/*
-    Gain/release exclusive access to the buffer
-    TODO: these functions should not exist!
-        All buffer synchronization should be
-        internal to the buffer, users should not
-        be concerned with it!
-*/
-void sbuffer_lock(sbuffer_t* buffer);
-void sbuffer_unlock(sbuffer_t* buffer);
+/**
+ * Fills out 'stats' with the counters of 'buffer', apart from depth they only ever grow
+ * Safe to call from any thread while the buffer is in use
+ */
+void sbuffer_get_stats(sbuffer_t* buffer, sbuffer_stats_t* stats);
+
+/**
+ * Fills out 'stats' with the counters of 'reader', safe to call from any thread until the buffer is destroyed
+ */
+void sbuffer_get_reader_stats(sbuffer_reader_t* reader, sbuffer_reader_stats_t* stats);
 
 /**
  * Inserts the sensor data in 'data' at the start of 'buffer' (at the 'head')
+ * When the slowest SBUFFER_DELIVER_ALL reader is a full ring behind, the overload policy decides what happens
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be _copied_ into the buffer
- * \return the current status of the buffer
+ * \return SBUFFER_FAILURE if the buffer was closed, SBUFFER_SUCCESS otherwise, even if the policy dropped the reading
  */
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data);
 
 /**
- * Removes & returns the last measurement in the buffer (at the 'tail')
- * \return the removed measurement
+ * Inserts 'count' readings from 'data' in order, taking the buffer lock once per
+ * stretch of free slots instead of once per reading
+ * When the slowest SBUFFER_DELIVER_ALL reader is a full ring behind, the overload policy decides what happens
+ * \param buffer a pointer to the buffer that is used
+ * \param data an array of 'count' readings, that will be _copied_ into the buffer
+ * \param count the number of readings in 'data'
+ * \return SBUFFER_FAILURE if the buffer was closed, SBUFFER_SUCCESS otherwise, even if the policy dropped readings
+ */
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t const* data, size_t count);
+
+/**
+ * Returns the oldest measurement 'reader' has not seen yet (at its own 'tail')
+ * Blocks while the reader is caught up and the buffer is not closed
+ * \return the measurement, or one with value -INFINITY once the buffer is closed and drained
+ */
+sensor_data_t sbuffer_remove_last(sbuffer_reader_t* reader);
+
+/**
+ * Copies up to 'max' of the oldest measurements 'reader' has not seen yet into 'out'
+ * \param out an array that can hold at least 'max' readings
+ * \param max the maximum number of readings to return
+ * \param timeout_ms how long to wait for data if the reader is caught up: 0 returns immediately, -1 waits forever
+ * \return the number of readings copied (0 if the timeout expired), or SBUFFER_FAILURE once the buffer is closed and drained
  */
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer);
+int sbuffer_remove_batch(sbuffer_reader_t* reader, sensor_data_t* out, size_t max, int timeout_ms);
 
 /**
  * Closes the buffer. This signifies that no more data will be inserted.
  */
 void sbuffer_close(sbuffer_t* buffer);
 
-void setManagers(sbuffer_t* buffer, unsigned long datamgr, unsigned long storagemgr);
+/**
+ * Creates a waiter, for a thread that reads from several buffers to sleep until any of them has data
+ */
+sbuffer_waiter_t* sbuffer_waiter_create();
+
+/**
+ * Frees the waiter, once no buffer it is attached to has producers anymore
+ */
+void sbuffer_waiter_destroy(sbuffer_waiter_t* waiter);
+
+/**
+ * Has every insert into 'buffer', and closing it, wake 'waiter' as well
+ * Attach it before the producers start, a buffer has at most one waiter
+ */
+void sbuffer_attach_waiter(sbuffer_t* buffer, sbuffer_waiter_t* waiter);
+
+/**
+ * Starts a wait on 'waiter': call this, then look at every reader with sbuffer_remove_batch() and a timeout of 0,
+ * then sbuffer_waiter_wait() with what this returned. Nothing inserted in between goes unnoticed.
+ * \return the ticket to hand to sbuffer_waiter_wait()
+ */
+uint32_t sbuffer_waiter_prepare(sbuffer_waiter_t* waiter);
+
+/**
+ * Sleeps until an attached buffer got an insert or was closed, or sbuffer_waiter_wake() was called, since the
+ * sbuffer_waiter_prepare() that returned 'ticket'; it may also return early
+ * \param timeout_ms how long to sleep at most: 0 only ends the wait, say when the readers had data after all, -1 sleeps until woken
+ */
+void sbuffer_waiter_wait(sbuffer_waiter_t* waiter, uint32_t ticket, int timeout_ms);
+
+/**
+ * Wakes the thread waiting on 'waiter' for something other than the buffers, from any thread
+ */
+void sbuffer_waiter_wake(sbuffer_waiter_t* waiter);
@@ -8,43 +8,54 @@
 
 #include "sensor_db.h"
 
+#include "lib/logger.h"
+
 #include <assert.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define RUN_QUERY(connection, callback, query_failed, format...)                \
-    do {                                                                        \
-        char* sql_query = NULL;                                                 \
-        ASSERT_ELSE_PERROR(asprintf(&sql_query, format) > 0);                   \
-        char* err_msg = NULL;                                                   \
-        query_failed = false;                                                   \
-        int retries = 0;                                                        \
-        int rc = !SQLITE_OK;                                                    \
-        do {                                                                    \
-            rc = sqlite3_exec(connection, sql_query, callback, NULL, &err_msg); \
-            retries++;                                                          \
-        } while (rc != SQLITE_OK && retries < 3);                               \
-        if (rc != SQLITE_OK) {                                                  \
-            printf("Query \" %s \" Failed :%s\n", sql_query, err_msg);          \
-            printf("Connection to SQL server lost\n");                          \
-            sqlite3_free(err_msg);                                              \
-            sqlite3_close(connection);                                          \
-            query_failed = true;                                                \
-        }                                                                       \
-        free(sql_query);                                                        \
+#define RUN_QUERY(connection, callback, query_failed, format...)                         \
+    do {                                                                                 \
+        char* sql_query = NULL;                                                          \
+        ASSERT_ELSE_PERROR(asprintf(&sql_query, format) > 0);                            \
+        char* err_msg = NULL;                                                            \
+        query_failed = false;                                                            \
+        int retries = 0;                                                                 \
+        int rc = !SQLITE_OK;                                                             \
+        do {                                                                             \
+            rc = sqlite3_exec(connection, sql_query, callback, NULL, &err_msg);          \
+            retries++;                                                                   \
+        } while (rc != SQLITE_OK && retries < 3);                                        \
+        if (rc != SQLITE_OK) {                                                           \
+            logger_log(LOGGER_ERROR, "Query \" %s \" Failed :%s\n", sql_query, err_msg); \
+            logger_log(LOGGER_ERROR, "Connection to SQL server lost\n");                 \
+            sqlite3_free(err_msg);                                                       \
+            sqlite3_close(connection);                                                   \
+            query_failed = true;                                                         \
+        }                                                                                \
+        free(sql_query);                                                                 \
     } while (false)
 
+#define ROLLUP_TABLE_SCHEMA                                                                              \
+    "CREATE TABLE IF NOT EXISTS " TO_STRING(ROLLUP_TABLE_NAME) " (id INTEGER PRIMARY KEY AUTOINCREMENT," \
+                                                               "sensor_id INT, length INT, "            \
+                                                               "start TIMESTAMP, count INT, "           \
+                                                               "min DECIMAL(4,2), "                     \
+                                                               "average DECIMAL(4,2), "                 \
+                                                               "max DECIMAL(4,2));"
+
 DBCONN* storagemgr_init_connection(bool clear_up_flag) {
     sqlite3* db = NULL;
     int rc = sqlite3_open(TO_STRING(DB_NAME), &db); // rc stands for result code
     if (rc != SQLITE_OK) {
-        printf("Unable to connect to SQL server: %s\n", sqlite3_errmsg(db));
+        logger_log(LOGGER_ERROR, "Unable to connect to SQL server: %s\n", sqlite3_errmsg(db));
         sqlite3_close(db);
         return NULL;
     }
 
-    printf("Connection to SQL server established\n");
+    logger_log(LOGGER_INFO, "Connection to SQL server established\n");
 
     char* query =
         clear_up_flag == 1
@@ -62,10 +73,17 @@ DBCONN* storagemgr_init_connection(bool clear_up_flag) {
     bool query_failed = false;
 
     RUN_QUERY(db, NULL, query_failed, query, NULL);
+    if (!query_failed) {
+        query = clear_up_flag == 1 ? "DROP TABLE IF EXISTS " TO_STRING(ROLLUP_TABLE_NAME) ";" ROLLUP_TABLE_SCHEMA
+                                   : ROLLUP_TABLE_SCHEMA;
+        RUN_QUERY(db, NULL, query_failed, query, NULL);
+    }
 
     assert(db != NULL);
-    query_failed ? printf("A new table couldn't be created\n")
-                 : printf("New table " TO_STRING(TABLE_NAME) " created\n");
+    if (query_failed)
+        logger_log(LOGGER_ERROR, "A new table couldn't be created\n");
+    else
+        logger_log(LOGGER_INFO, "New tables " TO_STRING(TABLE_NAME) " and " TO_STRING(ROLLUP_TABLE_NAME) " created\n");
     return query_failed ? NULL : db;
 }
 
@@ -83,3 +101,14 @@ int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value,
         id, value, ts);
     return query_failed;
 }
+
+int storagemgr_insert_rollup(DBCONN* conn, sensor_id_t id, uint32_t length, sensor_ts_t start, uint32_t count,
+                             sensor_value_t min, sensor_value_t average, sensor_value_t max) {
+    bool query_failed = false;
+    RUN_QUERY(
+        conn, NULL, query_failed,
+        "INSERT INTO " TO_STRING(
+            ROLLUP_TABLE_NAME) "(sensor_id,length,start,count,min,average,max) VALUES (%d,%" PRIu32 ",%ld,%" PRIu32 ",%f,%f,%f);",
+        id, length, start, count, min, average, max);
+    return query_failed;
+}
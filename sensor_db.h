@@ -21,13 +21,17 @@
     #define TABLE_NAME SensorData
 #endif
 
+#ifndef ROLLUP_TABLE_NAME
+    #define ROLLUP_TABLE_NAME SensorRollups
+#endif
+
 #define DBCONN sqlite3
 
 typedef int (*callback_t)(void*, int, char**, char**);
 
 /**
  * Make a connection to the database server
- * Create (open) a database with name DB_NAME having 1 table named TABLE_NAME
+ * Create (open) a database with name DB_NAME having 2 tables: TABLE_NAME for the measurements, ROLLUP_TABLE_NAME for their rollups
  * \param clear_up_flag if the table existed, clear up the existing data when clear_up_flag is set to 1
  * \return the connection for success, NULL if an error occurs
  */
@@ -48,3 +52,18 @@ void storagemgr_disconnect(DBCONN* conn);
  * \return zero for success, and non-zero if an error occurs
  */
 int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Write an INSERT query to insert the summary of the measurements of one sensor in one time window
+ * \param conn pointer to the current connection
+ * \param id the sensor id
+ * \param length the window length in seconds
+ * \param start the timestamp the window starts at
+ * \param count the number of measurements in the window
+ * \param min the lowest measurement value
+ * \param average the average measurement value
+ * \param max the highest measurement value
+ * \return zero for success, and non-zero if an error occurs
+ */
+int storagemgr_insert_rollup(DBCONN* conn, sensor_id_t id, uint32_t length, sensor_ts_t start, uint32_t count,
+                             sensor_value_t min, sensor_value_t average, sensor_value_t max);
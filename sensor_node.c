@@ -4,6 +4,8 @@
 
 #include "config.h"
 #include "lib/tcpsock.h"
+#include "protocol.h"
+#include "shmring.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,11 +52,64 @@
     #define LOG_CLOSE(...) (void) 0
 #endif
 
+// conditional compilation option to choose the wire protocol, see protocol.h
+#ifndef SENSOR_PROTOCOL
+    #define SENSOR_PROTOCOL 2
+#endif
+
+// v2: readings collected into one frame, a node that sleeps between measurements sends each one right away
+#ifndef FRAME_READINGS
+    #define FRAME_READINGS 64
+#endif
+
+// server IP that makes the node write to the shared memory ring of a server on this host instead
+#define LOCAL_SERVER "local"
+
 #define INITIAL_TEMPERATURE 22.5
 #define TEMP_DEV 0.5 // max deviation from previous temp in celsius
 
 void print_help(void);
 
+/**
+ * Sends every byte of the 'count' buffers, one system call for all of them unless it gets cut short; exits if the connection fails
+ */
+void send_all(tcpsock_t* client, struct iovec* buffers, int count) {
+    while (count > 0) {
+        int bytes;
+        if (tcp_send_vec(client, buffers, count, &bytes) != TCP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        // a blocking send may still be cut short by a signal, go on from where it stopped
+        for (; count > 0 && (size_t) bytes >= buffers->iov_len; buffers++, count--)
+            bytes -= buffers->iov_len;
+        if (count > 0) {
+            buffers->iov_base = (char*) buffers->iov_base + bytes;
+            buffers->iov_len -= bytes;
+        }
+    }
+}
+
+#if (SENSOR_PROTOCOL == 2)
+/**
+ * Sends 'count' readings as one v2 frame, exits if the connection fails
+ */
+void send_frame(tcpsock_t* client, const sensor_data_t* readings, uint16_t count) {
+    static char frame[PROTOCOL_FRAME_SIZE(FRAME_READINGS)];
+    struct iovec buffer = {.iov_base = frame, .iov_len = protocol_encode_frame(frame, readings, count)};
+    send_all(client, &buffer, 1);
+}
+#endif
+
+/**
+ * Writes one reading into the shared memory ring, waiting while it is full; exits once the server closed it
+ */
+void write_local(shmring_t* ring, const sensor_data_t* data) {
+    int written;
+    while ((written = shmring_write(ring, data, 1)) == 0)
+        usleep(1000); // the server is behind, or holding this sensor back
+    if (written == SHMRING_CLOSED)
+        exit(EXIT_FAILURE);
+}
+
 double normalized_rand() {
     const double min = -1.0;
     const double max = 1.0;
@@ -70,7 +125,7 @@ double normalized_rand() {
  *
  * argv[1] = sensor ID
  * argv[2] = sleep time
- * argv[3] = server IP
+ * argv[3] = server IP, or "local" for a server on this host
  * argv[4] = server port
  */
 
@@ -78,8 +133,13 @@ int main(int argc, char* argv[]) {
     sensor_data_t data;
     int server_port;
     char server_ip[] = "000.000.000.000";
-    tcpsock_t* client;
-    int i, bytes, sleep_time;
+    tcpsock_t* client = NULL;
+    shmring_t* ring = NULL;
+    int i, sleep_time;
+#if (SENSOR_PROTOCOL == 2)
+    sensor_data_t frame[FRAME_READINGS];
+    uint16_t frame_count = 0;
+#endif
 
     LOG_OPEN();
 
@@ -97,32 +157,58 @@ int main(int argc, char* argv[]) {
     srand48(time(NULL));
     srand(time(NULL));
 
-    // open TCP connection to the server; server is listening to SERVER_IP and PORT
-    if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR)
+    if (strcmp(server_ip, LOCAL_SERVER) == 0) {
+        char name[SHMRING_NAME_SIZE];
+        snprintf(name, sizeof(name), SHMRING_NAME_FORMAT, server_port);
+        ring = shmring_open(name);
+        // without shared memory to map, the server's Unix socket speaks the same protocol as its port
+        snprintf(name, sizeof(name), SHMRING_SOCKET_FORMAT, server_port);
+        if (ring == NULL && tcp_active_open_local(&client, name) != TCP_NO_ERROR)
+            exit(EXIT_FAILURE);
+    } else if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR) {
+        // open TCP connection to the server; server is listening to SERVER_IP and PORT
         exit(EXIT_FAILURE);
+    }
 
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
         data.value = data.value + TEMP_DEV * (normalized_rand() - (data.value - INITIAL_TEMPERATURE) / 100.0);
         time(&data.ts);
-        // send data to server in this order (!!):
-        // <sensor_id><temperature><timestamp> remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void*) &data.id, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void*) &data.value, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void*) &data.ts, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
+        if (ring != NULL) {
+            // the reading goes into the server's memory as it is, there is no wire format
+            write_local(ring, &data);
+        } else {
+#if (SENSOR_PROTOCOL == 2)
+            frame[frame_count++] = data;
+            if (frame_count == FRAME_READINGS || sleep_time > 0) {
+                send_frame(client, frame, frame_count);
+                frame_count = 0;
+            }
+#else
+            // send data to server in this order (!!):
+            // <sensor_id><temperature><timestamp> remark: don't send as a struct!
+            struct iovec fields[] = {
+                {.iov_base = &data.id, .iov_len = sizeof(data.id)},
+                {.iov_base = &data.value, .iov_len = sizeof(data.value)},
+                {.iov_base = &data.ts, .iov_len = sizeof(data.ts)},
+            };
+            send_all(client, fields, sizeof(fields) / sizeof(fields[0]));
+#endif
+        }
         LOG_PRINTF(data.id, data.value, data.ts);
         sleep(sleep_time);
         UPDATE(i);
     }
 
-    if (tcp_close(&client) != TCP_NO_ERROR)
+#if (SENSOR_PROTOCOL == 2)
+    if (frame_count > 0)
+        send_frame(client, frame, frame_count);
+#endif
+
+    if (ring != NULL)
+        shmring_close(ring);
+    else if (tcp_close(&client) != TCP_NO_ERROR)
         exit(EXIT_FAILURE);
 
     LOG_CLOSE();
@@ -137,6 +223,6 @@ void print_help(void) {
     printf("Use this program with 4 command line options: \n");
     printf("\t%-15s : a unique sensor node ID\n", "\'ID\'");
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
-    printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
+    printf("\t%-15s : TCP server IP address, or \"" LOCAL_SERVER "\" for a server on this host\n", "\'server IP\'");
     printf("\t%-15s : TCP server port number\n", "\'server port\'");
 }
@@ -0,0 +1,253 @@
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+
+// tells a mapping of some other shared memory object apart from a ring of this layout
+#define SHMRING_MAGIC 0x53524e47
+
+// the doorbell word
+#define AWAKE 0
+#define SLEEPING 1
+#define WOKEN 2 // by shmring_wake(), the next wait returns right away
+
+_Static_assert((SHMRING_RECORDS & (SHMRING_RECORDS - 1)) == 0, "SHMRING_RECORDS must be a power of two");
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring is shared between processes, its atomics cannot take locks");
+
+// 'sequence' is p + 1 once the reading at position p is written, p + SHMRING_RECORDS once it is taken out or skipped
+typedef struct {
+    _Atomic uint64_t sequence;
+    sensor_data_t data;
+} shmring_slot_t;
+
+// the shared memory itself, every process maps it at its own address so it holds no pointers
+typedef struct {
+    uint32_t magic;
+    uint32_t records;
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t head; // next position a producer claims
+    alignas(CACHE_LINE_SIZE) _Atomic uint32_t doorbell;
+    atomic_bool closed;
+    alignas(CACHE_LINE_SIZE) shmring_slot_t slots[SHMRING_RECORDS];
+} shmring_region_t;
+
+struct shmring {
+    shmring_region_t* region;
+    uint64_t tail;       // consumer: next position to take out, only the consumer needs it
+    int64_t stalled_ms;  // consumer: since when the slot at 'tail' is claimed but empty, -1 if it is not
+    uint64_t abandoned;  // consumer: slots skipped because of that
+    char* name;          // consumer: removed again on close, NULL for a producer
+};
+
+static int64_t monotonic_ms() {
+    struct timespec now;
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// the futex is shared between processes, so unlike sbuffer's it cannot be FUTEX_PRIVATE_FLAG
+static void futex_wait(_Atomic uint32_t* word, uint32_t expected, int timeout_ms) {
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    if (syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &timeout, NULL, 0) != 0)
+        ASSERT_ELSE_PERROR(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+}
+
+static void futex_wake(_Atomic uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static shmring_t* shmring_map(int fd) {
+    shmring_region_t* region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return NULL;
+    shmring_t* ring = malloc(sizeof(*ring));
+    assert(ring != NULL);
+    ring->region = region;
+    ring->tail = 0;
+    ring->stalled_ms = -1;
+    ring->abandoned = 0;
+    ring->name = NULL;
+    return ring;
+}
+
+shmring_t* shmring_create(const char* name) {
+    assert(name);
+    // a ring left behind by a server that crashed may still have producers writing to it
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, sizeof(shmring_region_t)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    shmring_t* ring = shmring_map(fd);
+    if (ring == NULL) {
+        shm_unlink(name);
+        return NULL;
+    }
+    // a new object is zeroed, only the sequence numbers start elsewhere
+    shmring_region_t* region = ring->region;
+    for (uint64_t position = 0; position < SHMRING_RECORDS; position++)
+        atomic_init(&region->slots[position].sequence, position);
+    region->records = SHMRING_RECORDS;
+    // producers check the magic before anything else
+    atomic_thread_fence(memory_order_release);
+    region->magic = SHMRING_MAGIC;
+    ring->name = strdup(name);
+    assert(ring->name != NULL);
+    return ring;
+}
+
+shmring_t* shmring_open(const char* name) {
+    assert(name);
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1)
+        return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size != sizeof(shmring_region_t)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    shmring_t* ring = shmring_map(fd);
+    if (ring == NULL)
+        return NULL;
+    atomic_thread_fence(memory_order_acquire);
+    if (ring->region->magic != SHMRING_MAGIC || ring->region->records != SHMRING_RECORDS) {
+        shmring_close(ring);
+        errno = EPROTO;
+        return NULL;
+    }
+    return ring;
+}
+
+void shmring_close(shmring_t* ring) {
+    if (ring == NULL)
+        return;
+    if (ring->name != NULL) {
+        atomic_store(&ring->region->closed, true);
+        shm_unlink(ring->name);
+        free(ring->name);
+    }
+    munmap(ring->region, sizeof(*ring->region));
+    free(ring);
+}
+
+int shmring_write(shmring_t* ring, const sensor_data_t* readings, int count) {
+    assert(ring && (readings || count == 0));
+    shmring_region_t* region = ring->region;
+    if (atomic_load_explicit(&region->closed, memory_order_relaxed))
+        return SHMRING_CLOSED;
+    int written = 0;
+    uint64_t position = atomic_load_explicit(&region->head, memory_order_relaxed);
+    while (written < count) {
+        shmring_slot_t* slot = &region->slots[position & (SHMRING_RECORDS - 1)];
+        int64_t turn = (int64_t) (atomic_load_explicit(&slot->sequence, memory_order_acquire) - position);
+        if (turn < 0)
+            break; // the consumer has not taken this slot out yet: full
+        if (turn > 0) {
+            // another producer claimed it already
+            position = atomic_load_explicit(&region->head, memory_order_relaxed);
+            continue;
+        }
+        if (!atomic_compare_exchange_weak_explicit(&region->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            continue;
+        // the consumer skips the slot if we take too long, from then on it is not ours anymore
+        uint64_t claimed = position;
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == claimed) {
+            slot->data = readings[written];
+            if (atomic_compare_exchange_strong_explicit(&slot->sequence, &claimed, position + 1, memory_order_release, memory_order_relaxed))
+                written++;
+        }
+        position++;
+    }
+    // pairs with the fence in shmring_wait: either the consumer sees the readings, or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t sleeping = SLEEPING;
+    if (written > 0 && atomic_load_explicit(&region->doorbell, memory_order_relaxed) == SLEEPING
+        && atomic_compare_exchange_strong(&region->doorbell, &sleeping, AWAKE))
+        futex_wake(&region->doorbell);
+    return written;
+}
+
+// whether a producer claimed the slot at 'tail' without filling it yet
+static bool tail_claimed(shmring_t* ring) {
+    return atomic_load_explicit(&ring->region->head, memory_order_relaxed) > ring->tail;
+}
+
+const sensor_data_t* shmring_peek(shmring_t* ring) {
+    assert(ring);
+    while (true) {
+        shmring_slot_t* slot = &ring->region->slots[ring->tail & (SHMRING_RECORDS - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == ring->tail + 1) {
+            ring->stalled_ms = -1;
+            return &slot->data;
+        }
+        if (!tail_claimed(ring))
+            return NULL;
+        int64_t now_ms = monotonic_ms();
+        if (ring->stalled_ms == -1)
+            ring->stalled_ms = now_ms;
+        if (now_ms - ring->stalled_ms < SHMRING_CLAIM_TIMEOUT_MS)
+            return NULL;
+        // its producer is gone, or stopped: hand the slot to the next lap unless it got filled after all
+        uint64_t claimed = ring->tail;
+        if (!atomic_compare_exchange_strong(&slot->sequence, &claimed, ring->tail + SHMRING_RECORDS))
+            continue;
+        ring->tail++;
+        ring->abandoned++;
+        ring->stalled_ms = -1;
+    }
+}
+
+void shmring_consume(shmring_t* ring) {
+    assert(ring);
+    shmring_slot_t* slot = &ring->region->slots[ring->tail & (SHMRING_RECORDS - 1)];
+    atomic_store_explicit(&slot->sequence, ring->tail + SHMRING_RECORDS, memory_order_release);
+    ring->tail++;
+}
+
+void shmring_wait(shmring_t* ring, int timeout_ms) {
+    assert(ring);
+    shmring_region_t* region = ring->region;
+    uint32_t awake = AWAKE;
+    if (atomic_compare_exchange_strong(&region->doorbell, &awake, SLEEPING)) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (shmring_peek(ring) == NULL) {
+            // nobody rings for a slot whose producer died, wake up in time to skip it
+            if (ring->stalled_ms != -1) {
+                int64_t skip_ms = ring->stalled_ms + SHMRING_CLAIM_TIMEOUT_MS - monotonic_ms();
+                if (timeout_ms < 0 || skip_ms < timeout_ms)
+                    timeout_ms = skip_ms > 0 ? (int) skip_ms : 0;
+            }
+            futex_wait(&region->doorbell, SLEEPING, timeout_ms);
+        }
+    }
+    atomic_store(&region->doorbell, AWAKE);
+}
+
+uint64_t shmring_abandoned(const shmring_t* ring) {
+    assert(ring);
+    return ring->abandoned;
+}
+
+void shmring_wake(shmring_t* ring) {
+    assert(ring);
+    atomic_store(&ring->region->doorbell, WOKEN);
+    futex_wake(&ring->region->doorbell);
+}
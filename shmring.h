@@ -0,0 +1,102 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    A ring of readings in named shared memory, for sensors running on the same host as the
+    server: they write sensor_data_t records straight into it instead of going through the
+    network stack. Any number of producer processes may write to a ring, one consumer takes
+    the readings out. Every slot carries a sequence number saying whose turn it is, so a
+    producer claims a slot with a single compare-and-swap and nobody ever takes a lock.
+
+    A consumer that runs out of readings sleeps on a futex in the ring, the doorbell; a
+    producer only makes the wake-up syscall when the consumer announced it is sleeping.
+
+    The consumer takes readings out in order, so a producer killed between claiming a slot
+    and filling it would hold up the ring for good. Once a claimed slot stayed empty for
+    SHMRING_CLAIM_TIMEOUT_MS, the consumer hands it back unread and moves on. Producers fill a
+    slot with a compare-and-swap, so one that was merely stopped that long finds out and
+    writes its reading to a slot further on.
+*/
+
+// readings a ring holds, a power of two
+#ifndef SHMRING_RECORDS
+    #define SHMRING_RECORDS 4096
+#endif
+
+// milliseconds the consumer waits for a claimed slot to be filled before it gives up on the producer
+#ifndef SHMRING_CLAIM_TIMEOUT_MS
+    #define SHMRING_CLAIM_TIMEOUT_MS 1000
+#endif
+
+// name of the ring of the server listening on 'port', formatted with the port number
+#define SHMRING_NAME_FORMAT "/sensor_gateway.%d"
+
+// path of the Unix socket taking the place of the ring for processes that cannot map it
+#define SHMRING_SOCKET_FORMAT "/tmp/sensor_gateway.%d.sock"
+
+// room for either name formatted with any port
+#define SHMRING_NAME_SIZE 64
+
+// returned by shmring_write() once the consumer closed the ring
+#define SHMRING_CLOSED -1
+
+typedef struct shmring shmring_t;
+
+/**
+ * Creates the ring 'name' for a consumer, replacing any ring left behind under that name
+ * \return NULL if the shared memory could not be set up, errno tells why
+ */
+shmring_t* shmring_create(const char* name);
+
+/**
+ * Maps the existing ring 'name' for a producer
+ * \return NULL if there is no such ring or it cannot be mapped, errno tells why
+ */
+shmring_t* shmring_open(const char* name);
+
+/**
+ * Unmaps the ring; when the consumer closes it, producers are told and the name is removed
+ */
+void shmring_close(shmring_t* ring);
+
+/**
+ * Producer: copies up to 'count' readings into the ring and rings the doorbell if needed
+ * \return how many readings fit, fewer than 'count' when the ring is full, or SHMRING_CLOSED
+ */
+int shmring_write(shmring_t* ring, const sensor_data_t* readings, int count);
+
+/**
+ * Consumer: returns the oldest reading in the ring without taking it out, NULL if there is none
+ * Skips the slots producers claimed but did not fill within SHMRING_CLAIM_TIMEOUT_MS
+ */
+const sensor_data_t* shmring_peek(shmring_t* ring);
+
+/**
+ * Consumer: takes out the reading shmring_peek() returned, handing its slot back to the producers
+ */
+void shmring_consume(shmring_t* ring);
+
+/**
+ * Consumer: sleeps until a producer wrote something, or for at most 'timeout_ms' unless that is negative
+ * Returns right away if there is a reading already, and once a claimed slot is due to be skipped
+ */
+void shmring_wait(shmring_t* ring, int timeout_ms);
+
+/**
+ * Consumer: the number of slots skipped because their producer claimed them and never filled them
+ */
+uint64_t shmring_abandoned(const shmring_t* ring);
+
+/**
+ * Wakes the consumer from shmring_wait(), or has its next call return right away, whether there is a reading or not
+ */
+void shmring_wake(shmring_t* ring);
@@ -0,0 +1,373 @@
+/**
+ * Tests of the data manager, built once with the SSE/AVX kernels and once with the scalar ones
+ */
+
+#undef NDEBUG
+
+#include "datamgr.h"
+#include "lib/logger.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SENSORS 7
+#define READINGS 20000
+
+// a fixed pseudo-random sequence, the same on every run
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// readings of 'sensors' sensors in no particular order, some of them outside the thresholds
+static void make_sensor_readings(sensor_data_t* data, size_t count, unsigned sensors) {
+    uint32_t state = 42;
+    for (size_t i = 0; i < count; i++) {
+        data[i].id = 1 + next_random(&state) % sensors;
+        data[i].value = 15 + (next_random(&state) % 15000) / 1000.0;
+        data[i].ts = 1000000 + i;
+    }
+}
+
+static void make_readings(sensor_data_t* data, size_t count) {
+    make_sensor_readings(data, count, SENSORS);
+}
+
+static void assert_same_stats(const datamgr_sensor_stats_t* a, const datamgr_sensor_stats_t* b) {
+    assert(a->count == b->count && a->window == b->window && a->last_modified == b->last_modified);
+    assert(a->average == b->average && a->variance == b->variance && a->ewma == b->ewma);
+    assert(a->min == b->min && a->max == b->max && a->late == b->late);
+}
+
+// batches of any size, with sensors coming up several times in one, end up exactly where the readings one by one do
+static void test_batch_matches_readings(unsigned sensors) {
+    static sensor_data_t data[READINGS];
+    make_sensor_readings(data, READINGS, sensors);
+    datamgr_t* single = datamgr_init();
+    datamgr_t* batched = datamgr_init();
+    for (size_t i = 0; i < READINGS; i++)
+        datamgr_process_reading(single, &data[i]);
+    uint32_t state = 7;
+    for (size_t first = 0; first < READINGS;) {
+        size_t n = 1 + next_random(&state) % 200;
+        if (n > READINGS - first)
+            n = READINGS - first;
+        datamgr_process_batch(batched, &data[first], n);
+        first += n;
+    }
+    for (sensor_id_t id = 1; id <= sensors; id++) {
+        datamgr_sensor_stats_t a, b;
+        assert(datamgr_get_stats(single, id, &a) && datamgr_get_stats(batched, id, &b));
+        assert_same_stats(&a, &b);
+    }
+    datamgr_free(single);
+    datamgr_free(batched);
+}
+
+// the statistics match the ones computed from the last RUN_AVG_LENGTH readings directly
+static void test_window_statistics() {
+    static sensor_data_t data[READINGS];
+    make_readings(data, READINGS);
+    datamgr_t* datamgr = datamgr_init();
+    double window[SENSORS + 1][RUN_AVG_LENGTH];
+    double ewma[SENSORS + 1];
+    uint64_t count[SENSORS + 1] = {0};
+    for (size_t first = 0; first < READINGS; first += 100) {
+        datamgr_process_batch(datamgr, &data[first], 100);
+        for (size_t i = first; i < first + 100; i++) {
+            sensor_id_t id = data[i].id;
+            window[id][count[id] % RUN_AVG_LENGTH] = data[i].value;
+            ewma[id] = count[id] == 0 ? data[i].value : ewma[id] + EWMA_ALPHA * (data[i].value - ewma[id]);
+            count[id]++;
+        }
+        for (sensor_id_t id = 1; id <= SENSORS; id++) {
+            datamgr_sensor_stats_t stats;
+            if (!datamgr_get_stats(datamgr, id, &stats)) {
+                assert(count[id] == 0);
+                continue;
+            }
+            size_t n = count[id] < RUN_AVG_LENGTH ? count[id] : RUN_AVG_LENGTH;
+            double sum = 0, min = INFINITY, max = -INFINITY;
+            for (size_t j = 0; j < n; j++) {
+                sum += window[id][j];
+                min = fmin(min, window[id][j]);
+                max = fmax(max, window[id][j]);
+            }
+            double mean = sum / n;
+            double squares = 0;
+            for (size_t j = 0; j < n; j++)
+                squares += (window[id][j] - mean) * (window[id][j] - mean);
+            assert(stats.count == count[id] && stats.window == n);
+            assert(stats.min == min && stats.max == max);
+            assert(fabs(stats.average - mean) < 1e-9);
+            assert(fabs(stats.variance - squares / n) < 1e-9);
+            assert(fabs(stats.ewma - ewma[id]) < 1e-9);
+        }
+    }
+    datamgr_free(datamgr);
+}
+
+#define DRIFT_READINGS 100003
+
+// after readings far off the rest, the window statistics still match the ones computed directly, however long the run
+static void test_no_drift() {
+    datamgr_t* datamgr = datamgr_init();
+    static sensor_data_t data[DRIFT_READINGS];
+    uint32_t state = 3;
+    for (size_t i = 0; i < DRIFT_READINGS; i++) {
+        double value = i < 100 ? 1e9 + next_random(&state) % 1000 : 20 + (next_random(&state) % 1000) / 1000.0;
+        data[i] = (sensor_data_t){.id = 1, .value = value, .ts = 1000000 + i};
+    }
+    datamgr_process_batch(datamgr, data, DRIFT_READINGS);
+
+    double mean = 0, squares = 0;
+    for (size_t i = DRIFT_READINGS - RUN_AVG_LENGTH; i < DRIFT_READINGS; i++)
+        mean += data[i].value / RUN_AVG_LENGTH;
+    for (size_t i = DRIFT_READINGS - RUN_AVG_LENGTH; i < DRIFT_READINGS; i++)
+        squares += (data[i].value - mean) * (data[i].value - mean);
+    datamgr_sensor_stats_t stats;
+    assert(datamgr_get_stats(datamgr, 1, &stats));
+    assert(fabs(stats.average - mean) < 1e-9);
+    assert(fabs(stats.variance - squares / RUN_AVG_LENGTH) < 1e-9);
+    datamgr_free(datamgr);
+}
+
+#define SNAPSHOT_READINGS 20000 // per sensor
+
+// first seen in this order, which is not the order of the ids
+static const sensor_id_t snapshot_ids[] = {42, 7, 1000, 3, 512, 99, 12};
+#define SNAPSHOT_SENSORS (sizeof(snapshot_ids) / sizeof(*snapshot_ids))
+
+typedef struct {
+    datamgr_t* datamgr;
+    datamgr_sensor_stats_t expected[SNAPSHOT_READINGS + 1]; // the statistics of a sensor after that many readings
+    atomic_bool done;
+    size_t checked;
+} snapshots_t;
+
+// the k-th reading of every sensor is the same, so its statistics only depend on how many it had
+static sensor_data_t snapshot_reading(size_t i) {
+    size_t k = i / SNAPSHOT_SENSORS;
+    uint32_t state = (uint32_t) k;
+    return (sensor_data_t){.id = snapshot_ids[i % SNAPSHOT_SENSORS], .value = 15 + next_random(&state) % 15000 / 1000.0, .ts = 1000000 + k};
+}
+
+static void* process_snapshot_readings(void* arg) {
+    snapshots_t* snapshots = arg;
+    static sensor_data_t data[SNAPSHOT_READINGS * SNAPSHOT_SENSORS];
+    for (size_t i = 0; i < SNAPSHOT_READINGS * SNAPSHOT_SENSORS; i++)
+        data[i] = snapshot_reading(i);
+    uint32_t state = 9;
+    for (size_t first = 0; first < SNAPSHOT_READINGS * SNAPSHOT_SENSORS;) {
+        size_t n = 1 + next_random(&state) % 100;
+        if (n > SNAPSHOT_READINGS * SNAPSHOT_SENSORS - first)
+            n = SNAPSHOT_READINGS * SNAPSHOT_SENSORS - first;
+        datamgr_process_batch(snapshots->datamgr, &data[first], n);
+        first += n;
+    }
+    atomic_store(&snapshots->done, true);
+    return NULL;
+}
+
+// every snapshot is the statistics after some reading, never a mix, and they only move forward
+static void* check_snapshots(void* arg) {
+    snapshots_t* snapshots = arg;
+    uint64_t seen[SNAPSHOT_SENSORS] = {0};
+    bool last = false;
+    while (!last) {
+        last = atomic_load(&snapshots->done);
+        size_t cursor = 0, listed = 0;
+        sensor_id_t id;
+        datamgr_sensor_stats_t stats;
+        while (datamgr_snapshot_next(snapshots->datamgr, &cursor, &id, &stats)) {
+            // in the order the sensors were first seen
+            assert(listed < SNAPSHOT_SENSORS && id == snapshot_ids[listed]);
+            assert(stats.count > 0 && stats.count <= SNAPSHOT_READINGS && stats.count >= seen[listed]);
+            assert_same_stats(&stats, &snapshots->expected[stats.count]);
+            seen[listed++] = stats.count;
+            snapshots->checked++;
+        }
+        if (last)
+            assert(listed == SNAPSHOT_SENSORS);
+    }
+    for (size_t j = 0; j < SNAPSHOT_SENSORS; j++) {
+        datamgr_sensor_stats_t stats;
+        assert(datamgr_snapshot(snapshots->datamgr, snapshot_ids[j], &stats) && stats.count == SNAPSHOT_READINGS);
+    }
+    return NULL;
+}
+
+// another thread taking snapshots while batches are processed never sees statistics half written
+static void test_concurrent_snapshots() {
+    static snapshots_t snapshots;
+    datamgr_t* expected = datamgr_init();
+    for (size_t k = 0; k < SNAPSHOT_READINGS; k++) {
+        sensor_data_t data = snapshot_reading(k * SNAPSHOT_SENSORS);
+        datamgr_process_reading(expected, &data);
+        assert(datamgr_get_stats(expected, data.id, &snapshots.expected[k + 1]));
+    }
+    datamgr_free(expected);
+
+    snapshots.datamgr = datamgr_init();
+    atomic_init(&snapshots.done, false);
+    snapshots.checked = 0;
+    pthread_t processor, checker;
+    assert(pthread_create(&checker, NULL, check_snapshots, &snapshots) == 0);
+    assert(pthread_create(&processor, NULL, process_snapshot_readings, &snapshots) == 0);
+    assert(pthread_join(processor, NULL) == 0);
+    assert(pthread_join(checker, NULL) == 0);
+    assert(snapshots.checked > 0);
+    datamgr_free(snapshots.datamgr);
+}
+
+#define ROLLUP_READINGS 6000
+
+static const sensor_ts_t lengths[] = {ROLLUP_WINDOWS};
+#define LENGTHS (sizeof(lengths) / sizeof(*lengths))
+
+typedef struct {
+    datamgr_rollup_t records[ROLLUP_READINGS * LENGTHS];
+    size_t count;
+    const sensor_data_t* reading; // the reading being processed, NULL while the data manager is freed
+} rollups_t;
+
+static void collect_rollup(const datamgr_rollup_t* rollup, void* arg) {
+    rollups_t* rollups = arg;
+    assert(rollups->count < ROLLUP_READINGS * LENGTHS);
+    // a window is closed by a reading of its own sensor that is ROLLUP_GRACE past its end, or when freeing
+    if (rollups->reading != NULL)
+        assert(rollups->reading->id == rollup->id && rollups->reading->ts >= rollup->start + rollup->length + ROLLUP_GRACE);
+    rollups->records[rollups->count++] = *rollup;
+}
+
+static int compare_rollups(const void* a, const void* b) {
+    const datamgr_rollup_t *x = a, *y = b;
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    if (x->length != y->length)
+        return x->length < y->length ? -1 : 1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// readings that mostly move forward in time, now and then one from up to a few windows back
+static void make_timed_readings(sensor_data_t* data, size_t count) {
+    uint32_t state = 5;
+    sensor_ts_t now = 1000000;
+    for (size_t i = 0; i < count; i++) {
+        now += next_random(&state) % 4;
+        sensor_ts_t back = next_random(&state) % 10 == 0 ? next_random(&state) % 200 : 0;
+        data[i].id = 1 + next_random(&state) % SENSORS;
+        data[i].value = 15 + (next_random(&state) % 15000) / 1000.0;
+        data[i].ts = now - back;
+    }
+}
+
+// the windows handed over hold exactly the readings that were not late for them, each window once
+static void test_rollups() {
+    static sensor_data_t data[ROLLUP_READINGS];
+    static rollups_t single, batched;
+    make_timed_readings(data, ROLLUP_READINGS);
+
+    datamgr_t* datamgr = datamgr_init();
+    datamgr_set_rollup_sink(datamgr, collect_rollup, &single);
+    for (size_t i = 0; i < ROLLUP_READINGS; i++) {
+        single.reading = &data[i];
+        datamgr_process_reading(datamgr, &data[i]);
+    }
+    uint64_t late[SENSORS + 1];
+    for (sensor_id_t id = 1; id <= SENSORS; id++) {
+        datamgr_sensor_stats_t stats;
+        assert(datamgr_get_stats(datamgr, id, &stats));
+        late[id] = stats.late;
+    }
+    size_t closed_early = single.count;
+    single.reading = NULL;
+    datamgr_free(datamgr);
+    assert(closed_early > 0 && single.count > closed_early);
+
+    // work it out again from the readings: a reading is late for a window once its sensor reported a time ROLLUP_GRACE past the window's end
+    sensor_ts_t watermark[SENSORS + 1] = {0};
+    bool included[ROLLUP_READINGS][LENGTHS];
+    uint64_t expected_late[SENSORS + 1] = {0};
+    size_t included_count[LENGTHS] = {0};
+    for (size_t i = 0; i < ROLLUP_READINGS; i++) {
+        sensor_id_t id = data[i].id;
+        if (data[i].ts > watermark[id])
+            watermark[id] = data[i].ts;
+        bool is_late = false;
+        for (size_t l = 0; l < LENGTHS; l++) {
+            sensor_ts_t start = data[i].ts - data[i].ts % lengths[l];
+            included[i][l] = start + lengths[l] + ROLLUP_GRACE > watermark[id];
+            included_count[l] += included[i][l];
+            is_late = is_late || !included[i][l];
+        }
+        expected_late[id] += is_late;
+    }
+    for (sensor_id_t id = 1; id <= SENSORS; id++)
+        assert(late[id] == expected_late[id] && late[id] > 0);
+
+    size_t rolled_up[LENGTHS] = {0};
+    for (size_t r = 0; r < single.count; r++) {
+        const datamgr_rollup_t* rollup = &single.records[r];
+        size_t l = 0;
+        while (lengths[l] != rollup->length)
+            l++;
+        uint32_t count = 0;
+        double sum = 0, min = INFINITY, max = -INFINITY;
+        for (size_t i = 0; i < ROLLUP_READINGS; i++) {
+            if (data[i].id != rollup->id || !included[i][l] || data[i].ts < rollup->start || data[i].ts >= rollup->start + rollup->length)
+                continue;
+            count++;
+            sum += data[i].value;
+            min = fmin(min, data[i].value);
+            max = fmax(max, data[i].value);
+        }
+        assert(rollup->start % rollup->length == 0);
+        assert(rollup->count == count && rollup->min == min && rollup->max == max && rollup->average == sum / count);
+        rolled_up[l] += count;
+    }
+    // no window was handed over twice or left out
+    for (size_t l = 0; l < LENGTHS; l++)
+        assert(rolled_up[l] == included_count[l]);
+
+    // batches interleave the sensors differently, but every sensor ends up with the same windows
+    datamgr = datamgr_init();
+    datamgr_set_rollup_sink(datamgr, collect_rollup, &batched);
+    uint32_t state = 9;
+    for (size_t first = 0; first < ROLLUP_READINGS;) {
+        size_t n = 1 + next_random(&state) % 100;
+        if (n > ROLLUP_READINGS - first)
+            n = ROLLUP_READINGS - first;
+        datamgr_process_batch(datamgr, &data[first], n);
+        first += n;
+    }
+    datamgr_free(datamgr);
+    assert(batched.count == single.count);
+    qsort(single.records, single.count, sizeof(datamgr_rollup_t), compare_rollups);
+    qsort(batched.records, batched.count, sizeof(datamgr_rollup_t), compare_rollups);
+    for (size_t r = 0; r < single.count; r++) {
+        const datamgr_rollup_t *a = &single.records[r], *b = &batched.records[r];
+        assert(compare_rollups(a, b) == 0 && a->count == b->count);
+        assert(a->min == b->min && a->average == b->average && a->max == b->max);
+    }
+}
+
+int main() {
+    // the readings outside the thresholds would log a warning each
+    logger_set_level(LOGGER_ERROR);
+    // from readings spread over many sensors, batched in rounds, to a single sensor, batched one by one
+    test_batch_matches_readings(SENSORS * 4);
+    test_batch_matches_readings(SENSORS);
+    test_batch_matches_readings(1);
+    test_window_statistics();
+    test_no_drift();
+    test_concurrent_snapshots();
+    test_rollups();
+    printf("datamgr tests passed\n");
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * Tests of the block pool with blocks freed by other threads than the ones that allocated them
+ */
+
+#undef NDEBUG
+
+#include "lib/pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BLOCKS 100000
+#define IN_FLIGHT 256 // blocks allocated and not freed yet at most
+#define REUSERS 4
+
+typedef struct {
+    pool_t* pool;
+    _Atomic(uint64_t*) blocks[BLOCKS];
+    _Atomic size_t freed;
+} handover_t;
+
+// allocates every block and hands it over, never getting more than IN_FLIGHT ahead of the freeing thread
+static void* allocate_blocks(void* arg) {
+    handover_t* handover = arg;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        while (i - atomic_load(&handover->freed) >= IN_FLIGHT)
+            sched_yield();
+        uint64_t* block = pool_alloc(handover->pool);
+        assert(block != NULL);
+        block[0] = i;
+        block[1] = ~i;
+        atomic_store(&handover->blocks[i], block);
+    }
+    return NULL;
+}
+
+// frees every block in the order it was handed over, checking nobody else wrote to it meanwhile
+static void* free_blocks(void* arg) {
+    handover_t* handover = arg;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        uint64_t* block;
+        while ((block = atomic_load(&handover->blocks[i])) == NULL)
+            sched_yield();
+        assert(block[0] == i && block[1] == ~i);
+        pool_free(handover->pool, block);
+        atomic_store(&handover->freed, i + 1);
+    }
+    return NULL;
+}
+
+// allocates a slab worth of blocks and frees them again
+static void* allocate_and_free(void* arg) {
+    pool_t* pool = arg;
+    void* blocks[POOL_SLAB_BLOCKS];
+    for (size_t i = 0; i < POOL_SLAB_BLOCKS; i++) {
+        blocks[i] = pool_alloc(pool);
+        assert(blocks[i] != NULL);
+    }
+    for (size_t i = 0; i < POOL_SLAB_BLOCKS; i++)
+        pool_free(pool, blocks[i]);
+    return NULL;
+}
+
+// blocks freed by another thread go back to the allocating one, which takes them rather than the heap
+static void test_remote_frees() {
+    static handover_t handover;
+    handover.pool = pool_create(2 * sizeof(uint64_t));
+    pthread_t allocator, freer;
+    assert(pthread_create(&allocator, NULL, allocate_blocks, &handover) == 0);
+    assert(pthread_create(&freer, NULL, free_blocks, &handover) == 0);
+    assert(pthread_join(allocator, NULL) == 0);
+    assert(pthread_join(freer, NULL) == 0);
+
+    pool_stats_t stats;
+    pool_get_stats(handover.pool, &stats);
+    assert(stats.allocations == BLOCKS && stats.frees == BLOCKS && stats.remote_frees == BLOCKS);
+    assert(stats.in_use == 0);
+    // a new slab only once every block the allocator owns is in flight
+    assert(stats.heap_calls * POOL_SLAB_BLOCKS <= IN_FLIGHT + POOL_SLAB_BLOCKS);
+
+    // threads started after the others exited take over their caches and the blocks freed to them
+    size_t heap_calls = stats.heap_calls;
+    for (size_t i = 0; i < REUSERS; i++) {
+        pthread_t reuser;
+        assert(pthread_create(&reuser, NULL, allocate_and_free, handover.pool) == 0);
+        assert(pthread_join(reuser, NULL) == 0);
+    }
+    pool_get_stats(handover.pool, &stats);
+    assert(stats.heap_calls == heap_calls);
+    assert(stats.allocations == BLOCKS + REUSERS * POOL_SLAB_BLOCKS && stats.frees == stats.allocations);
+    assert(stats.remote_frees == BLOCKS && stats.in_use == 0);
+    pool_destroy(handover.pool);
+}
+
+int main() {
+    test_remote_frees();
+    printf("pool tests passed\n");
+    return 0;
+}
@@ -0,0 +1,161 @@
+/**
+ * Tests of the wire protocol parser, with the bytes arriving in pieces of any size
+ */
+
+#undef NDEBUG
+
+#include "protocol.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define READINGS 5000
+#define MAX_FRAME 40
+
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void make_readings(sensor_data_t* data, size_t count) {
+    uint32_t state = 3;
+    for (size_t i = 0; i < count; i++)
+        data[i] = (sensor_data_t){.id = 1 + next_random(&state) % 1000, .value = next_random(&state) / 1000.0 - 5000, .ts = 1700000000 + i};
+}
+
+/*
+    Hands the parser the bytes received so far, like the connection manager does: whatever it did
+    not consume is handed to it again, together with the next piece of at most 'max_piece' bytes.
+*/
+// returns how many readings came out, they go to 'out'
+static size_t parse_in_pieces(protocol_parser_t* parser, const char* bytes, size_t size, size_t max_piece, sensor_data_t* out) {
+    uint32_t state = (uint32_t) max_piece;
+    size_t parsed = 0, received = 0, count = 0;
+    while (true) {
+        sensor_data_t data;
+        size_t consumed;
+        protocol_result_t result = protocol_parse(parser, bytes + parsed, received - parsed, &data, &consumed);
+        assert(result != PROTOCOL_MALFORMED);
+        assert(consumed <= received - parsed);
+        parsed += consumed;
+        if (result == PROTOCOL_READING) {
+            out[count++] = data;
+            continue;
+        }
+        if (received == size)
+            break;
+        received += 1 + next_random(&state) % max_piece;
+        if (received > size)
+            received = size;
+    }
+    // nothing is left behind once every byte arrived
+    assert(parsed == size);
+    return count;
+}
+
+static void assert_same_readings(const sensor_data_t* a, const sensor_data_t* b, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        assert(a[i].id == b[i].id && a[i].value == b[i].value && a[i].ts == b[i].ts);
+}
+
+// v1 records split anywhere, even inside the first four bytes the version is told from
+static void test_v1_in_pieces() {
+    static sensor_data_t readings[READINGS], out[READINGS];
+    static char bytes[READINGS * PROTOCOL_RECORD_SIZE];
+    make_readings(readings, READINGS);
+    for (size_t i = 0; i < READINGS; i++)
+        protocol_encode_v1(bytes + i * PROTOCOL_RECORD_SIZE, &readings[i]);
+
+    size_t pieces[] = {1, 3, 7, PROTOCOL_RECORD_SIZE, 1000};
+    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+        protocol_parser_t parser;
+        protocol_parser_init(&parser);
+        assert(parse_in_pieces(&parser, bytes, sizeof(bytes), pieces[p], out) == READINGS);
+        assert(parser.version == PROTOCOL_V1);
+        assert_same_readings(readings, out, READINGS);
+    }
+}
+
+// v2 frames of any size, empty ones included, split anywhere in headers and readings
+static void test_v2_in_pieces() {
+    static sensor_data_t readings[READINGS], out[READINGS];
+    static char bytes[READINGS * PROTOCOL_RECORD_SIZE + READINGS * PROTOCOL_HEADER_SIZE];
+    make_readings(readings, READINGS);
+    uint32_t state = 11;
+    size_t size = 0;
+    for (size_t first = 0; first < READINGS;) {
+        size_t count = next_random(&state) % MAX_FRAME;
+        if (count > READINGS - first)
+            count = READINGS - first;
+        size += protocol_encode_frame(bytes + size, &readings[first], (uint16_t) count);
+        first += count;
+    }
+
+    size_t pieces[] = {1, 5, PROTOCOL_HEADER_SIZE + 1, 1000};
+    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+        protocol_parser_t parser;
+        protocol_parser_init(&parser);
+        assert(parse_in_pieces(&parser, bytes, size, pieces[p], out) == READINGS);
+        assert(parser.version == PROTOCOL_V2);
+        assert(parser.frame_left == 0);
+        assert_same_readings(readings, out, READINGS);
+    }
+}
+
+// the version stays open until the first four bytes are in, and a v1 reading may not start like the magic
+static void test_version_detection() {
+    char bytes[PROTOCOL_FRAME_SIZE(1)];
+    sensor_data_t reading = {.id = 65534, .value = 1.5, .ts = 42}, data;
+    size_t consumed;
+    protocol_parser_t parser;
+
+    protocol_encode_frame(bytes, &reading, 1);
+    protocol_parser_init(&parser);
+    assert(protocol_parse(&parser, bytes, PROTOCOL_MAGIC_SIZE - 1, &data, &consumed) == PROTOCOL_NEED_MORE);
+    assert(parser.version == PROTOCOL_UNKNOWN && consumed == 0);
+    // a header without its reading is consumed, the frame is remembered
+    assert(protocol_parse(&parser, bytes, PROTOCOL_HEADER_SIZE + 1, &data, &consumed) == PROTOCOL_NEED_MORE);
+    assert(parser.version == PROTOCOL_V2 && consumed == PROTOCOL_HEADER_SIZE && parser.frame_left == 1);
+    assert(protocol_parse(&parser, bytes + consumed, sizeof(bytes) - consumed, &data, &consumed) == PROTOCOL_READING);
+    assert(consumed == PROTOCOL_RECORD_SIZE && data.id == reading.id && data.value == reading.value && data.ts == reading.ts);
+
+    // sensor id 65534 starts with 0xff 0xfe, so it is read as v1
+    protocol_encode_v1(bytes, &reading);
+    protocol_parser_init(&parser);
+    assert(protocol_parse(&parser, bytes, PROTOCOL_RECORD_SIZE, &data, &consumed) == PROTOCOL_READING);
+    assert(parser.version == PROTOCOL_V1 && consumed == PROTOCOL_RECORD_SIZE && data.id == reading.id);
+}
+
+// a v2 peer sending a header that does not add up gets dropped
+static void test_malformed_headers() {
+    sensor_data_t readings[2] = {{.id = 1, .value = 2, .ts = 3}, {.id = 4, .value = 5, .ts = 6}}, data;
+    char frame[PROTOCOL_FRAME_SIZE(2)];
+    size_t consumed;
+    for (size_t byte = PROTOCOL_MAGIC_SIZE; byte < PROTOCOL_HEADER_SIZE; byte++) {
+        protocol_encode_frame(frame, readings, 2);
+        frame[byte] ^= 0x10;
+        protocol_parser_t parser;
+        protocol_parser_init(&parser);
+        assert(protocol_parse(&parser, frame, sizeof(frame), &data, &consumed) == PROTOCOL_MALFORMED);
+    }
+
+    // a broken second header is only noticed once the first frame is parsed
+    char frames[2 * PROTOCOL_FRAME_SIZE(1)];
+    protocol_encode_frame(frames, readings, 1);
+    protocol_encode_frame(frames + PROTOCOL_FRAME_SIZE(1), readings, 1);
+    frames[PROTOCOL_FRAME_SIZE(1) + 4] = 3;
+    protocol_parser_t parser;
+    protocol_parser_init(&parser);
+    assert(protocol_parse(&parser, frames, sizeof(frames), &data, &consumed) == PROTOCOL_READING);
+    assert(protocol_parse(&parser, frames + consumed, sizeof(frames) - consumed, &data, &consumed) == PROTOCOL_MALFORMED);
+}
+
+int main() {
+    test_v1_in_pieces();
+    test_v2_in_pieces();
+    test_version_detection();
+    test_malformed_headers();
+    printf("protocol tests passed\n");
+    return 0;
+}
@@ -0,0 +1,437 @@
+/**
+ * Tests of the shared buffer, built once with locks and once with SBUFFER_LOCKFREE
+ */
+
+#undef NDEBUG
+
+#include "config.h"
+#include "sbuffer.h"
+
+#include <assert.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    sbuffer_t* buffer;
+    size_t count;
+    int result;
+} producer_t;
+
+static sensor_data_t reading(size_t i) {
+    return (sensor_data_t){.id = i % 100, .value = i, .ts = i};
+}
+
+static void* produce(void* arg) {
+    producer_t* producer = arg;
+    sensor_data_t data[producer->count];
+    for (size_t i = 0; i < producer->count; i++)
+        data[i] = reading(i);
+    producer->result = sbuffer_insert_batch(producer->buffer, data, producer->count);
+    return NULL;
+}
+
+// closing the buffer releases a producer waiting for space, and readers still get everything inserted before
+static void test_close_while_producer_blocked() {
+    sbuffer_t* buffer = sbuffer_create_bounded(4, SBUFFER_OVERLOAD_BLOCK);
+    sbuffer_reader_t* reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL);
+    producer_t producer = {.buffer = buffer, .count = 10};
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, produce, &producer) == 0);
+
+    // let the producer fill the ring and block
+    sbuffer_stats_t stats;
+    do {
+        usleep(1000);
+        sbuffer_get_stats(buffer, &stats);
+    } while (stats.inserted < 4);
+    usleep(20000);
+    sbuffer_close(buffer);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(producer.result == SBUFFER_FAILURE);
+
+    sensor_data_t out[16];
+    int n = sbuffer_remove_batch(reader, out, 16, 0);
+    assert(n == 4);
+    for (int i = 0; i < n; i++)
+        assert(out[i].ts == i);
+    assert(sbuffer_remove_batch(reader, out, 16, 0) == SBUFFER_FAILURE);
+    assert(sbuffer_is_empty(buffer));
+
+    sbuffer_unsubscribe(reader);
+    sbuffer_destroy(buffer);
+}
+
+// a producer blocked in the middle of a batch carries on with the rest once the reader makes room
+static void test_blocked_batch_resumes() {
+    sbuffer_t* buffer = sbuffer_create_bounded(4, SBUFFER_OVERLOAD_BLOCK);
+    sbuffer_reader_t* reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL);
+    producer_t producer = {.buffer = buffer, .count = 1000};
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, produce, &producer) == 0);
+
+    sensor_data_t out[3];
+    size_t next = 0;
+    while (next < producer.count) {
+        int n = sbuffer_remove_batch(reader, out, 3, -1);
+        assert(n > 0);
+        for (int i = 0; i < n; i++)
+            assert(out[i].ts == (sensor_ts_t) next++);
+    }
+    assert(pthread_join(thread, NULL) == 0);
+    assert(producer.result == SBUFFER_SUCCESS);
+    assert(sbuffer_is_empty(buffer));
+
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted == producer.count && stats.dropped == 0);
+
+    sbuffer_close(buffer);
+    sbuffer_unsubscribe(reader);
+    sbuffer_destroy(buffer);
+}
+
+#define LAP_PRODUCERS 6
+#define LAP_READINGS 200000
+
+// every reading carries its producer and its number, so a torn copy shows
+static void* produce_tagged(void* arg) {
+    producer_t* producer = arg;
+    sensor_id_t id = producer->count;
+    sensor_data_t data[8];
+    for (size_t i = 0; i < LAP_READINGS;) {
+        size_t n = 1 + i % 8;
+        if (n > LAP_READINGS - i)
+            n = LAP_READINGS - i;
+        for (size_t j = 0; j < n; j++, i++)
+            data[j] = (sensor_data_t){.id = id, .value = 2.0 * i + id, .ts = i};
+        producer->result = sbuffer_insert_batch(producer->buffer, data, n);
+        assert(producer->result == SBUFFER_SUCCESS);
+    }
+    return NULL;
+}
+
+typedef struct {
+    sbuffer_reader_t* reader;
+    size_t removed;
+} consumer_t;
+
+// reads slowly, checking that readings come out whole and in order per producer
+static void* consume_tagged(void* arg) {
+    consumer_t* consumer = arg;
+    long last[LAP_PRODUCERS];
+    for (int i = 0; i < LAP_PRODUCERS; i++)
+        last[i] = -1;
+    sensor_data_t out[16];
+    int n;
+    while ((n = sbuffer_remove_batch(consumer->reader, out, 16, -1)) != SBUFFER_FAILURE) {
+        for (int i = 0; i < n; i++) {
+            assert(out[i].id < LAP_PRODUCERS);
+            assert(out[i].value == 2.0 * out[i].ts + out[i].id);
+            assert(out[i].ts > last[out[i].id]);
+            last[out[i].id] = out[i].ts;
+        }
+        consumer->removed += n;
+        if (consumer->removed % 64 == 0)
+            usleep(10);
+    }
+    return NULL;
+}
+
+// producers overwrite what slow readers did not get to, the readers skip it and account for every reading
+static void test_drop_oldest_laps_slow_readers() {
+    sbuffer_t* buffer = sbuffer_create_bounded(16, SBUFFER_OVERLOAD_DROP_OLDEST);
+    consumer_t consumers[] = {
+        {.reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL)},
+        {.reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_LATEST)},
+    };
+    pthread_t readers[2];
+    for (int i = 0; i < 2; i++)
+        assert(pthread_create(&readers[i], NULL, consume_tagged, &consumers[i]) == 0);
+    producer_t producers[LAP_PRODUCERS];
+    pthread_t threads[LAP_PRODUCERS];
+    for (size_t i = 0; i < LAP_PRODUCERS; i++) {
+        producers[i] = (producer_t){.buffer = buffer, .count = i};
+        assert(pthread_create(&threads[i], NULL, produce_tagged, &producers[i]) == 0);
+    }
+    for (size_t i = 0; i < LAP_PRODUCERS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    sbuffer_close(buffer);
+    for (int i = 0; i < 2; i++)
+        assert(pthread_join(readers[i], NULL) == 0);
+
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted == LAP_PRODUCERS * LAP_READINGS);
+    for (int i = 0; i < 2; i++) {
+        sbuffer_reader_stats_t reader;
+        sbuffer_get_reader_stats(consumers[i].reader, &reader);
+        assert(reader.removed == consumers[i].removed);
+        assert(reader.removed + reader.skipped == stats.inserted);
+        // only readers the producers promised everything to count as drops
+        if (i == 0)
+            assert(stats.dropped == reader.skipped);
+        sbuffer_unsubscribe(consumers[i].reader);
+    }
+    sbuffer_destroy(buffer);
+}
+
+#define CHURN_ROUNDS 2000
+
+// subscribes and unsubscribes over and over, reading a little in between
+static void* churn_readers(void* arg) {
+    sbuffer_t* buffer = arg;
+    sensor_data_t out[4];
+    for (size_t i = 0; i < CHURN_ROUNDS; i++) {
+        sbuffer_reader_t* reader = sbuffer_subscribe(buffer, i % 2 ? SBUFFER_DELIVER_ALL : SBUFFER_DELIVER_LATEST);
+        sbuffer_remove_batch(reader, out, 4, 0);
+        sbuffer_unsubscribe(reader);
+    }
+    return NULL;
+}
+
+// readers come and go while producers walk the reader list, the old lists and readers are freed as it happens
+static void test_subscribe_churn() {
+    sbuffer_t* buffer = sbuffer_create_bounded(16, SBUFFER_OVERLOAD_DROP_OLDEST);
+    consumer_t consumer = {.reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_LATEST)};
+    pthread_t reader, churner;
+    assert(pthread_create(&reader, NULL, consume_tagged, &consumer) == 0);
+    assert(pthread_create(&churner, NULL, churn_readers, buffer) == 0);
+    producer_t producers[LAP_PRODUCERS];
+    pthread_t threads[LAP_PRODUCERS];
+    for (size_t i = 0; i < LAP_PRODUCERS; i++) {
+        producers[i] = (producer_t){.buffer = buffer, .count = i};
+        assert(pthread_create(&threads[i], NULL, produce_tagged, &producers[i]) == 0);
+    }
+    assert(pthread_join(churner, NULL) == 0);
+    for (size_t i = 0; i < LAP_PRODUCERS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    sbuffer_close(buffer);
+    assert(pthread_join(reader, NULL) == 0);
+
+    sbuffer_stats_t stats;
+    sbuffer_reader_stats_t reader_stats;
+    sbuffer_get_stats(buffer, &stats);
+    sbuffer_get_reader_stats(consumer.reader, &reader_stats);
+    assert(reader_stats.removed + reader_stats.skipped == stats.inserted);
+    sbuffer_unsubscribe(consumer.reader);
+    sbuffer_destroy(buffer);
+}
+
+#define OVERLOAD_CAPACITY 64
+#define OVERLOAD_READINGS 300
+
+// takes everything the reader has, returns how many readings that was
+static size_t drain(sbuffer_reader_t* reader, sensor_data_t* out, size_t max) {
+    size_t removed = 0;
+    int n;
+    while (removed < max && (n = sbuffer_remove_batch(reader, out + removed, max - removed, 0)) > 0)
+        removed += n;
+    return removed;
+}
+
+// a full ring turns away the newest readings, single ones and the part of a batch that does not fit
+static void test_drop_newest_when_full() {
+    sbuffer_t* buffer = sbuffer_create_bounded(OVERLOAD_CAPACITY, SBUFFER_OVERLOAD_DROP_NEWEST);
+    sbuffer_reader_t* reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL);
+    for (size_t i = 0; i < OVERLOAD_READINGS; i++) {
+        sensor_data_t data = reading(i);
+        assert(sbuffer_insert_batch(buffer, &data, 1) == SBUFFER_SUCCESS);
+    }
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted == OVERLOAD_CAPACITY && stats.dropped == OVERLOAD_READINGS - OVERLOAD_CAPACITY);
+    assert(stats.inserted + stats.dropped == OVERLOAD_READINGS);
+
+    // room for a few, the rest of the batch goes
+    sensor_data_t out[OVERLOAD_CAPACITY];
+    assert(sbuffer_remove_batch(reader, out, 10, 0) == 10);
+    sensor_data_t batch[OVERLOAD_CAPACITY];
+    for (size_t i = 0; i < OVERLOAD_CAPACITY; i++)
+        batch[i] = reading(OVERLOAD_READINGS + i);
+    assert(sbuffer_insert_batch(buffer, batch, OVERLOAD_CAPACITY) == SBUFFER_SUCCESS);
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted == OVERLOAD_CAPACITY + 10);
+    assert(stats.inserted + stats.dropped == OVERLOAD_READINGS + OVERLOAD_CAPACITY);
+
+    // the oldest readings stayed, followed by the first of the batch
+    assert(drain(reader, out, OVERLOAD_CAPACITY) == OVERLOAD_CAPACITY);
+    for (size_t i = 0; i < OVERLOAD_CAPACITY; i++)
+        assert(out[i].ts == (sensor_ts_t) (i < OVERLOAD_CAPACITY - 10 ? 10 + i : OVERLOAD_READINGS + i - (OVERLOAD_CAPACITY - 10)));
+    sbuffer_close(buffer);
+    sbuffer_unsubscribe(reader);
+    sbuffer_destroy(buffer);
+}
+
+// above the high water mark one in SBUFFER_SAMPLE_EVERY readings goes in, until the ring is full
+static void test_sample_above_high_water() {
+    sbuffer_t* buffer = sbuffer_create_bounded(OVERLOAD_CAPACITY, SBUFFER_OVERLOAD_SAMPLE);
+    sbuffer_reader_t* reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL);
+    // what should go in, worked out from the depth of the ring at every reading
+    sensor_ts_t kept[OVERLOAD_READINGS];
+    size_t depth = 0, sampled = 0;
+    for (size_t i = 0; i < OVERLOAD_READINGS; i++) {
+        sensor_data_t data = reading(i);
+        assert(sbuffer_insert_batch(buffer, &data, 1) == SBUFFER_SUCCESS);
+        bool sampling = depth * 100 >= OVERLOAD_CAPACITY * SBUFFER_HIGH_WATER;
+        if ((!sampling || sampled++ % SBUFFER_SAMPLE_EVERY == 0) && depth < OVERLOAD_CAPACITY)
+            kept[depth++] = i;
+    }
+    // the ring sampled its way up to full
+    assert(depth == OVERLOAD_CAPACITY && kept[depth - 1] > OVERLOAD_CAPACITY);
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted == depth && stats.inserted + stats.dropped == OVERLOAD_READINGS);
+
+    sensor_data_t out[OVERLOAD_CAPACITY];
+    assert(drain(reader, out, OVERLOAD_CAPACITY) == depth);
+    for (size_t i = 0; i < depth; i++)
+        assert(out[i].ts == kept[i]);
+
+    // with the reader caught up, everything goes in again
+    sensor_data_t batch[OVERLOAD_CAPACITY / 2];
+    for (size_t i = 0; i < OVERLOAD_CAPACITY / 2; i++)
+        batch[i] = reading(OVERLOAD_READINGS + i);
+    assert(sbuffer_insert_batch(buffer, batch, OVERLOAD_CAPACITY / 2) == SBUFFER_SUCCESS);
+    assert(drain(reader, out, OVERLOAD_CAPACITY) == OVERLOAD_CAPACITY / 2);
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted + stats.dropped == OVERLOAD_READINGS + OVERLOAD_CAPACITY / 2);
+    sbuffer_close(buffer);
+    sbuffer_unsubscribe(reader);
+    sbuffer_destroy(buffer);
+}
+
+#define SPILL_READINGS 100000
+
+// where the buffers spill to, the environment overrides the default like it does for them
+static const char* spill_dir() {
+    const char* dir = getenv("SBUFFER_SPILL_DIR");
+    return dir != NULL && dir[0] != '\0' ? dir : TO_STRING(SBUFFER_SPILL_DIR);
+}
+
+static size_t spill_files() {
+    char pattern[4096];
+    snprintf(pattern, sizeof(pattern), "%s/sbuffer-*.spill", spill_dir());
+    glob_t files;
+    size_t n = glob(pattern, 0, NULL, &files) == 0 ? files.gl_pathc : 0;
+    globfree(&files);
+    return n;
+}
+
+// a stalled reader does not hold the producer back, readings go to disk or, if the spill directory is unusable, get dropped
+static void test_spill_with_stalled_reader() {
+    bool spillable = access(spill_dir(), W_OK) == 0;
+    sbuffer_t* buffer = sbuffer_create_bounded(64, SBUFFER_OVERLOAD_SPILL);
+    sbuffer_reader_t* reader = sbuffer_subscribe(buffer, SBUFFER_DELIVER_ALL);
+    for (size_t i = 0; i < SPILL_READINGS; i++) {
+        sensor_data_t data = reading(i);
+        assert(sbuffer_insert_batch(buffer, &data, 1) == SBUFFER_SUCCESS);
+    }
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    assert(stats.inserted + stats.dropped == SPILL_READINGS);
+    if (spillable)
+        assert(stats.spilled > 0 && stats.dropped == 0);
+    else
+        assert(stats.spilled == 0 && stats.dropped > 0);
+
+    sbuffer_close(buffer);
+    sensor_data_t out[100];
+    size_t removed = 0;
+    sensor_ts_t last = 0;
+    int n;
+    while ((n = sbuffer_remove_batch(reader, out, 100, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            // in order, and complete unless readings were dropped
+            assert(removed == 0 || out[i].ts > last);
+            assert(stats.dropped > 0 || out[i].ts == (sensor_ts_t) removed);
+            last = out[i].ts;
+            removed++;
+        }
+    }
+    assert(removed == stats.inserted);
+    sbuffer_unsubscribe(reader);
+    sbuffer_destroy(buffer);
+    assert(spill_files() == 0);
+}
+
+#define WAITER_BUFFERS 3
+#define WAITER_READINGS 20000
+
+typedef struct {
+    sbuffer_waiter_t* waiter;
+    sbuffer_reader_t* readers[WAITER_BUFFERS];
+    size_t removed;
+} drainer_t;
+
+// drains every buffer and sleeps on the waiter only when all of them are empty, until all are closed
+static void* drain_all(void* arg) {
+    drainer_t* drainer = arg;
+    sensor_data_t out[16];
+    size_t open = WAITER_BUFFERS;
+    while (open > 0) {
+        uint32_t ticket = sbuffer_waiter_prepare(drainer->waiter);
+        bool idle = true;
+        for (size_t b = 0; b < WAITER_BUFFERS; b++) {
+            if (drainer->readers[b] == NULL)
+                continue;
+            int n = sbuffer_remove_batch(drainer->readers[b], out, 16, 0);
+            if (n == SBUFFER_FAILURE) {
+                sbuffer_unsubscribe(drainer->readers[b]);
+                drainer->readers[b] = NULL;
+                open--;
+                continue;
+            }
+            drainer->removed += n;
+            idle = idle && n == 0;
+        }
+        sbuffer_waiter_wait(drainer->waiter, ticket, idle && open > 0 ? -1 : 0);
+    }
+    return NULL;
+}
+
+// one waiter shared by several buffers is woken by a reading in any of them and by each of them closing
+static void test_waiter_wakes_on_any_buffer() {
+    sbuffer_waiter_t* waiter = sbuffer_waiter_create();
+    sbuffer_t* buffers[WAITER_BUFFERS];
+    drainer_t drainer = {.waiter = waiter};
+    for (size_t b = 0; b < WAITER_BUFFERS; b++) {
+        buffers[b] = sbuffer_create_bounded(64, SBUFFER_OVERLOAD_BLOCK);
+        sbuffer_attach_waiter(buffers[b], waiter);
+        drainer.readers[b] = sbuffer_subscribe(buffers[b], SBUFFER_DELIVER_ALL);
+    }
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, drain_all, &drainer) == 0);
+
+    // only the last buffer gets readings, in bursts with pauses the drainer sleeps through
+    for (size_t i = 0; i < WAITER_READINGS; i++) {
+        sensor_data_t data = reading(i);
+        assert(sbuffer_insert_batch(buffers[WAITER_BUFFERS - 1], &data, 1) == SBUFFER_SUCCESS);
+        if (i % 1000 == 0)
+            usleep(1000);
+    }
+    usleep(20000);
+    for (size_t b = 0; b < WAITER_BUFFERS; b++)
+        sbuffer_close(buffers[b]);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(drainer.removed == WAITER_READINGS);
+
+    for (size_t b = 0; b < WAITER_BUFFERS; b++)
+        sbuffer_destroy(buffers[b]);
+    sbuffer_waiter_destroy(waiter);
+}
+
+int main() {
+    test_close_while_producer_blocked();
+    test_blocked_batch_resumes();
+    test_drop_oldest_laps_slow_readers();
+    test_subscribe_churn();
+    test_drop_newest_when_full();
+    test_sample_above_high_water();
+    test_spill_with_stalled_reader();
+    test_waiter_wakes_on_any_buffer();
+    printf("sbuffer tests passed\n");
+    return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * Tests of the timer wheel against a plain list of deadlines
+ */
+
+#undef NDEBUG
+
+#include "lib/timerwheel.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TIMERS 64
+#define STEPS 100000
+
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// the earliest deadline of the armed timers, -1 if there is none
+static time_t earliest(wheel_timer_t* timers) {
+    time_t earliest = -1;
+    for (size_t i = 0; i < TIMERS; i++) {
+        if (timer_wheel_is_armed(&timers[i]) && (earliest == -1 || timers[i].deadline < earliest))
+            earliest = timers[i].deadline;
+    }
+    return earliest;
+}
+
+// arming, disarming and expiring timers in any order, the next deadline is never later than the earliest one
+// and, while that is less than a round of the wheel away, exactly it
+static void test_next_deadline() {
+    timer_wheel_t* wheel = timer_wheel_create(16, 100);
+    wheel_timer_t timers[TIMERS] = {0};
+    time_t now = 100;
+    uint32_t state = 1;
+    for (size_t step = 0; step < STEPS; step++) {
+        wheel_timer_t* timer = &timers[next_random(&state) % TIMERS];
+        switch (next_random(&state) % 4) {
+        case 0:
+        case 1:
+            if (!timer_wheel_is_armed(timer))
+                timer_wheel_add(wheel, timer, now + next_random(&state) % 40);
+            break;
+        case 2:
+            timer_wheel_remove(wheel, timer);
+            break;
+        default:
+            now += next_random(&state) % 3;
+            while ((timer = timer_wheel_expire(wheel, now)) != NULL)
+                assert(timer->deadline <= now);
+        }
+        time_t expected = earliest(timers);
+        time_t next = timer_wheel_next_deadline(wheel);
+        if (expected == -1 || expected < now + 16)
+            assert(next == expected);
+        else
+            assert(next <= expected);
+    }
+    timer_wheel_destroy(wheel);
+}
+
+int main() {
+    test_next_deadline();
+    printf("timer wheel tests passed\n");
+    return 0;
+}